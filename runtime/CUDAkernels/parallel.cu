@@ -368,6 +368,91 @@ KERNEL_DECLARE(gpu_internalMoveSFC2) (int       n_extract,
 }
 
 
+//Process that owns the position, walks the bisection tree of the ORB
+//decomposition (see ddorb.h). Uses the same comparison as DDORB::domain
+static __device__ int orb_domain(const real4 pos, const int4 *nodes)
+{
+  int4 node = nodes[0];
+  while(node.x >= 0)
+  {
+    const float x = node.x == 0 ? pos.x : (node.x == 1 ? pos.y : pos.z);
+    node = nodes[x < __int_as_float(node.y) ? node.z : node.w];
+  }
+  return node.z;
+}
+
+//Check if a particles predicted position is within our ORB domain
+KERNEL_DECLARE(gpu_domainCheckORBAndAssign)(int    n_bodies,
+                                            int4   *orbNodes,
+                                            real4  *Ppos,
+                                            uint2  *validList,    //Valid is 1 if particle is outside domain,
+                                            uint   *idList, int procId
+){
+  CUXTIMER("domainCheckORBAndAssign");
+  uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  uint tid = threadIdx.x;
+  uint id  = bid * blockDim.x + tid;
+
+  if (id >= n_bodies) return;
+
+  const int domain = orb_domain(Ppos[id], orbNodes);
+
+  uint valid = 0;
+  if(domain != procId)
+    valid = domain | ((1) << 31);
+
+  validList[id] = make_uint2(valid, id);
+  idList[id]    = 1;
+}
+
+
+KERNEL_DECLARE(gpu_internalMoveORB) (int       n_extract,
+                                  int       n_bodies,
+                                  int       procId,
+                                  int4     *orbNodes,
+                                  int2       *extractList,
+                                  int       *indexList,
+                                  real4     *Ppos,
+                                  real4     *Pvel,
+                                  real4     *pos,
+                                  real4     *vel,
+                                  real4     *acc0,
+                                  real4     *acc1,
+                                  float2    *time,
+                                  unsigned long long       *body_id,
+                                  uint4     *body_key,
+                                  float *h)
+{
+  CUXTIMER("internalMoveORB");
+  uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  uint tid = threadIdx.x;
+  uint id  = bid * blockDim.x + tid;
+
+  if(id >= n_extract) return;
+
+  int srcIdx     = (n_bodies-n_extract) + id;
+
+  if(orb_domain(Ppos[srcIdx], orbNodes) == procId)
+  {
+    int dstIdx = atomicAdd(indexList, 1);
+    dstIdx     = extractList[dstIdx].y;
+
+    //Move!
+    Ppos[dstIdx] = Ppos[srcIdx];
+    Pvel[dstIdx] = Pvel[srcIdx];
+    pos[dstIdx]  = pos[srcIdx];
+    vel[dstIdx]  = vel[srcIdx];
+    acc0[dstIdx] = acc0[srcIdx];
+    acc1[dstIdx] = acc1[srcIdx];
+    time[dstIdx] = time[srcIdx];
+    body_key[dstIdx] = body_key[srcIdx];
+    body_id[dstIdx]  = body_id[srcIdx];
+    h[dstIdx]     = h[srcIdx];
+  }//if inside
+
+}
+
+
 
 KERNEL_DECLARE(gpu_extractOutOfDomainParticlesAdvancedSFC2)(
                                                        int offset,
@@ -570,6 +655,53 @@ KERNEL_DECLARE(gpu_insertNewParticlesSFC)(int       	 n_extract,
 #endif
 }
 
+//Same as insertNewParticlesSFC, for the minimal migration record. Ppos and Pvel are
+//set to the current state, the predictor replaces them after the insert
+KERNEL_DECLARE(gpu_insertNewParticlesRecord)(int       	 n_extract,
+                                             int       	 n_insert,
+                                             int       	 n_oldbodies,
+                                             int       	 offset,
+                                             real4     	*Ppos,
+                                             real4     	*Pvel,
+                                             real4     	*pos,
+                                             real4     	*vel,
+                                             real4     	*acc0,
+                                             real4     	*acc1,
+                                             float2    	*time,
+                                             unsigned long long        *body_id,
+                                             uint4     	*body_key,
+                                             float     	*h,
+                                             migrationStruct *source)
+{
+  CUXTIMER("insertNewParticlesRecord");
+  uint bid = blockIdx.y * gridDim.x + blockIdx.x;
+  uint tid = threadIdx.x;
+  uint id  = bid * blockDim.x + tid;
+
+  if(id >= n_insert) return;
+
+  //The newly added particles are added at the end of the array
+  int idx = (n_oldbodies-n_extract) + id + offset;
+
+  const migrationStruct &m = source[id];
+  const real4 p = make_float4(m.pos[0], m.pos[1], m.pos[2], m.pos[3]);
+  const real4 v = make_float4(m.vel[0], m.vel[1], m.vel[2], m.vel[3]);
+
+  pos [idx]     = p;
+  vel [idx]     = v;
+  Ppos[idx]     = p;
+  Pvel[idx]     = make_float4(v.x, v.y, v.z, m.h);
+  acc0[idx]     = make_float4(m.acc0[0], m.acc0[1], m.acc0[2], m.acc0[3]);
+  time[idx]     = m.time;
+  body_id[idx]  = m.id;
+  h[idx]        = m.h;
+
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+  body_key[idx] = make_uint4(m.key[0], m.key[1], m.key[2], m.key[3]);
+  acc1[idx]     = make_float4(m.acc1[0], m.acc1[1], m.acc1[2], m.acc1[3]);
+#endif
+}
+
 
 #if 0
 
@@ -0,0 +1,180 @@
+#pragma once
+
+/*
+ * Per peer communication statistics of the parallel phases.
+ *
+ * For every phase and peer we accumulate the bytes and messages send and
+ * received and the time waited. For a receive the wait is the time from the
+ * start of the wait (or receive loop) until the message of that peer arrived,
+ * so late peers stand out. For a send it is the time until the send completed.
+ * Collectives can not be attributed to a peer, they are stored under our own
+ * rank (the diagonal) with their duration as wait time.
+ *
+ * Every 'interval' steps the non-zero entries are appended to the file
+ * <baseName>-<nProcs>-<procId>.cmx, see comm_matrix.cpp for the aggregation:
+ *
+ *   Header {magic, version, procId, nProcs, firstIter, nSteps, nRecords}
+ *   nRecords x Record
+ */
+
+#include "mpi.h"
+#include <vector>
+#include <string>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+struct CommMatrix
+{
+  enum Phase {LET, GRPTREE, EXCHANGE, DOMAIN, NPHASE};
+
+  enum {MAGIC = 0x31584d43, VERSION = 1};  //"CMX1"
+
+  struct Header
+  {
+    int32_t magic, version;
+    int32_t procId, nProcs;
+    int32_t firstIter, nSteps;
+    int32_t nRecords, pad;
+  };
+
+  struct Record
+  {
+    int32_t  peer, phase;
+    uint64_t bytesSend, bytesRecv;
+    uint32_t nSend, nRecv;
+    float    tWait;           //Seconds, summed over the steps
+    float    pad;
+  };
+
+  static const char* phaseName(const int phase)
+  {
+    static const char *names[NPHASE] = {"let", "grptree", "exchange", "domain"};
+    return (phase >= 0 && phase < NPHASE) ? names[phase] : "unknown";
+  }
+
+  const int   procId, nProcs;
+  const int   interval;       //Steps per dump
+  std::string fileName;
+
+  std::vector<Record> entries;  //NPHASE x nProcs
+  int firstIter, nSteps;
+
+  std::vector<double> peerWait; //Work buffer of waitAll
+
+  CommMatrix(const int _procId, const int _nProcs, const int _interval, const char *baseName = "commMatrix") :
+    procId(_procId), nProcs(_nProcs), interval(_interval), entries(NPHASE*_nProcs), firstIter(-1), nSteps(0)
+  {
+    char buff[1024];
+    sprintf(buff, "%s-%d-%d.cmx", baseName, nProcs, procId);
+    fileName = buff;
+    remove(fileName.c_str());
+    reset();
+  }
+
+  ~CommMatrix() { flush(); }
+
+  Record& entry(const int phase, const int peer) { return entries[phase*nProcs + peer]; }
+
+  void send(const int phase, const int peer, const size_t bytes)
+  {
+    Record &r = entry(phase, peer);
+    r.bytesSend += bytes;
+    r.nSend++;
+  }
+
+  void recv(const int phase, const int peer, const size_t bytes)
+  {
+    Record &r = entry(phase, peer);
+    r.bytesRecv += bytes;
+    r.nRecv++;
+  }
+
+  void wait(const int phase, const int peer, const double dt)
+  {
+    entry(phase, peer).tWait += dt;
+  }
+
+  //bytes is our contribution to the collective
+  void collective(const int phase, const size_t bytes, const double dt)
+  {
+    send(phase, procId, bytes);
+    wait(phase, procId, dt);
+  }
+
+  //Adds the per peer wait times as produced by PersistentExchange::waitAll
+  void addWait(const int phase, const std::vector<double> &peerWait)
+  {
+    for(size_t i=0; i < peerWait.size(); i++)
+      if(peerWait[i] > 0) wait(phase, i, peerWait[i]);
+  }
+
+  //MPI_Waitall that records for every peer the time until its last request completed
+  void waitAll(const int phase, const int n, MPI_Request *req, const int *peer)
+  {
+    peerWait.assign(nProcs, 0);
+    const double t0 = MPI_Wtime();
+    for(int i=0; i < n; i++)
+    {
+      int idx = MPI_UNDEFINED;
+      MPI_Waitany(n, req, &idx, MPI_STATUS_IGNORE);
+      if(idx == MPI_UNDEFINED) break;
+      peerWait[peer[idx]] = MPI_Wtime() - t0;
+    }
+    addWait(phase, peerWait);
+  }
+
+  void endStep(const int iter)
+  {
+    if(firstIter < 0) firstIter = iter;
+    nSteps++;
+    if(nSteps >= interval) flush();
+  }
+
+  void reset()
+  {
+    for(int p=0; p < NPHASE; p++)
+      for(int i=0; i < nProcs; i++)
+      {
+        Record &r = entry(p, i);
+        memset(&r, 0, sizeof(Record));
+        r.peer  = i;
+        r.phase = p;
+      }
+    firstIter = -1;
+    nSteps    = 0;
+  }
+
+  //Append the non-zero entries of the current interval to the file
+  void flush()
+  {
+    if(nSteps == 0) return;
+
+    std::vector<Record> records;
+    for(size_t i=0; i < entries.size(); i++)
+      if(entries[i].nSend || entries[i].nRecv || entries[i].tWait > 0)
+        records.push_back(entries[i]);
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    h.magic     = MAGIC;
+    h.version   = VERSION;
+    h.procId    = procId;
+    h.nProcs    = nProcs;
+    h.firstIter = firstIter;
+    h.nSteps    = nSteps;
+    h.nRecords  = records.size();
+
+    FILE *out = fopen(fileName.c_str(), "ab");
+    if(out)
+    {
+      fwrite(&h, sizeof(h), 1, out);
+      if(!records.empty()) fwrite(&records[0], sizeof(Record), records.size(), out);
+      fclose(out);
+    }
+    else
+      fprintf(stderr, "CommMatrix: can not open %s\n", fileName.c_str());
+
+    reset();
+  }
+};
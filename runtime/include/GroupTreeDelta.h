@@ -0,0 +1,266 @@
+#pragma once
+
+/*
+ * Delta encoding of the group tree that every process broadcasts each step
+ * (SmallBoundaryTree in sendCurrentInfoGrpTree).
+ *
+ * Layout of a tree: header {nbody, nnode, cellBeg, cellEnd}, nbody bodies,
+ * nnode sizes, nnode centres, 3*nnode multipoles.
+ *
+ * The sender keeps the tree as the other processes have it ('sent'). As long
+ * as the structure (header and the child/leaf info in size.w) is unchanged
+ * only the bodies and nodes that moved more than tolerance, relative to the
+ * node size, are send. Their new values replace those in 'sent', so the error
+ * of the copy at the receivers stays bounded by the tolerance. Every
+ * refreshRate steps, and when the delta is not much smaller than the tree, the
+ * full tree is send.
+ *
+ * The receivers use the node boxes for the LET opening test and the quick
+ * boundary check, so those have to contain the true boxes. The transmitted
+ * size of a node is therefore grown by twice the tolerance (drift of the
+ * centre and of the size) and the opening radius (centre.w) by the drift of
+ * the centre of mass, in both the full and the delta messages. 'sent' keeps
+ * the values without this margin.
+ *
+ * Delta message: header {-1, nBodyChanged, nNodeChanged, 0}, the indices of
+ * the changed bodies and nodes packed 4 per real4, the bodies and for every
+ * node its size, centre and 3 multipoles.
+ *
+ * Receivers patch their cached copy of the tree of the source. This requires
+ * that every process receives every message, which is the case for the
+ * all-gather of the group trees.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <cmath>
+#include <cfloat>
+#include <assert.h>
+
+struct GroupTreeDelta
+{
+  enum {DELTA = -1};
+
+  const float tolerance;
+  const int   refreshRate;
+
+  std::vector<real4> sent;                   //Our tree as the other processes have it
+  std::vector<real4> message;                //Last encoded message
+  std::vector< std::vector<real4> > remote;  //Cached trees of the other processes
+
+  float lmin;                                //Smallest node size of the last full tree
+
+  //Statistics
+  int nFull, nDelta;
+  int nChanged;                              //Bodies+nodes in the last delta
+
+  GroupTreeDelta(const int nProcs, const float _tolerance, const int _refreshRate) :
+    tolerance(_tolerance), refreshRate(_refreshRate), remote(nProcs), lmin(0), nFull(0), nDelta(0), nChanged(0) {}
+
+  static int   asInt  (const float f) { int   i; memcpy(&i, &f, sizeof(int)); return i; }
+  static float asFloat(const int   i) { float f; memcpy(&f, &i, sizeof(int)); return f; }
+
+  static bool differs(const float a, const float b, const float tol)
+  {
+    return !(fabsf(a - b) <= tol);   //NaN counts as changed
+  }
+
+  //Same number of bodies, nodes, start cells and child/leaf information
+  static bool sameStructure(const std::vector<real4> &a, const std::vector<real4> &b)
+  {
+    if(a.size() != b.size() || a.empty()) return false;
+    if(memcmp(&a[0], &b[0], sizeof(real4)) != 0) return false;
+
+    const int nbody = asInt(a[0].x);
+    const int nnode = asInt(a[0].y);
+    for(int i=0; i < nnode; i++)
+    {
+      if(asInt(a[1 + nbody + i].w) != asInt(b[1 + nbody + i].w)) return false;  //Size: child info
+      if((a[1 + nbody + nnode + i].w <= 0) != (b[1 + nbody + nnode + i].w <= 0)) return false;  //Centre: leaf flag
+    }
+    return true;
+  }
+
+  //Single child leaves do not set their size, only its child info is used
+  static bool hasSize(const real4 &size, const real4 &centre)
+  {
+    return centre.w > 0 || asInt(size.w) == (int)0xFFFFFFFF;
+  }
+
+  //Length that the tolerance of a node is relative to
+  float nodeLength(const real4 &size, const real4 &centre) const
+  {
+    return hasSize(size, centre) ? std::max(size.x, std::max(size.y, size.z)) : lmin;
+  }
+
+  //Bodies are compared with the smallest node that can be opened
+  static float smallestNode(const std::vector<real4> &tree)
+  {
+    const int nbody = asInt(tree[0].x);
+    const int nnode = asInt(tree[0].y);
+    float l = HUGE_VALF;
+    for(int i=0; i < nnode; i++)
+    {
+      const real4 &size = tree[1 + nbody + i];
+      if(tree[1 + nbody + nnode + i].w > 0)
+        l = std::min(l, std::max(size.x, std::max(size.y, size.z)));
+    }
+    return l == HUGE_VALF ? 0 : l;
+  }
+
+  //Margin of a node in the messages: a node is not resend as long as its centre and size
+  //each move less than tol*l, and its centre of mass less than tol*l per component
+  void inflate(real4 &size, real4 &centre) const
+  {
+    const float l = nodeLength(size, centre);
+    if(hasSize(size, centre))
+    {
+      //A few ulps on top so the rounding of the comparisons can not leave a gap
+      size.x += 2*tolerance*l + 4*FLT_EPSILON*(fabsf(centre.x) + size.x);
+      size.y += 2*tolerance*l + 4*FLT_EPSILON*(fabsf(centre.y) + size.y);
+      size.z += 2*tolerance*l + 4*FLT_EPSILON*(fabsf(centre.z) + size.z);
+    }
+    //The squared opening radius may grow by tolerance, the sign marks leaves
+    const float r = sqrtf((1 + tolerance)*fabsf(centre.w)) + sqrtf(3.0f)*tolerance*l;
+    centre.w = copysignf(r*r, centre.w);
+  }
+
+  //Returns the message that replaces the broadcast of tree
+  const std::vector<real4>& encode(const std::vector<real4> &tree, const int iter)
+  {
+    const bool refresh = (refreshRate > 0) && (iter % refreshRate == 0);
+    if(refresh || !sameStructure(tree, sent))
+      return encodeFull(tree);
+
+    const int nbody = asInt(tree[0].x);
+    const int nnode = asInt(tree[0].y);
+    const real4 *bodyNew = &tree[1],                 *bodyOld = &sent[1];
+    const real4 *sizeNew = &tree[1 + nbody],         *sizeOld = &sent[1 + nbody];
+    const real4 *cntrNew = &tree[1 + nbody + nnode], *cntrOld = &sent[1 + nbody + nnode];
+    const real4 *multNew = &tree[1 + nbody + 2*nnode];
+    const real4 *multOld = &sent[1 + nbody + 2*nnode];
+
+    std::vector<int> bodies, nodes;
+    for(int i=0; i < nbody; i++)
+    {
+      const float tol = tolerance*lmin;
+      if(differs(bodyNew[i].x, bodyOld[i].x, tol) || differs(bodyNew[i].y, bodyOld[i].y, tol) ||
+         differs(bodyNew[i].z, bodyOld[i].z, tol) || bodyNew[i].w != bodyOld[i].w)
+        bodies.push_back(i);
+    }
+    for(int i=0; i < nnode; i++)
+    {
+      const float l    = nodeLength(sizeOld[i], cntrOld[i]);
+      const float tol  = tolerance*l;
+      const float mass = multOld[3*i].w;
+      const float tolM = tolerance*fabsf(mass);
+      const float tolQ = tolerance*fabsf(mass)*l*l;
+
+      bool changed = false;
+      changed |= differs(cntrNew[i].x, cntrOld[i].x, tol) || differs(cntrNew[i].y, cntrOld[i].y, tol) ||
+                 differs(cntrNew[i].z, cntrOld[i].z, tol) || differs(cntrNew[i].w, cntrOld[i].w, tolerance*fabsf(cntrOld[i].w));
+      if(hasSize(sizeOld[i], cntrOld[i]))
+        changed |= differs(sizeNew[i].x, sizeOld[i].x, tol) || differs(sizeNew[i].y, sizeOld[i].y, tol) ||
+                   differs(sizeNew[i].z, sizeOld[i].z, tol);
+      changed |= differs(multNew[3*i].x, multOld[3*i].x, tol) || differs(multNew[3*i].y, multOld[3*i].y, tol) ||
+                 differs(multNew[3*i].z, multOld[3*i].z, tol) || differs(multNew[3*i].w, mass, tolM);
+      for(int j=1; j < 3 && !changed; j++)
+        changed |= differs(multNew[3*i+j].x, multOld[3*i+j].x, tolQ) ||
+                   differs(multNew[3*i+j].y, multOld[3*i+j].y, tolQ) ||
+                   differs(multNew[3*i+j].z, multOld[3*i+j].z, tolQ);
+      if(changed) nodes.push_back(i);
+    }
+
+    const int nb = bodies.size(), nn = nodes.size();
+    const int nIdx = (nb + nn + 3) / 4;
+    if(2*(1 + nIdx + nb + 5*nn) > (int)tree.size())
+      return encodeFull(tree);  //Not worth it
+
+    message.resize(1 + nIdx + nb + 5*nn);
+    message[0] = make_float4(asFloat(DELTA), asFloat(nb), asFloat(nn), 0);
+
+    int *idx = (int*)&message[1];
+    memset(idx, 0, nIdx*sizeof(real4));
+    for(int i=0; i < nb; i++) idx[i]      = bodies[i];
+    for(int i=0; i < nn; i++) idx[nb + i] = nodes[i];
+
+    real4 *data = &message[1 + nIdx];
+    for(int i=0; i < nb; i++)
+    {
+      *data++ = bodyNew[bodies[i]];
+      sent[1 + bodies[i]] = bodyNew[bodies[i]];
+    }
+    for(int i=0; i < nn; i++)
+    {
+      const int n = nodes[i];
+      real4 size = sizeNew[n], centre = cntrNew[n];
+      inflate(size, centre);
+      *data++ = size;
+      *data++ = centre;
+      *data++ = multNew[3*n+0];
+      *data++ = multNew[3*n+1];
+      *data++ = multNew[3*n+2];
+      sent[1 + nbody + n]           = sizeNew[n];
+      sent[1 + nbody + nnode + n]   = cntrNew[n];
+      sent[1 + nbody + 2*nnode + 3*n+0] = multNew[3*n+0];
+      sent[1 + nbody + 2*nnode + 3*n+1] = multNew[3*n+1];
+      sent[1 + nbody + 2*nnode + 3*n+2] = multNew[3*n+2];
+    }
+
+    nDelta++;
+    nChanged = nb + nn;
+    return message;
+  }
+
+  const std::vector<real4>& encodeFull(const std::vector<real4> &tree)
+  {
+    sent    = tree;
+    message = tree;
+    if(!tree.empty())
+    {
+      lmin = smallestNode(tree);
+      const int nbody = asInt(tree[0].x);
+      const int nnode = asInt(tree[0].y);
+      for(int i=0; i < nnode; i++)
+        inflate(message[1 + nbody + i], message[1 + nbody + nnode + i]);
+    }
+    nFull++;
+    nChanged = -1;
+    return message;
+  }
+
+  //Apply the message of src, returns the (patched) tree of src
+  const std::vector<real4>& decode(const int src, const real4 *msg, const int count)
+  {
+    std::vector<real4> &tree = remote[src];
+    if(asInt(msg[0].x) != DELTA)
+    {
+      tree.assign(msg, msg + count);
+      return tree;
+    }
+
+    assert(!tree.empty());
+    const int nbody = asInt(tree[0].x);
+    const int nnode = asInt(tree[0].y);
+    const int nb    = asInt(msg[0].y);
+    const int nn    = asInt(msg[0].z);
+    const int nIdx  = (nb + nn + 3) / 4;
+    assert(count == 1 + nIdx + nb + 5*nn);
+
+    const int   *idx  = (const int*)&msg[1];
+    const real4 *data = &msg[1 + nIdx];
+    for(int i=0; i < nb; i++)
+      tree[1 + idx[i]] = *data++;
+    for(int i=0; i < nn; i++)
+    {
+      const int n = idx[nb + i];
+      tree[1 + nbody + n]               = *data++;
+      tree[1 + nbody + nnode + n]       = *data++;
+      tree[1 + nbody + 2*nnode + 3*n+0] = *data++;
+      tree[1 + nbody + 2*nnode + 3*n+1] = *data++;
+      tree[1 + nbody + 2*nnode + 3*n+2] = *data++;
+    }
+    return tree;
+  }
+};
@@ -0,0 +1,281 @@
+#pragma once
+
+/*
+ * Host thread manager.
+ *
+ * Discovers the cores, sockets and SMT siblings that this process is allowed
+ * to run on and divides them over the three host thread roles:
+ *
+ *  - compute : the main thread that drives the GPU (also thread 0 of the LET team)
+ *  - LET     : the OpenMP team used in essential_tree_exchangeV2. Thread 1 of that
+ *              team does the MPI communication, all others build LET structures
+ *  - IO      : the asynchronous snapshot writer thread in main.cpp
+ *  - progress: optional MPI progress thread (MPIProgress.h), takes the last
+ *              LET core if the team keeps at least 3 threads
+ *
+ * The CPU list is taken from sched_getaffinity so cpusets / launcher binding are
+ * honoured. If the launcher did not bind and multiple ranks share a node, the
+ * node is split between the local ranks. OMP_NUM_THREADS (if set) caps the
+ * LET team size, SMT siblings are only used if the requested thread count
+ * exceeds the number of physical cores. When OMP_PROC_BIND, GOMP_CPU_AFFINITY
+ * or KMP_AFFINITY is set we only size the teams and leave the pinning to the
+ * OpenMP runtime.
+ */
+
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+#ifdef USE_MPI
+  #include <mpi.h>
+#endif
+
+struct HostThreads
+{
+  struct HWThread
+  {
+    int cpu;      //OS cpu id
+    int core;     //core id within the socket
+    int socket;   //physical package id
+    int smt;      //index of this hardware thread within its core
+    bool operator<(const HWThread &b) const
+    {
+      if(smt    != b.smt)    return smt    < b.smt;
+      if(socket != b.socket) return socket < b.socket;
+      if(core   != b.core)   return core   < b.core;
+      return cpu < b.cpu;
+    }
+  };
+
+  std::vector<HWThread> hwThreads; //Usable hardware threads, first SMT thread of each core first
+
+  std::vector<int> computeCpus;
+  std::vector<int> letCpus;
+  std::vector<int> ioCpus;
+  std::vector<int> progressCpus;
+
+  int nSockets;
+  int nCores;           //Physical cores in our share
+  int localRank;
+  int ranksPerNode;
+  int nLETThreads;      //Size of the OpenMP team during the LET phase
+  bool useIOThread;
+  bool ioOwnCore;        //False if the IO thread shares a core with LET threads
+  bool useProgressThread;
+  bool progressOwnCore;
+  bool doPin;
+  bool initialized;
+
+  HostThreads() : nSockets(1), nCores(1), localRank(0), ranksPerNode(1),
+                  nLETThreads(1), useIOThread(false), ioOwnCore(false),
+                  useProgressThread(false), progressOwnCore(false), doPin(false), initialized(false) {}
+
+  static HostThreads &instance()
+  {
+    static HostThreads hostThreads;
+    return hostThreads;
+  }
+
+  static int readSysInt(const int cpu, const char *field, const int defVal)
+  {
+    char fileName[256];
+    sprintf(fileName, "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, field);
+    FILE *in = fopen(fileName, "r");
+    if(!in) return defVal;
+    int val = defVal;
+    if(fscanf(in, "%d", &val) != 1) val = defVal;
+    fclose(in);
+    return val;
+  }
+
+  //Collect the cpus we may run on and annotate them with socket/core/smt info
+  void discover()
+  {
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    std::vector<int> allowed;
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) == 0)
+    {
+      for(int i=0; i < CPU_SETSIZE; i++)
+        if(CPU_ISSET(i, &cpuset)) allowed.push_back(i);
+    }
+    if(allowed.empty())
+    {
+      const int nOnline = (int)sysconf(_SC_NPROCESSORS_ONLN);
+      for(int i=0; i < std::max(nOnline, 1); i++) allowed.push_back(i);
+    }
+
+    hwThreads.clear();
+    for(size_t i=0; i < allowed.size(); i++)
+    {
+      HWThread t;
+      t.cpu    = allowed[i];
+      t.socket = readSysInt(t.cpu, "physical_package_id", 0);
+      t.core   = readSysInt(t.cpu, "core_id", t.cpu);
+      t.smt    = 0;
+      for(size_t j=0; j < hwThreads.size(); j++)
+        if(hwThreads[j].socket == t.socket && hwThreads[j].core == t.core) t.smt++;
+      hwThreads.push_back(t);
+    }
+    std::sort(hwThreads.begin(), hwThreads.end());
+
+    nCores = 0; nSockets = 0;
+    std::vector<int> sockets;
+    for(size_t i=0; i < hwThreads.size(); i++)
+    {
+      if(hwThreads[i].smt == 0) nCores++;
+      if(std::find(sockets.begin(), sockets.end(), hwThreads[i].socket) == sockets.end())
+        sockets.push_back(hwThreads[i].socket);
+    }
+    nSockets = (int)sockets.size();
+  }
+
+  //If all local ranks see the full node, give each rank a contiguous slice of cores
+  void splitNodeBetweenRanks(const bool launcherBound)
+  {
+    if(ranksPerNode <= 1 || launcherBound) return;
+
+    //Cores are ordered by (socket, core), so slices stay within a socket when possible
+    std::vector<HWThread> cores, share;
+    for(size_t i=0; i < hwThreads.size(); i++)
+      if(hwThreads[i].smt == 0) cores.push_back(hwThreads[i]);
+
+    const int nPerRank = std::max(1, (int)cores.size() / ranksPerNode);
+    const int beg      = (localRank*nPerRank) % std::max((int)cores.size(), 1);
+    const int end      = std::min(beg + nPerRank, (int)cores.size());
+
+    for(size_t i=0; i < hwThreads.size(); i++)
+      for(int c=beg; c < end; c++)
+        if(hwThreads[i].socket == cores[c].socket && hwThreads[i].core == cores[c].core)
+          share.push_back(hwThreads[i]);
+
+    hwThreads = share;
+    std::sort(hwThreads.begin(), hwThreads.end());
+    nCores = end-beg;
+  }
+
+  //Determine the node layout and assign cpus to the roles.
+  void setup(const bool withIOThread, const int procId, const int nProcs
+#ifdef USE_MPI
+             , const MPI_Comm &comm
+#endif
+             , const bool withProgressThread = false
+             )
+  {
+    useIOThread       = withIOThread;
+    useProgressThread = withProgressThread;
+    discover();
+
+    const int nOnline = (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+    localRank    = 0;
+    ranksPerNode = 1;
+#ifdef USE_MPI
+    if(nProcs > 1)
+    {
+      MPI_Comm nodeComm;
+      MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, procId, MPI_INFO_NULL, &nodeComm);
+      MPI_Comm_rank(nodeComm, &localRank);
+      MPI_Comm_size(nodeComm, &ranksPerNode);
+      MPI_Comm_free(&nodeComm);
+    }
+#endif
+
+    const bool launcherBound = (int)hwThreads.size() < nOnline;
+    splitNodeBetweenRanks(launcherBound);
+
+    doPin = !(getenv("OMP_PROC_BIND") || getenv("GOMP_CPU_AFFINITY") || getenv("KMP_AFFINITY"));
+
+    //Thread budget, by default one thread per physical core
+    int nThreads = nCores;
+    const char *ompEnv = getenv("OMP_NUM_THREADS");
+    if(ompEnv && atoi(ompEnv) > 0) nThreads = std::min(atoi(ompEnv), (int)hwThreads.size());
+    nThreads = std::max(nThreads, 1);
+
+    computeCpus.clear(); letCpus.clear(); ioCpus.clear(); progressCpus.clear();
+
+    //Compute gets the first core, IO the last one (if we have a spare), LET the rest
+    const int nIO = (useIOThread && nThreads > 2) ? 1 : 0;
+    ioOwnCore     = nIO > 0;
+    computeCpus.push_back(hwThreads[0].cpu);
+    for(int i=1; i < nThreads-nIO; i++) letCpus.push_back(hwThreads[i].cpu);
+    if(nIO) ioCpus.push_back(hwThreads[nThreads-1].cpu);
+    else    ioCpus.push_back(hwThreads[(int)hwThreads.size()-1].cpu); //Shares a core
+
+    //The progress thread spins, give it its own core unless the LET team would drop below 3 threads
+    progressOwnCore = useProgressThread && letCpus.size() > 2;
+    if(progressOwnCore)
+    {
+      progressCpus.push_back(letCpus.back());
+      letCpus.pop_back();
+    }
+    else if(useProgressThread)
+      progressCpus.push_back(ioCpus[0]);
+
+    //LET team: thread 0 runs on the compute core, 1 for MPI and at least one builder
+    nLETThreads = std::max(1 + (int)letCpus.size(), 3);
+
+    //The IO thread puts the iterate loop in a nested parallel region
+    if(useIOThread) omp_set_max_active_levels(2);
+
+    omp_set_num_threads(nLETThreads);
+    initialized = true;
+  }
+
+  void print(FILE *out, const int procId) const
+  {
+    fprintf(out, "[INIT]\tProc: %d Host threads: sockets: %d cores: %d hw-threads: %d ranks/node: %d (local %d) "
+                 "LET threads: %d IO thread: %s progress thread: %s pinning: %s\n",
+            procId, nSockets, nCores, (int)hwThreads.size(), ranksPerNode, localRank,
+            nLETThreads, useIOThread ? (ioOwnCore ? "own core" : "shared") : "no",
+            useProgressThread ? (progressOwnCore ? "own core" : "shared") : "no", doPin ? "yes" : "no (OpenMP env)");
+  }
+
+  static void bindToCpu(const int cpu)
+  {
+    static __thread int boundCpu = -1;
+    if(boundCpu == cpu) return;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+    if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) == 0) boundCpu = cpu;
+  }
+
+  //Called by the thread that drives the GPU
+  void bindComputeThread() const
+  {
+    if(doPin && !computeCpus.empty()) bindToCpu(computeCpus[0]);
+  }
+
+  void bindIOThread() const
+  {
+    if(doPin && !ioCpus.empty()) bindToCpu(ioCpus[0]);
+  }
+
+  //Called by every thread at the start of the LET parallel region
+  void bindLETThread(const int tid) const
+  {
+    if(!doPin) return;
+    if(tid == 0 || letCpus.empty()) bindComputeThread();
+    else bindToCpu(letCpus[(tid-1) % letCpus.size()]);
+  }
+
+  //Cpu for the MPI progress thread, -1 if it should not be pinned
+  int getProgressCpu() const
+  {
+    return (doPin && !progressCpus.empty()) ? progressCpus[0] : -1;
+  }
+
+  //Number of threads to use for the LET team. Without setup (e.g. library mode)
+  //fall back to the OpenMP default, the LET code requires at least 3 threads
+  int getLETThreads() const
+  {
+    if(!initialized) return std::max(omp_get_max_threads(), 3);
+    return nLETThreads;
+  }
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+/*
+ * Pool of reusable LET buffers.
+ *
+ * Every step allocates a buffer per LET that we send and per LET that we
+ * receive, with sizes that change only slowly between steps. Instead of going
+ * back to malloc each time, released buffers are kept in free lists per size
+ * class and handed out again. There are four classes per power of two (4 KB,
+ * 5 KB, 6 KB, 7 KB, 8 KB, 10 KB, ...), so a buffer is at most 25% larger than
+ * requested. The free lists are lock-free queues (MPMCQueue.h), so the LET
+ * builders, the communication thread and the MPI progress thread can get and
+ * release buffers concurrently.
+ *
+ * Each free list holds at most 'maxPerClass' buffers and all free lists
+ * together at most 'maxBytes' bytes, a release that does not fit frees the
+ * buffer. The buffers are 16 byte aligned, like malloc.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <vector>
+#include <algorithm>
+#include "MPMCQueue.h"
+
+struct LETBufferPool
+{
+  enum {MIN_SHIFT = 12, SUB_BITS = 2, NSUB = 1 << SUB_BITS, NCLASS = 20*NSUB};   //4 KB .. 3.5 GB
+
+  private:
+
+  //Stored in front of the buffer
+  struct Header
+  {
+    size_t sizeClass;
+    size_t size;
+  };
+
+  std::vector<MPMCQueue<void*>*> freeLists;
+  const size_t                   maxBytes;
+  volatile size_t                pooledBytes;    //Bytes held in the free lists
+
+  public:
+
+  //Statistics
+  unsigned long long nGet, nAlloc;
+
+  LETBufferPool(const int maxPerClass, const size_t maxPooledBytes) :
+    freeLists(NCLASS), maxBytes(maxPooledBytes), pooledBytes(0), nGet(0), nAlloc(0)
+  {
+    for(int i=0; i < NCLASS; i++)
+      freeLists[i] = new MPMCQueue<void*>(maxPerClass);
+  }
+
+  ~LETBufferPool()
+  {
+    for(int i=0; i < NCLASS; i++)
+    {
+      void *p;
+      while(freeLists[i]->pop(p)) free(p);
+      delete freeLists[i];
+    }
+  }
+
+  //Size of class c: (NSUB + c % NSUB) * 2^(MIN_SHIFT - SUB_BITS + c / NSUB)
+  static size_t classSize(const int c)
+  {
+    return (size_t)(NSUB + c % NSUB) << (MIN_SHIFT - SUB_BITS + c / NSUB);
+  }
+
+  //Smallest class that holds 'bytes' bytes
+  static int sizeClass(const size_t bytes)
+  {
+    if(bytes <= classSize(0)) return 0;
+    int octave = 0;
+    while(((size_t)1 << (MIN_SHIFT + octave + 1)) < bytes) octave++;
+    const size_t step = (size_t)1 << (MIN_SHIFT - SUB_BITS + octave);
+    const int    sub  = (int)((bytes - ((size_t)1 << (MIN_SHIFT + octave)) + step - 1) / step);
+    return std::min(octave*NSUB + sub, (int)NCLASS-1);
+  }
+
+  size_t getPooledBytes() const { return pooledBytes; }
+
+  //Returns a buffer of at least 'bytes' bytes
+  void* get(const size_t bytes)
+  {
+    __sync_fetch_and_add(&nGet, 1);
+
+    //Larger than the largest class, not pooled
+    const bool   pooled = bytes <= classSize(NCLASS-1);
+    const int    c      = pooled ? sizeClass(bytes) : (int)NCLASS;
+    const size_t size   = pooled ? classSize(c) : bytes;
+
+    void *p = NULL;
+    if(pooled && freeLists[c]->pop(p))
+    {
+      __sync_fetch_and_sub(&pooledBytes, size);
+    }
+    else
+    {
+      __sync_fetch_and_add(&nAlloc, 1);
+      p = malloc(sizeof(Header) + size);
+      if(p == NULL)
+      {
+        fprintf(stderr, "LETBufferPool: failed to allocate %ld bytes\n", (long)size);
+        ::exit(-1);
+      }
+      ((Header*)p)->sizeClass = c;
+      ((Header*)p)->size      = size;
+    }
+    return (char*)p + sizeof(Header);
+  }
+
+  template<typename T>
+  T* get(const size_t count) { return (T*)get(count*sizeof(T)); }
+
+  void release(void *buffer)
+  {
+    if(buffer == NULL) return;
+    void *p = (char*)buffer - sizeof(Header);
+    const size_t c    = ((Header*)p)->sizeClass;
+    const size_t size = ((Header*)p)->size;
+
+    //Reserve the bytes first so concurrent releases can not overshoot the cap
+    if(c >= NCLASS || __sync_add_and_fetch(&pooledBytes, size) > maxBytes)
+    {
+      if(c < NCLASS) __sync_fetch_and_sub(&pooledBytes, size);
+      free(p);
+      return;
+    }
+    if(!freeLists[c]->push(p))
+    {
+      __sync_fetch_and_sub(&pooledBytes, size);
+      free(p);
+    }
+  }
+};
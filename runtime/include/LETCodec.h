@@ -0,0 +1,343 @@
+#pragma once
+
+/*
+ * Codec for LET buffers.
+ *
+ * A LET buffer is a float4 array with the layout:
+ *   [header {nParticles, nNodes, topBeg, topEnd}]
+ *   [particles: nParticles] [node sizes: nNodes] [node centres: nNodes] [multipoles: 3*nNodes]
+ *
+ * Encoding:
+ *  - bits < 32 (lossy): the positions (particle xyz, node centre xyz and the
+ *    centre of mass in the first multipole) are stored as fixed-point numbers
+ *    relative to the bounding box of the exported data. Node box sizes are
+ *    rounded up and the opening radius (centre.w) is grown by the largest
+ *    displacement of the quantised centre of mass, so the opening tests on
+ *    the receiving side stay conservative. Masses, child info and higher
+ *    multipoles are kept exact. The accepted force error is that of moving
+ *    every particle and centre of mass by at most one quantisation step
+ *    (boxRange / 2^bits) per component; the quadrupoles are not shifted to
+ *    the quantised centre of mass.
+ *  - The 32-bit words are split in 4 byte planes (byte shuffle) and each plane
+ *    is compressed with a static order-0 rANS coder. Planes that do not
+ *    compress are stored raw, planes with a single value as that value.
+ *
+ * bits == 32 is lossless.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+
+struct LETCodec
+{
+  enum { MAGIC = 0x4354454C, PROB_BITS = 12, PROB_SCALE = 1 << PROB_BITS, RANS_L = 1 << 23 };
+  enum { PLANE_RAW = 0, PLANE_RANS = 1, PLANE_CONST = 2 };
+
+  struct Header
+  {
+    uint32_t magic;
+    uint32_t nFloats;     //Number of floats in the decoded buffer, including the LET header
+    int32_t  bits;        //Fixed-point precision, 32 if lossless
+    float    boxLow[3];
+    float    boxRange;
+    float    letHeader[4];
+  };
+
+  //Upper limit of the encoded size for a buffer of nFloats floats
+  static size_t maxEncodedSize(const int nFloats)
+  {
+    return sizeof(Header) + 4*(1 + sizeof(uint32_t) + nFloats);
+  }
+
+  /*************** rANS ***************/
+
+  //Scale the counts so they sum to PROB_SCALE, every used symbol gets at least 1
+  static void normaliseFreqs(const uint32_t count[256], const size_t total, uint32_t freq[256])
+  {
+    int sum = 0, maxSym = 0;
+    for(int s=0; s < 256; s++)
+    {
+      freq[s] = 0;
+      if(count[s] == 0) continue;
+      freq[s] = std::max<uint32_t>(1, (uint32_t)(((uint64_t)count[s] * PROB_SCALE) / total));
+      sum    += freq[s];
+      if(count[s] > count[maxSym]) maxSym = s;
+    }
+    if(sum < PROB_SCALE) freq[maxSym] += PROB_SCALE - sum;
+    while(sum > PROB_SCALE)
+    {
+      int best = 0;
+      for(int s=1; s < 256; s++)
+        if(freq[s] > freq[best]) best = s;
+      const int take = std::min<int>(sum - PROB_SCALE, freq[best] - 1);
+      freq[best] -= take;
+      sum        -= take;
+    }
+  }
+
+  //Encode n bytes into out, returns the number of bytes written or 0 if it
+  //does not fit in maxOut bytes. The frequency table is stored in front of the data
+  static size_t ransEncode(const uint8_t *in, const size_t n, uint8_t *out, const size_t maxOut,
+                           std::vector<uint8_t> &scratch)
+  {
+    const size_t tableSize = 2*256;
+    if(maxOut < tableSize + 4) return 0;
+
+    uint32_t count[256] = {0}, freq[256], cum[257];
+    for(size_t i=0; i < n; i++) count[in[i]]++;
+    normaliseFreqs(count, n, freq);
+
+    cum[0] = 0;
+    for(int s=0; s < 256; s++)
+    {
+      cum[s+1] = cum[s] + freq[s];
+      const uint16_t f = (uint16_t)freq[s];
+      memcpy(&out[2*s], &f, 2);
+    }
+
+    //rANS encodes in reverse order, so fill the scratch buffer from the back
+    const size_t maxData = maxOut - tableSize;
+    scratch.resize(maxData);
+    uint8_t *end = &scratch[0] + maxData;
+    uint8_t *ptr = end;
+
+    uint32_t x = RANS_L;
+    for(size_t i=n; i > 0; i--)
+    {
+      const int      s    = in[i-1];
+      const uint32_t f    = freq[s];
+      const uint32_t xMax = ((RANS_L >> PROB_BITS) << 8) * f;
+      while(x >= xMax)
+      {
+        if(ptr - &scratch[0] <= 4) return 0;
+        *--ptr = (uint8_t)(x & 0xff);
+        x    >>= 8;
+      }
+      x = ((x / f) << PROB_BITS) + (x % f) + cum[s];
+    }
+    ptr -= 4;
+    ptr[0] = (uint8_t)(x >>  0); ptr[1] = (uint8_t)(x >>  8);
+    ptr[2] = (uint8_t)(x >> 16); ptr[3] = (uint8_t)(x >> 24);
+
+    const size_t dataSize = end - ptr;
+    memcpy(&out[tableSize], ptr, dataSize);
+    return tableSize + dataSize;
+  }
+
+  static void ransDecode(const uint8_t *in, uint8_t *out, const size_t n)
+  {
+    uint32_t freq[256], cum[257];
+    std::vector<uint8_t> symbol(PROB_SCALE);
+
+    cum[0] = 0;
+    for(int s=0; s < 256; s++)
+    {
+      uint16_t f;
+      memcpy(&f, &in[2*s], 2);
+      freq[s]  = f;
+      cum[s+1] = cum[s] + freq[s];
+      for(uint32_t j=cum[s]; j < cum[s+1]; j++) symbol[j] = (uint8_t)s;
+    }
+
+    const uint8_t *ptr = in + 2*256;
+    uint32_t x = ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+    ptr += 4;
+
+    for(size_t i=0; i < n; i++)
+    {
+      const uint32_t slot = x & (PROB_SCALE-1);
+      const int      s    = symbol[slot];
+      out[i] = (uint8_t)s;
+      x = freq[s] * (x >> PROB_BITS) + slot - cum[s];
+      while(x < RANS_L) x = (x << 8) | *ptr++;
+    }
+  }
+
+  /*************** Fixed-point positions ***************/
+
+  static uint32_t quantise(const float x, const float low, const float invRange, const uint32_t qMax)
+  {
+    const double q = floor((double)(x - low) * invRange * qMax + 0.5);
+    return (uint32_t)std::min<double>(std::max<double>(q, 0.0), (double)qMax);
+  }
+
+  //Lengths are rounded up, including one unit for the error in the centre. They
+  //are not limited to the box so they may use the full word
+  static uint32_t quantiseUp(const float x, const float invRange, const uint32_t qMax)
+  {
+    const double q = ceil((double)x * invRange * qMax) + 1;
+    return (uint32_t)std::min<double>(std::max<double>(q, 0.0), 4294967295.0);
+  }
+
+  //Calls f(floatIndex, kind) for the floats that are changed in lossy mode,
+  //kind 0 is a position component, kind 1 a box size component
+  template<typename F>
+  static void forEachPosition(const int nPtcl, const int nNodes, F f)
+  {
+    const int ptclBeg   = 4;
+    const int sizeBeg   = ptclBeg + 4*nPtcl;
+    const int centreBeg = sizeBeg + 4*nNodes;
+    const int multiBeg  = centreBeg + 4*nNodes;
+    for(int i=0; i < nPtcl; i++)
+      for(int k=0; k < 3; k++) f(ptclBeg + 4*i + k, 0);
+    for(int i=0; i < nNodes; i++)
+      for(int k=0; k < 3; k++)
+      {
+        f(sizeBeg   + 4*i    + k, 1);
+        f(centreBeg + 4*i    + k, 0);
+        f(multiBeg  + 12*i   + k, 0);
+      }
+  }
+
+  /*************** Buffer codec ***************/
+
+  //Encode a LET buffer. out must hold maxEncodedSize(nFloats) bytes. Returns the encoded size
+  static size_t encode(const float *in, const int nFloats, const int bits, char *out)
+  {
+    int nPtcl, nNodes;
+    memcpy(&nPtcl,  &in[0], sizeof(int));
+    memcpy(&nNodes, &in[1], sizeof(int));
+
+    Header hdr;
+    hdr.magic   = MAGIC;
+    hdr.nFloats = nFloats;
+    hdr.bits    = std::min(std::max(bits, 1), 32);
+    memcpy(hdr.letHeader, in, 4*sizeof(float));
+
+    const int nWords = nFloats - 4;
+    std::vector<uint32_t> words(nWords);
+    if(nWords > 0) memcpy(words.data(), &in[4], nWords*sizeof(uint32_t));
+
+    float low[3] = {0, 0, 0}, high[3] = {0, 0, 0};
+    if(hdr.bits < 32)
+    {
+      bool first = true;
+      forEachPosition(nPtcl, nNodes, [&](const int idx, const int kind)
+      {
+        if(kind != 0) return;
+        const int k = (idx % 4);
+        if(first) { for(int j=0; j < 3; j++) low[j] = high[j] = in[idx - k + j]; first = false; }
+        low [k] = std::min(low [k], in[idx]);
+        high[k] = std::max(high[k], in[idx]);
+      });
+    }
+    const float range = std::max(std::max(high[0]-low[0], high[1]-low[1]), std::max(high[2]-low[2], 1e-30f));
+    for(int j=0; j < 3; j++) hdr.boxLow[j] = low[j];
+    hdr.boxRange = range;
+
+    if(hdr.bits < 32)
+    {
+      const uint32_t qMax     = (1u << hdr.bits) - 1;
+      const float    invRange = 1.0f / range;
+      forEachPosition(nPtcl, nNodes, [&](const int idx, const int kind)
+      {
+        words[idx-4] = (kind == 0) ? quantise(in[idx], low[idx % 4], invRange, qMax)
+                                   : quantiseUp(in[idx], invRange, qMax);
+      });
+
+      //Grow the squared opening radius by the error in the centre of mass, one unit
+      //per component to include the rounding of the decoded float. The sign marks leaves
+      const float comError = sqrtf(3.0f) * range / qMax;
+      const int   wBeg     = 4 + 4*nPtcl + 4*nNodes + 3;
+      for(int i=0; i < nNodes; i++)
+      {
+        const float w = in[wBeg + 4*i];
+        const float r = sqrtf(fabsf(w)) + comError;
+        const float wGrown = copysignf(r*r, w);
+        memcpy(&words[wBeg + 4*i - 4], &wGrown, sizeof(uint32_t));
+      }
+    }
+
+    //Byte shuffle and compress each plane
+    memcpy(out, &hdr, sizeof(Header));
+    size_t outSize = sizeof(Header);
+
+    std::vector<uint8_t> plane(nWords), scratch;
+    for(int b=0; b < 4; b++)
+    {
+      for(int i=0; i < nWords; i++) plane[i] = (uint8_t)(words[i] >> (8*b));
+
+      uint8_t  *mode  = (uint8_t*)&out[outSize];
+      uint32_t  size  = 0;
+      uint8_t  *data  = (uint8_t*)&out[outSize + 1 + sizeof(uint32_t)];
+
+      bool constant = true;
+      for(int i=1; i < nWords && constant; i++) constant = plane[i] == plane[0];
+
+      if(constant)
+      {
+        *mode   = PLANE_CONST;
+        data[0] = nWords ? plane[0] : 0;
+        size    = 1;
+      }
+      else
+      {
+        size  = (uint32_t)ransEncode(&plane[0], nWords, data, nWords, scratch);
+        *mode = PLANE_RANS;
+        if(size == 0)
+        {
+          *mode = PLANE_RAW;
+          memcpy(data, &plane[0], nWords);
+          size  = nWords;
+        }
+      }
+      memcpy(&out[outSize+1], &size, sizeof(uint32_t));
+      outSize += 1 + sizeof(uint32_t) + size;
+    }
+    return outSize;
+  }
+
+  //Number of floats in the decoded buffer, 0 if this is not an encoded buffer
+  static int decodedSize(const char *in)
+  {
+    Header hdr;
+    memcpy(&hdr, in, sizeof(Header));
+    return hdr.magic == (uint32_t)MAGIC ? (int)hdr.nFloats : 0;
+  }
+
+  //Decode into out, which must hold decodedSize(in) floats
+  static void decode(const char *in, float *out)
+  {
+    Header hdr;
+    memcpy(&hdr, in, sizeof(Header));
+    memcpy(out, hdr.letHeader, 4*sizeof(float));
+
+    const int nWords = hdr.nFloats - 4;
+    std::vector<uint32_t> words(nWords, 0);
+    std::vector<uint8_t>  plane(nWords);
+
+    size_t offset = sizeof(Header);
+    for(int b=0; b < 4; b++)
+    {
+      const uint8_t mode = (uint8_t)in[offset];
+      uint32_t size;
+      memcpy(&size, &in[offset+1], sizeof(uint32_t));
+      const uint8_t *data = (const uint8_t*)&in[offset + 1 + sizeof(uint32_t)];
+
+      if(mode == PLANE_CONST)     std::fill(plane.begin(), plane.end(), data[0]);
+      else if(mode == PLANE_RAW)  memcpy(&plane[0], data, nWords);
+      else                        ransDecode(data, &plane[0], nWords);
+
+      for(int i=0; i < nWords; i++) words[i] |= (uint32_t)plane[i] << (8*b);
+      offset += 1 + sizeof(uint32_t) + size;
+    }
+
+    if(nWords > 0) memcpy(&out[4], words.data(), nWords*sizeof(uint32_t));
+
+    if(hdr.bits < 32)
+    {
+      int nPtcl, nNodes;
+      memcpy(&nPtcl,  &hdr.letHeader[0], sizeof(int));
+      memcpy(&nNodes, &hdr.letHeader[1], sizeof(int));
+      const double scale = (double)hdr.boxRange / (double)((1u << hdr.bits) - 1);
+      forEachPosition(nPtcl, nNodes, [&](const int idx, const int kind)
+      {
+        const double q = words[idx-4];
+        out[idx] = (kind == 0) ? (float)(hdr.boxLow[idx % 4] + q*scale) : (float)(q*scale);
+      });
+    }
+  }
+};
@@ -0,0 +1,144 @@
+#pragma once
+
+/*
+ * Decides when the domain boundaries are updated and how far they may move.
+ *
+ * The execution time of every step (local, maximum and average over all
+ * processes) is recorded. At a decision point the imbalance (max-avg)/avg of
+ * the next steps is predicted from a least-squares fit of the recent steps.
+ *
+ * Hysteresis: balancing is switched on when the predicted imbalance exceeds
+ * ON_THRESHOLD and switched off when it drops below OFF_THRESHOLD. While on,
+ * the boundaries are only updated if the time we expect to gain before the
+ * next decisions exceeds the measured cost of the previous update (boundary
+ * search plus particle migration).
+ *
+ * Damping: the boundaries move DAMPING of the way to the balanced position,
+ * this prevents the oscillation caused by over-correcting on noisy timings.
+ *
+ * The inputs are global (reduced) values so every process takes the same
+ * decision.
+ */
+
+#include <algorithm>
+#include <deque>
+
+struct LoadBalanceController
+{
+  enum {HISTORY = 8, WARMUP = 4, HORIZON = 4};
+
+  static constexpr double ON_THRESHOLD  = 0.10;
+  static constexpr double OFF_THRESHOLD = 0.03;
+  static constexpr double DAMPING       = 0.5;
+
+  struct Decision
+  {
+    bool   update;
+    double damping;         //Fraction of the way to the balanced boundaries
+    double imbalance;       //Last measured
+    double predicted;       //Predicted for the coming steps
+    double gain;            //Expected time gained, seconds
+    double cost;            //Cost of the previous update, seconds
+  };
+
+  std::deque<double> tLocal, tMax, tAvg;  //Milliseconds
+  Decision last;            //Result of the most recent decide()
+  bool   balancing;
+  int    nDecisions;
+  int    nUpdates;
+  double updateCost;        //Seconds, max over the processes
+
+  LoadBalanceController() : balancing(true), nDecisions(0), nUpdates(0), updateCost(0)
+  {
+    last.update  = true;
+    last.damping = 1.0;
+  }
+
+  void addSample(const double local, const double max, const double avg)
+  {
+    tLocal.push_back(local);
+    tMax.push_back(max);
+    tAvg.push_back(avg);
+    if(tMax.size() > HISTORY)
+    {
+      tLocal.pop_front();
+      tMax.pop_front();
+      tAvg.pop_front();
+    }
+  }
+
+  //Least-squares line through the samples, evaluated 'ahead' steps after the last one
+  static double extrapolate(const std::deque<double> &y, const double ahead)
+  {
+    const int n = y.size();
+    if(n == 0) return 0;
+    if(n == 1) return y[0];
+
+    double sx = 0, sy = 0, sxx = 0, sxy = 0;
+    for(int i=0; i < n; i++)
+    {
+      sx  += i;
+      sy  += y[i];
+      sxx += (double)i*i;
+      sxy += i*y[i];
+    }
+    const double slope = (n*sxy - sx*sy) / (n*sxx - sx*sx);
+    const double mean  = sy / n;
+    return mean + slope*((n-1) + ahead - sx/n);
+  }
+
+  //Predicted time of this process, used as load-balance weight by the domain decomposition
+  double predictedLocalTime(const int stepsPerDecision) const
+  {
+    if(tLocal.empty()) return 0;
+    return std::max(extrapolate(tLocal, 0.5*stepsPerDecision*HORIZON), 0.5*tLocal.back());
+  }
+
+  //Damping the next decide() will use if it updates
+  double nextDamping() const
+  {
+    return (nDecisions < WARMUP) ? 1.0 : DAMPING;
+  }
+
+  Decision decide(const int stepsPerDecision)
+  {
+    Decision d;
+    d.update    = false;
+    d.damping   = DAMPING;
+    d.imbalance = 0;
+    d.predicted = 0;
+    d.gain      = 0;
+    d.cost      = updateCost;
+
+    if(!tMax.empty() && tAvg.back() > 0)
+    {
+      d.imbalance = (tMax.back() - tAvg.back()) / tAvg.back();
+
+      //Predict halfway the period in which this decision has effect
+      const double ahead   = 0.5*stepsPerDecision*HORIZON;
+      const double predMax = extrapolate(tMax, ahead);
+      const double predAvg = std::max(extrapolate(tAvg, ahead), 1e-6);
+      d.predicted = std::max(0.0, (predMax - predAvg) / predAvg);
+      d.gain      = 1e-3*(predMax - predAvg)*stepsPerDecision*HORIZON;
+    }
+
+    if(nDecisions < WARMUP)
+    {
+      //Create the initial load-balance, move all the way
+      d.update  = true;
+      d.damping = 1.0;
+    }
+    else
+    {
+      if( balancing && d.predicted < OFF_THRESHOLD) balancing = false;
+      if(!balancing && d.predicted > ON_THRESHOLD)  balancing = true;
+
+      d.update = balancing && d.gain > d.cost;
+    }
+
+    nDecisions++;
+    if(d.update) nUpdates++;
+    last = d;
+    return d;
+  }
+};
@@ -0,0 +1,416 @@
+#pragma once
+
+/*
+ * All-to-all algorithms, selected on message size and number of processes.
+ *
+ * PAIRWISE      P-1 rounds of MPI_Sendrecv, the original MPIComm::all2all.
+ * SPARSE        Isend/Irecv for the non-zero messages only. Both sides of a
+ *               pair know the size so pairs agree on skipping, this makes it
+ *               interchangeable with PAIRWISE per process.
+ * BRUCK         log2(P) rounds for fixed size blocks, every round forwards
+ *               half of the blocks. Used for the small (count) exchanges.
+ * HIERARCHICAL  The processes on a node send their data to the node leader,
+ *               the leaders exchange one aggregated message per node pair and
+ *               scatter the result. Reduces the number of messages from P^2 to
+ *               nNodes^2 at the cost of two extra copies.
+ *
+ * All counts and displacements are in elements of elemBytes bytes, data is
+ * send as MPI_BYTE.
+ */
+
+#include "mpi.h"
+#include <vector>
+#include <string.h>
+#include <algorithm>
+
+struct All2all
+{
+  enum Algorithm {AUTO, PAIRWISE, SPARSE, BRUCK, HIERARCHICAL};
+
+  enum {BRUCK_MAX_BYTES  = 256,   //Block size up to which Bruck is used
+        BRUCK_MIN_PROCS  = 64,
+        HIER_MAX_BYTES   = 2048,  //Average message size up to which the hierarchical exchange is used
+        HIER_MIN_PROCS   = 128,
+        TAG              = 31};
+
+  const MPI_Comm &comm;
+  int rank, nProc;
+
+  //Node layout, for the hierarchical exchange
+  MPI_Comm nodeComm;
+  MPI_Comm leaderComm;              //MPI_COMM_NULL on the non-leaders
+  int nodeRank, nodeSize;
+  int nodeId, nNodes;
+  std::vector<int> rankNode;        //Node of every rank
+  std::vector<int> rankLocal;       //Rank within its node
+  std::vector< std::vector<int> > nodeRanks;  //Ranks of every node, increasing
+
+  //Statistics
+  int nCalls[5];
+
+  static const char* name(const Algorithm alg)
+  {
+    static const char *names[] = {"auto", "pairwise", "sparse", "bruck", "hierarchical"};
+    return names[alg];
+  }
+
+  //Collective on _comm. ranksPerNode > 0 emulates nodes of that size, for testing on a single host
+  All2all(const MPI_Comm &_comm, const int ranksPerNode = 0) : comm(_comm), leaderComm(MPI_COMM_NULL)
+  {
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &nProc);
+    memset(nCalls, 0, sizeof(nCalls));
+
+    if(ranksPerNode > 0)
+      MPI_Comm_split(comm, rank / ranksPerNode, rank, &nodeComm);
+    else
+      MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, rank, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_rank(nodeComm, &nodeRank);
+    MPI_Comm_size(nodeComm, &nodeSize);
+
+    MPI_Comm_split(comm, nodeRank == 0 ? 0 : MPI_UNDEFINED, rank, &leaderComm);
+    if(nodeRank == 0)
+    {
+      MPI_Comm_rank(leaderComm, &nodeId);
+      MPI_Comm_size(leaderComm, &nNodes);
+    }
+    MPI_Bcast(&nodeId, 1, MPI_INT, 0, nodeComm);
+    MPI_Bcast(&nNodes, 1, MPI_INT, 0, nodeComm);
+
+    int me[2] = {nodeId, nodeRank};
+    std::vector<int> all(2*nProc);
+    MPI_Allgather(me, 2, MPI_INT, &all[0], 2, MPI_INT, comm);
+
+    rankNode.resize(nProc);
+    rankLocal.resize(nProc);
+    nodeRanks.resize(nNodes);
+    for(int r=0; r < nProc; r++)
+    {
+      rankNode [r] = all[2*r  ];
+      rankLocal[r] = all[2*r+1];
+      nodeRanks[rankNode[r]].push_back(r);  //Ranks are split with key=rank, so this is the local order
+    }
+  }
+
+  ~All2all()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(finalized) return;
+    if(leaderComm != MPI_COMM_NULL) MPI_Comm_free(&leaderComm);
+    MPI_Comm_free(&nodeComm);
+  }
+
+  /*
+   * Fixed size blocks, replacement for MPI_Alltoall(sbuf, blockBytes, MPI_BYTE, ...).
+   * The choice only depends on values that are equal on all processes.
+   */
+  static void alltoall(const void *sbuf, void *rbuf, const int blockBytes, const MPI_Comm &comm,
+                       Algorithm alg = AUTO)
+  {
+    int np;
+    MPI_Comm_size(comm, &np);
+    if(alg == AUTO)
+      alg = (blockBytes <= BRUCK_MAX_BYTES && np >= BRUCK_MIN_PROCS) ? BRUCK : PAIRWISE;
+
+    if(alg == BRUCK)
+      bruck(sbuf, rbuf, blockBytes, comm);
+    else
+      MPI_Alltoall((void*)sbuf, blockBytes, MPI_BYTE, rbuf, blockBytes, MPI_BYTE, comm);
+  }
+
+  static void bruck(const void *sbuf, void *rbuf, const int blockBytes, const MPI_Comm &comm)
+  {
+    int me, np;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &np);
+
+    const char *src = (const char*)sbuf;
+    char       *dst = (char*)rbuf;
+
+    //Rotate so the block for rank me+i is at position i
+    std::vector<char> tmp((size_t)np*blockBytes), pack, unpack;
+    for(int i=0; i < np; i++)
+      memcpy(&tmp[(size_t)i*blockBytes], &src[(size_t)((me+i) % np)*blockBytes], blockBytes);
+
+    //Round k forwards the blocks with bit k set in their position over distance 2^k
+    for(int k=1; k < np; k <<= 1)
+    {
+      int nBlocks = 0;
+      for(int i=k; i < np; i++)
+        if(i & k) nBlocks++;
+      pack.resize((size_t)nBlocks*blockBytes);
+      unpack.resize((size_t)nBlocks*blockBytes);
+
+      int b = 0;
+      for(int i=k; i < np; i++)
+        if(i & k) memcpy(&pack[(size_t)(b++)*blockBytes], &tmp[(size_t)i*blockBytes], blockBytes);
+
+      MPI_Sendrecv(&pack[0],   nBlocks*blockBytes, MPI_BYTE, (me + k) % np,      TAG,
+                   &unpack[0], nBlocks*blockBytes, MPI_BYTE, (me - k + np) % np, TAG,
+                   comm, MPI_STATUS_IGNORE);
+
+      b = 0;
+      for(int i=k; i < np; i++)
+        if(i & k) memcpy(&tmp[(size_t)i*blockBytes], &unpack[(size_t)(b++)*blockBytes], blockBytes);
+    }
+
+    //Position i now holds the block from rank me-i
+    for(int i=0; i < np; i++)
+      memcpy(&dst[(size_t)((me - i + np) % np)*blockBytes], &tmp[(size_t)i*blockBytes], blockBytes);
+  }
+
+  static void pairwise(const void *sbuf, const int *scounts, const int *sdispls,
+                       void *rbuf, const int *rcounts, const int *rdispls,
+                       const int elemBytes, const MPI_Comm &comm)
+  {
+    int me, np;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &np);
+    for(int dist = 0; dist < np; dist++)
+    {
+      const int src = (np + me - dist) % np;
+      const int dst = (np + me + dist) % np;
+      //Empty messages are skipped, same as in sparse()
+      MPI_Sendrecv((char*)sbuf + (size_t)sdispls[dst]*elemBytes, scounts[dst]*elemBytes, MPI_BYTE,
+                   scounts[dst] > 0 ? dst : MPI_PROC_NULL, TAG,
+                   (char*)rbuf + (size_t)rdispls[src]*elemBytes, rcounts[src]*elemBytes, MPI_BYTE,
+                   rcounts[src] > 0 ? src : MPI_PROC_NULL, TAG,
+                   comm, MPI_STATUS_IGNORE);
+    }
+  }
+
+  static void sparse(const void *sbuf, const int *scounts, const int *sdispls,
+                     void *rbuf, const int *rcounts, const int *rdispls,
+                     const int elemBytes, const MPI_Comm &comm)
+  {
+    int me, np;
+    MPI_Comm_rank(comm, &me);
+    MPI_Comm_size(comm, &np);
+
+    std::vector<MPI_Request> req;
+    req.reserve(64);
+    for(int dist = 1; dist < np; dist++)
+    {
+      const int src = (np + me - dist) % np;
+      if(rcounts[src] == 0) continue;
+      req.push_back(MPI_REQUEST_NULL);
+      MPI_Irecv((char*)rbuf + (size_t)rdispls[src]*elemBytes, rcounts[src]*elemBytes, MPI_BYTE, src, TAG,
+                comm, &req.back());
+    }
+    for(int dist = 1; dist < np; dist++)
+    {
+      const int dst = (np + me + dist) % np;
+      if(scounts[dst] == 0) continue;
+      req.push_back(MPI_REQUEST_NULL);
+      MPI_Isend((char*)sbuf + (size_t)sdispls[dst]*elemBytes, scounts[dst]*elemBytes, MPI_BYTE, dst, TAG,
+                comm, &req.back());
+    }
+    memcpy((char*)rbuf + (size_t)rdispls[me]*elemBytes, (char*)sbuf + (size_t)sdispls[me]*elemBytes,
+           (size_t)scounts[me]*elemBytes);
+    if(!req.empty()) MPI_Waitall(req.size(), &req[0], MPI_STATUSES_IGNORE);
+  }
+
+  //Pairwise or sparse, a local decision. Used on communicators without node layout
+  static void alltoallvLocal(const void *sbuf, const int *scounts, const int *sdispls,
+                             void *rbuf, const int *rcounts, const int *rdispls,
+                             const int elemBytes, const MPI_Comm &comm, Algorithm alg = AUTO)
+  {
+    if(alg == AUTO) alg = selectLocal(scounts, rcounts, comm);
+    if(alg == SPARSE) sparse  (sbuf, scounts, sdispls, rbuf, rcounts, rdispls, elemBytes, comm);
+    else              pairwise(sbuf, scounts, sdispls, rbuf, rcounts, rdispls, elemBytes, comm);
+  }
+
+  static Algorithm selectLocal(const int *scounts, const int *rcounts, const MPI_Comm &comm)
+  {
+    int np;
+    MPI_Comm_size(comm, &np);
+    int nActive = 0;
+    for(int i=0; i < np; i++)
+      nActive += (scounts[i] > 0) + (rcounts[i] > 0);
+    return (4*nActive < 2*np) ? SPARSE : PAIRWISE;   //Less than a quarter of the peers
+  }
+
+  /*
+   * Replacement for MPI_Alltoallv on comm. With AUTO the hierarchical exchange is
+   * chosen (by all processes together) when there are multiple processes per node
+   * and the average message is small.
+   */
+  void alltoallv(const void *sbuf, const int *scounts, const int *sdispls,
+                 void *rbuf, const int *rcounts, const int *rdispls,
+                 const int elemBytes, Algorithm alg = AUTO)
+  {
+    if(alg == AUTO)
+    {
+      alg = selectLocal(scounts, rcounts, comm);
+      if(nProc >= HIER_MIN_PROCS && nNodes > 1 && nNodes < nProc)
+      {
+        double bytes = 0, maxBytes = 0;
+        for(int i=0; i < nProc; i++) bytes += (double)scounts[i]*elemBytes;
+        bytes /= nProc;
+        MPI_Allreduce(&bytes, &maxBytes, 1, MPI_DOUBLE, MPI_MAX, comm);
+        if(maxBytes <= HIER_MAX_BYTES) alg = HIERARCHICAL;
+      }
+    }
+    nCalls[alg]++;
+
+    switch(alg)
+    {
+      case HIERARCHICAL:
+        hierarchical(sbuf, scounts, sdispls, rbuf, rcounts, rdispls, elemBytes);
+        break;
+      case SPARSE:
+        sparse(sbuf, scounts, sdispls, rbuf, rcounts, rdispls, elemBytes, comm);
+        break;
+      default:
+        pairwise(sbuf, scounts, sdispls, rbuf, rcounts, rdispls, elemBytes, comm);
+        break;
+    }
+  }
+
+  void hierarchical(const void *sbuf, const int *scounts, const int *sdispls,
+                    void *rbuf, const int *rcounts, const int *rdispls,
+                    const int elemBytes)
+  {
+    //Pack our messages ordered by destination node, then destination rank
+    std::vector<int> sbytes(nProc);
+    std::vector<char> packed;
+    size_t nPacked = 0;
+    for(int i=0; i < nProc; i++)
+    {
+      sbytes[i] = scounts[i]*elemBytes;
+      nPacked  += sbytes[i];
+    }
+    packed.resize(nPacked + 1);
+    nPacked = 0;
+    for(int m=0; m < nNodes; m++)
+      for(size_t j=0; j < nodeRanks[m].size(); j++)
+      {
+        const int d = nodeRanks[m][j];
+        memcpy(&packed[nPacked], (char*)sbuf + (size_t)sdispls[d]*elemBytes, sbytes[d]);
+        nPacked += sbytes[d];
+      }
+
+    //Gather the sizes and data of the node at the leader
+    std::vector<int> nodeBytes, gatherCnt(nodeSize), gatherDsp(nodeSize+1, 0);
+    if(nodeRank == 0) nodeBytes.resize((size_t)nodeSize*nProc);
+    MPI_Gather(&sbytes[0], nProc, MPI_INT, nodeRank == 0 ? &nodeBytes[0] : NULL, nProc, MPI_INT, 0, nodeComm);
+
+    int nPackedInt = nPacked;
+    MPI_Gather(&nPackedInt, 1, MPI_INT, &gatherCnt[0], 1, MPI_INT, 0, nodeComm);
+    for(int l=0; l < nodeSize; l++) gatherDsp[l+1] = gatherDsp[l] + gatherCnt[l];
+
+    std::vector<char> nodeData(nodeRank == 0 ? gatherDsp[nodeSize] + 1 : 1);
+    MPI_Gatherv(&packed[0], nPackedInt, MPI_BYTE, &nodeData[0], &gatherCnt[0], &gatherDsp[0], MPI_BYTE, 0, nodeComm);
+
+    std::vector<char> scatterData(1);
+    std::vector<int>  scatterCnt(nodeSize), scatterDsp(nodeSize+1, 0);
+    if(nodeRank == 0)
+    {
+      //Per destination node: the sizes (local src x remote dst) followed by the data in the same order
+      std::vector<int> nodeOffset(nodeSize);   //Read position in nodeData of every local src
+      for(int l=0; l < nodeSize; l++) nodeOffset[l] = gatherDsp[l];
+
+      std::vector<int>  hdrCnt(nNodes), hdrDsp(nNodes+1, 0), dataCnt(nNodes, 0), dataDsp(nNodes+1, 0);
+      for(int m=0; m < nNodes; m++)
+      {
+        hdrCnt[m]   = nodeSize*nodeRanks[m].size();
+        hdrDsp[m+1] = hdrDsp[m] + hdrCnt[m];
+      }
+      std::vector<int> hdrSend(hdrDsp[nNodes]);
+      for(int m=0; m < nNodes; m++)
+        for(int l=0; l < nodeSize; l++)
+          for(size_t j=0; j < nodeRanks[m].size(); j++)
+          {
+            const int b = nodeBytes[(size_t)l*nProc + nodeRanks[m][j]];
+            hdrSend[hdrDsp[m] + l*nodeRanks[m].size() + j] = b;
+            dataCnt[m] += b;
+          }
+      for(int m=0; m < nNodes; m++) dataDsp[m+1] = dataDsp[m] + dataCnt[m];
+
+      //Regroup the gathered data: the packed buffer of every local src is ordered by node
+      std::vector<char> dataSend(dataDsp[nNodes] + 1);
+      for(int m=0; m < nNodes; m++)
+      {
+        int pos = dataDsp[m];
+        for(int l=0; l < nodeSize; l++)
+        {
+          int bytes = 0;
+          for(size_t j=0; j < nodeRanks[m].size(); j++)
+            bytes += nodeBytes[(size_t)l*nProc + nodeRanks[m][j]];
+          memcpy(&dataSend[pos], &nodeData[nodeOffset[l]], bytes);
+          nodeOffset[l] += bytes;
+          pos           += bytes;
+        }
+      }
+
+      //Exchange between the leaders
+      std::vector<int> hdrRecvCnt(nNodes), hdrRecvDsp(nNodes+1, 0);
+      for(int m=0; m < nNodes; m++)
+      {
+        hdrRecvCnt[m]   = nodeRanks[m].size()*nodeSize;
+        hdrRecvDsp[m+1] = hdrRecvDsp[m] + hdrRecvCnt[m];
+      }
+      std::vector<int> hdrRecv(hdrRecvDsp[nNodes]);
+      MPI_Alltoallv(&hdrSend[0], &hdrCnt[0], &hdrDsp[0], MPI_INT,
+                    &hdrRecv[0], &hdrRecvCnt[0], &hdrRecvDsp[0], MPI_INT, leaderComm);
+
+      std::vector<int> dataRecvCnt(nNodes, 0), dataRecvDsp(nNodes+1, 0);
+      for(int m=0; m < nNodes; m++)
+      {
+        for(int i=0; i < hdrRecvCnt[m]; i++) dataRecvCnt[m] += hdrRecv[hdrRecvDsp[m] + i];
+        dataRecvDsp[m+1] = dataRecvDsp[m] + dataRecvCnt[m];
+      }
+      std::vector<char> dataRecv(dataRecvDsp[nNodes] + 1);
+      sparse(&dataSend[0], &dataCnt[0], &dataDsp[0], &dataRecv[0], &dataRecvCnt[0], &dataRecvDsp[0], 1, leaderComm);
+
+      //Offset of every (src rank, local dst) block in dataRecv
+      std::vector<int> blockOffset((size_t)nProc*nodeSize);
+      for(int m=0; m < nNodes; m++)
+      {
+        int pos = dataRecvDsp[m];
+        const int ns = nodeRanks[m].size();
+        for(int ls=0; ls < ns; ls++)
+          for(int ld=0; ld < nodeSize; ld++)
+          {
+            blockOffset[(size_t)nodeRanks[m][ls]*nodeSize + ld] = pos;
+            pos += hdrRecv[hdrRecvDsp[m] + ls*nodeSize + ld];
+          }
+      }
+
+      //Per local destination, the blocks ordered by source rank
+      for(int ld=0; ld < nodeSize; ld++)
+      {
+        for(int r=0; r < nProc; r++)
+          scatterCnt[ld] += hdrRecv[hdrRecvDsp[rankNode[r]] + rankLocal[r]*nodeSize + ld];
+        scatterDsp[ld+1] = scatterDsp[ld] + scatterCnt[ld];
+      }
+      scatterData.resize(scatterDsp[nodeSize] + 1);
+      for(int ld=0; ld < nodeSize; ld++)
+      {
+        int pos = scatterDsp[ld];
+        for(int r=0; r < nProc; r++)
+        {
+          const int b = hdrRecv[hdrRecvDsp[rankNode[r]] + rankLocal[r]*nodeSize + ld];
+          memcpy(&scatterData[pos], &dataRecv[blockOffset[(size_t)r*nodeSize + ld]], b);
+          pos += b;
+        }
+      }
+    }
+
+    //Scatter to the processes of the node, these know the size of every block
+    int nRecv = 0;
+    for(int r=0; r < nProc; r++) nRecv += rcounts[r]*elemBytes;
+    std::vector<char> recvPacked(nRecv + 1);
+    MPI_Scatterv(&scatterData[0], &scatterCnt[0], &scatterDsp[0], MPI_BYTE,
+                 &recvPacked[0], nRecv, MPI_BYTE, 0, nodeComm);
+
+    size_t pos = 0;
+    for(int r=0; r < nProc; r++)
+    {
+      const int b = rcounts[r]*elemBytes;
+      memcpy((char*)rbuf + (size_t)rdispls[r]*elemBytes, &recvPacked[pos], b);
+      pos += b;
+    }
+  }
+};
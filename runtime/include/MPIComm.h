@@ -3,6 +3,7 @@
 #include "mpi.h"
 #include <vector>
 #include <sys/time.h>
+#include "MPIAlltoall.h"
 
 template<class T>
 MPI_Datatype MPIComm_datatype();
@@ -57,6 +58,9 @@ struct MPIComm
   int i_color;
   int j_color;
 
+  All2all            a2a;         //Node layout for the hierarchical exchange
+  All2all::Algorithm algorithm;   //Used by all2all and all2allv_1D, AUTO selects on size and density
+
   double get_time() {
   	struct timeval Tvalue;
 	struct timezone dummy;
@@ -65,7 +69,8 @@ struct MPIComm
 	  return ((double) Tvalue.tv_sec +1.e-6*((double) Tvalue.tv_usec));
 	}
 
-  MPIComm(const int _myid, const int _nproc, const MPI_Comm &comm) : myid(_myid), n_proc(_nproc), mpiCommWorld(comm)
+  MPIComm(const int _myid, const int _nproc, const MPI_Comm &comm) : myid(_myid), n_proc(_nproc), mpiCommWorld(comm),
+                                                                     a2a(comm), algorithm(All2all::AUTO)
   {
     //// ij-parallized ////
 
@@ -106,16 +111,8 @@ struct MPIComm
 	T rbuf[],const  int recvcnts[], const int rdispl[],
 	const MPI_Comm comm)
     {
-	for (int dist = 0; dist < nproc; dist++) {
-		const int src = (nproc + color - dist) % nproc;
-		const int dst = (nproc + color + dist) % nproc;
-		const int scount = sendcnts[dst];
-		const int rcount = recvcnts[src];
-		MPI_Status stat;
-	MPI_Sendrecv(&sbuf[sdispl[dst]],
-	      scount, MPIComm_datatype<T>(), dst, 1,
-		&rbuf[rdispl[src]], rcount, MPIComm_datatype<T>(), src, 1, comm, &stat);
-	}
+      //Pairwise exchange, or only the non-empty messages if few peers are involved
+      All2all::alltoallvLocal(sbuf, sendcnts, sdispl, rbuf, recvcnts, rdispl, sizeof(T), comm, algorithm);
     }
 
   template<typename T>
@@ -156,8 +153,7 @@ struct MPIComm
 	    double t0 = get_time();
       std::vector<int> sub_counts(n_proc);
       //// exchange n of particles within j-comm -> sub counts ////
-      MPI_Alltoall(&scounts[0], n_proc_i, MPI_INT,
-          &sub_counts[0], n_proc_i, MPI_INT, MPI_COMM_J);    
+      All2all::alltoall(&scounts[0], &sub_counts[0], n_proc_i*sizeof(int), MPI_COMM_J);
 	double t1 = get_time();
       std::vector<int> scounts_j(n_proc_j);
       std::vector<int> rcounts_j(n_proc_j);
@@ -201,7 +197,7 @@ struct MPIComm
       sort_array<T>(p_new, &sub_counts[0], &scounts_i[0]);
 	double t4 = get_time();
       //// Alltoall in i-comm ////
-      MPI_Alltoall(&scounts_i[0], 1,  MPI_INT, &rcounts_i[0], 1, MPI_INT, MPI_COMM_I);
+      All2all::alltoall(&scounts_i[0], &rcounts_i[0], sizeof(int), MPI_COMM_I);
 	double t5 = get_time();
 #if 0
       if(myid==0) cout << "alltoall in comm-i" << endl;
@@ -258,8 +254,7 @@ double t6 = get_time();
       std::vector<int> rcounts(n_proc);
       std::vector<int> rdispls(n_proc+1);
 
-      MPI_Alltoall(scounts, 1, MPI_INT, 
-          &rcounts[0], 1, MPI_INT, mpiCommWorld);
+      All2all::alltoall(scounts, &rcounts[0], sizeof(int), mpiCommWorld);
       rdispls[0] = 0;
       sdispls[0] = 0;
       for(int i=0;i<n_proc;i++)
@@ -273,7 +268,7 @@ double t6 = get_time();
 #ifdef USE_ALL2ALLV
       MPI_Alltoallv(&p[0], scounts, &sdispls[0], MPIComm_datatype<T>(), &p_new[0], &rcounts[0], &rdispls[0], MPIComm_datatype<T>(), mpiCommWorld);
 #else
-      all2all<T>(n_proc,myid,&p[0], scounts, &sdispls[0],  &p_new[0], &rcounts[0], &rdispls[0], mpiCommWorld);
+      a2a.alltoallv(&p[0], scounts, &sdispls[0], &p_new[0], &rcounts[0], &rdispls[0], sizeof(T), algorithm);
 #endif
       p.swap(p_new);
     }
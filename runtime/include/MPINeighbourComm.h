@@ -0,0 +1,148 @@
+#pragma once
+
+/*
+ * Sparse (neighbourhood) version of the dense all-to-all exchanges.
+ *
+ * Keeps an MPI distributed-graph communicator with the ranks we exchanged data
+ * with during the previous call. Sources and destinations are the same set, this
+ * set is symmetric since it is derived from pair-wise send/receive information.
+ *
+ * Every call does one MPI_Allreduce on a single int to verify that nobody has
+ * to send something to a rank outside its graph. If that is the case (or there
+ * is no graph yet) the dense MPI_Alltoall is used for this call and the graph is
+ * rebuild from the result. Otherwise the exchange is done with
+ * MPI_Neighbor_alltoall and ranks outside the graph get the 'quiet' value.
+ * When many of the neighbours become idle the graph is rebuild as well.
+ */
+
+#include "mpi.h"
+#include <vector>
+#include <string.h>
+
+struct NeighbourComm
+{
+  const MPI_Comm &comm;
+  MPI_Comm        graphComm;
+
+  int procId, nProcs;
+
+  std::vector<int>  neighbours;   //Ranks in the graph, sorted
+  std::vector<char> isNeighbour;  //Per rank, 1 if it is in the graph
+  bool rebuildPending;
+
+  //Statistics
+  int nFallback;
+  int nRebuild;
+
+  NeighbourComm(const int _procId, const int _nProcs, const MPI_Comm &_comm) :
+    comm(_comm), graphComm(MPI_COMM_NULL), procId(_procId), nProcs(_nProcs),
+    isNeighbour(_nProcs, 0), rebuildPending(false), nFallback(0), nRebuild(0) {}
+
+  ~NeighbourComm()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(graphComm != MPI_COMM_NULL && !finalized) MPI_Comm_free(&graphComm);
+  }
+
+  int nNeighbours() const { return (int)neighbours.size(); }
+
+  //Collective, builds a new graph with the ranks marked in active
+  void rebuild(const std::vector<char> &active)
+  {
+    if(graphComm != MPI_COMM_NULL) MPI_Comm_free(&graphComm);
+
+    neighbours.clear();
+    for(int i=0; i < nProcs; i++)
+    {
+      isNeighbour[i] = (i != procId) && active[i];
+      if(isNeighbour[i]) neighbours.push_back(i);
+    }
+
+    int dummy   = 0;
+    const int n = neighbours.size();
+    int *nb     = n ? &neighbours[0] : &dummy;
+    MPI_Dist_graph_create_adjacent(comm, n, nb, MPI_UNWEIGHTED, n, nb, MPI_UNWEIGHTED,
+                                   MPI_INFO_NULL, 0, &graphComm);
+    rebuildPending = false;
+    nRebuild++;
+  }
+
+  /*
+   * Replacement for MPI_Alltoall(send, n, MPI_INT, recv, n, MPI_INT, comm).
+   * isQuiet(const int *item) returns true if the n ints for a rank carry no
+   * information, recv of ranks outside the graph is set to quietValue.
+   * Returns true if the exchange was done using the graph.
+   */
+  template<typename Quiet>
+  bool alltoall(const int *send, int *recv, const int n, const int *quietValue, Quiet isQuiet)
+  {
+    //0: graph is fine, 1: graph is fine but should be rebuild, 2: dense exchange required
+    int status = rebuildPending ? 1 : 0;
+    if(graphComm == MPI_COMM_NULL) status = 2;
+    for(int i=0; i < nProcs && status != 2; i++)
+      if(i != procId && !isNeighbour[i] && !isQuiet(&send[i*n])) status = 2;
+
+    int globalStatus = 0;
+    MPI_Allreduce(&status, &globalStatus, 1, MPI_INT, MPI_MAX, comm);
+
+    if(globalStatus == 2)
+    {
+      MPI_Alltoall((void*)send, n, MPI_INT, recv, n, MPI_INT, comm);
+      nFallback++;
+    }
+    else
+    {
+      const int nn = neighbours.size();
+      std::vector<int> sbuf(nn*n + 1), rbuf(nn*n + 1);
+      for(int j=0; j < nn; j++)
+        memcpy(&sbuf[j*n], &send[neighbours[j]*n], n*sizeof(int));
+
+      MPI_Neighbor_alltoall(&sbuf[0], n, MPI_INT, &rbuf[0], n, MPI_INT, graphComm);
+
+      for(int i=0; i < nProcs; i++)
+        memcpy(&recv[i*n], quietValue, n*sizeof(int));
+      for(int j=0; j < nn; j++)
+        memcpy(&recv[neighbours[j]*n], &rbuf[j*n], n*sizeof(int));
+      memcpy(&recv[procId*n], &send[procId*n], n*sizeof(int));
+    }
+
+    //Ranks that we actually communicate with this call
+    std::vector<char> active(nProcs, 0);
+    int nIdle = 0;
+    for(int i=0; i < nProcs; i++)
+    {
+      if(i == procId) continue;
+      active[i] = !isQuiet(&send[i*n]) || !isQuiet(&recv[i*n]);
+      nIdle    += isNeighbour[i] && !active[i];
+    }
+
+    //The decision to rebuild is global, every rank has the same globalStatus
+    if(globalStatus >= 1)
+      rebuild(active);
+    else if(nIdle > 2 && 4*nIdle > (int)neighbours.size())
+      rebuildPending = true;  //Shrink the graph during the next call
+
+    return globalStatus != 2;
+  }
+
+  /*
+   * Replacement for MPI_Alltoallv where the counts and displacements are
+   * indexed by rank. Only valid after alltoall() was used to exchange the
+   * counts, so every non-zero count is between neighbours.
+   */
+  void alltoallv(const void *sbuf, const int *scounts, const int *sdispls,
+                 void *rbuf, const int *rcounts, const int *rdispls, MPI_Datatype type)
+  {
+    const int nn = neighbours.size();
+    std::vector<int> sc(nn+1), sd(nn+1), rc(nn+1), rd(nn+1);
+    for(int j=0; j < nn; j++)
+    {
+      sc[j] = scounts[neighbours[j]];
+      sd[j] = sdispls[neighbours[j]];
+      rc[j] = rcounts[neighbours[j]];
+      rd[j] = rdispls[neighbours[j]];
+    }
+    MPI_Neighbor_alltoallv((void*)sbuf, &sc[0], &sd[0], type, rbuf, &rc[0], &rd[0], type, graphComm);
+  }
+};
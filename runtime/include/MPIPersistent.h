@@ -0,0 +1,191 @@
+#pragma once
+
+/*
+ * Persistent point-to-point requests for exchanges that are repeated every
+ * step with (mostly) the same communication partners.
+ *
+ * For every source we keep a receive buffer and a persistent receive request
+ * (MPI_Recv_init) that is pre-posted directly after the previous exchange
+ * completed, so the incoming message is matched on arrival. The buffer is
+ * sized from the high-water mark of the messages received from that source.
+ *
+ * The capacity is a function of the message sizes only, so the sender keeps
+ * a mirror of the capacity of the receive buffer at the remote side. A message
+ * that does not fit is sent with tag+1 and received with a normal MPI_Irecv,
+ * after which both sides enlarge the capacity. This requires that the message
+ * sizes are known by both sides before the exchange starts.
+ *
+ * Send requests are persistent as well (MPI_Send_init), they are rebuild when
+ * the send buffer or size changes.
+ */
+
+#include "mpi.h"
+#include <vector>
+#include <assert.h>
+
+struct PersistentExchange
+{
+  struct Peer
+  {
+    std::vector<char> recvBuffer;
+    MPI_Request       recvReq;      //Persistent receive, MPI_REQUEST_NULL if not created
+    bool              recvPosted;   //recvReq is started and not yet completed
+    int               recvCapacity; //In elements
+    bool              recvReinit;   //Capacity changed, rebuild recvReq
+
+    MPI_Request       sendReq;      //Persistent send, MPI_REQUEST_NULL if not created
+    const void       *sendBuffer;
+    int               sendCount;
+    int               sendCapacity; //Mirror of the recvCapacity of the remote process
+
+    Peer() : recvReq(MPI_REQUEST_NULL), recvPosted(false), recvCapacity(0), recvReinit(false),
+             sendReq(MPI_REQUEST_NULL), sendBuffer(NULL), sendCount(0), sendCapacity(0) {}
+  };
+
+  const MPI_Comm    &comm;
+  const MPI_Datatype type;
+  const int          elemSize;     //Size of type in bytes
+  const int          tag;          //Fitting messages use tag, others tag+1
+
+  std::vector<Peer>        peers;
+  std::vector<MPI_Request> pending;
+  std::vector<int>         pendingPeer;  //Source or destination of the pending requests
+  std::vector<int>         recvFrom;
+
+  //Statistics
+  int nOversized;     //Messages that did not fit in the pre-posted receive
+  int nSendInit;      //Number of times a persistent send was (re)build
+
+  PersistentExchange(const int nProcs, const MPI_Comm &_comm, MPI_Datatype _type,
+                     const int _elemSize, const int _tag) :
+    comm(_comm), type(_type), elemSize(_elemSize), tag(_tag), peers(nProcs),
+    nOversized(0), nSendInit(0) {}
+
+  ~PersistentExchange()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(!finalized) release();
+  }
+
+  static int growCapacity(const int count)
+  {
+    return count + count / 4 + 16;
+  }
+
+  //Cancels the pre-posted receives, has to be called before MPI_Finalize
+  void release()
+  {
+    for(size_t i=0; i < peers.size(); i++)
+    {
+      Peer &p = peers[i];
+      freeRecv(p);
+      if(p.sendReq != MPI_REQUEST_NULL) MPI_Request_free(&p.sendReq);
+    }
+  }
+
+  void freeRecv(Peer &p)
+  {
+    if(p.recvPosted)
+    {
+      MPI_Cancel(&p.recvReq);
+      MPI_Wait(&p.recvReq, MPI_STATUS_IGNORE);
+      p.recvPosted = false;
+    }
+    if(p.recvReq != MPI_REQUEST_NULL) MPI_Request_free(&p.recvReq);
+  }
+
+  //Start sending count elements of buf to dst
+  void send(const int dst, const void *buf, const int count)
+  {
+    Peer &p = peers[dst];
+    if(count > p.sendCapacity)
+    {
+      MPI_Request req;
+      MPI_Isend((void*)buf, count, type, dst, tag+1, comm, &req);
+      pending.push_back(req);
+      pendingPeer.push_back(dst);
+      p.sendCapacity = growCapacity(count);
+      return;
+    }
+
+    if(p.sendReq == MPI_REQUEST_NULL || p.sendBuffer != buf || p.sendCount != count)
+    {
+      if(p.sendReq != MPI_REQUEST_NULL) MPI_Request_free(&p.sendReq);
+      MPI_Send_init((void*)buf, count, type, dst, tag, comm, &p.sendReq);
+      p.sendBuffer = buf;
+      p.sendCount  = count;
+      nSendInit++;
+    }
+    MPI_Start(&p.sendReq);
+    pending.push_back(p.sendReq);
+    pendingPeer.push_back(dst);
+  }
+
+  //Receive count elements from src, returns the location the data will be stored at
+  //after waitAll
+  const void* recv(const int src, const int count)
+  {
+    Peer &p = peers[src];
+    recvFrom.push_back(src);
+
+    if(count > p.recvCapacity)
+    {
+      //Does not fit, the remote process sends it with tag+1
+      freeRecv(p);
+      p.recvCapacity = growCapacity(count);
+      p.recvBuffer.resize((size_t)p.recvCapacity*elemSize);
+      p.recvReinit   = true;
+      nOversized++;
+
+      MPI_Request req;
+      MPI_Irecv(&p.recvBuffer[0], count, type, src, tag+1, comm, &req);
+      pending.push_back(req);
+      pendingPeer.push_back(src);
+    }
+    else
+    {
+      assert(p.recvPosted);
+      pending.push_back(p.recvReq);
+      pendingPeer.push_back(src);
+      p.recvPosted = false;  //Completed by waitAll
+    }
+    return &p.recvBuffer[0];
+  }
+
+  //Completes the exchange and pre-posts the receives for the next one. If peerWait
+  //is set it returns per peer the time until its requests completed
+  void waitAll(std::vector<double> *peerWait = NULL)
+  {
+    if(peerWait)
+    {
+      peerWait->assign(peers.size(), 0);
+      const double t0 = MPI_Wtime();
+      for(size_t i=0; i < pending.size(); i++)
+      {
+        //Completed persistent requests become inactive, these are skipped like null requests
+        int idx = MPI_UNDEFINED;
+        MPI_Waitany(pending.size(), &pending[0], &idx, MPI_STATUS_IGNORE);
+        if(idx == MPI_UNDEFINED) break;
+        (*peerWait)[pendingPeer[idx]] = MPI_Wtime() - t0;  //Last request of the peer
+      }
+    }
+    else if(!pending.empty())
+      MPI_Waitall(pending.size(), &pending[0], MPI_STATUSES_IGNORE);
+    pending.clear();
+    pendingPeer.clear();
+
+    for(size_t i=0; i < recvFrom.size(); i++)
+    {
+      Peer &p = peers[recvFrom[i]];
+      if(p.recvReinit)
+      {
+        MPI_Recv_init(&p.recvBuffer[0], p.recvCapacity, type, recvFrom[i], tag, comm, &p.recvReq);
+        p.recvReinit = false;
+      }
+      MPI_Start(&p.recvReq);
+      p.recvPosted = true;
+    }
+    recvFrom.clear();
+  }
+};
@@ -0,0 +1,256 @@
+#pragma once
+
+/*
+ * MPI progress thread.
+ *
+ * Large non-blocking messages (rendezvous protocol) only move when some thread
+ * enters the MPI library. The progress thread owns the requests handed to it
+ * with submit() and calls MPI_Testsome on them until they complete, so the
+ * transfers continue while the other threads compute. Completed requests are
+ * put in a queue together with their user pointer, the owner collects them
+ * with poll() (e.g. to free the send buffer).
+ *
+ * The thread can also take over a known number of incoming messages, see
+ * receive(). It matches them with MPI_Improbe, allocates the buffer through
+ * the given allocator and completes the MPI_Imrecv, so the receives progress
+ * without the owner entering MPI. The owner collects them with pollReceived().
+ *
+ * Requires MPI_THREAD_MULTIPLE, start() returns false otherwise. stop() waits
+ * until all submitted requests are complete.
+ */
+
+#include <mpi.h>
+#include <sched.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <vector>
+#include <deque>
+#include <functional>
+#include "HostThreads.h"
+
+struct MPIProgress
+{
+  struct Completion
+  {
+    void *user;
+    int   tag;
+    int   source;     //Only set for receives
+    int   count;      //Received bytes, only set for receives
+    bool  isRecv;
+  };
+
+  typedef std::function<void*(int bytes)> Allocator;
+
+  private:
+
+  std::thread             thread;
+  std::mutex              mutex;
+  std::condition_variable wakeUp;
+
+  //Protected by mutex
+  std::vector<MPI_Request> inbox;
+  std::vector<Completion>  inboxUser;
+  std::deque<Completion>   done;
+  std::deque<Completion>   received;
+  bool                     stopRequested;
+  int                      nActive;       //Requests owned by the thread
+  int                      recvRemaining; //Messages still to be matched for receive()
+  MPI_Comm                 recvComm;
+  Allocator                recvAlloc;
+
+  //Owned by the thread
+  std::vector<MPI_Request> active;
+  std::vector<Completion>  activeUser;
+  std::vector<int>         indices;
+
+  int cpu;
+
+  public:
+
+  //Statistics
+  unsigned long long nSubmitted, nCompleted, nTests;
+
+  MPIProgress() : stopRequested(false), nActive(0), recvRemaining(0), recvComm(MPI_COMM_NULL),
+                  cpu(-1), nSubmitted(0), nCompleted(0), nTests(0) {}
+  ~MPIProgress() { stop(); }
+
+  //cpu < 0 leaves the thread unpinned
+  bool start(const int _cpu)
+  {
+    int provided;
+    MPI_Query_thread(&provided);
+    if(provided != MPI_THREAD_MULTIPLE) return false;
+    if(thread.joinable()) return true;
+
+    cpu           = _cpu;
+    stopRequested = false;
+    thread        = std::thread(&MPIProgress::run, this);
+    return true;
+  }
+
+  void stop()
+  {
+    if(!thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopRequested = true;
+    }
+    wakeUp.notify_one();
+    thread.join();
+  }
+
+  bool running() { return thread.joinable(); }
+
+  //Hand over a request, it is completed by the progress thread
+  void submit(const MPI_Request req, void *user, const int tag = 0)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      const Completion c = {user, tag, -1, 0, false};
+      nSubmitted++;
+      if(req == MPI_REQUEST_NULL)
+      {
+        done.push_back(c);
+        nCompleted++;
+        return;
+      }
+      inbox.push_back(req);
+      inboxUser.push_back(c);
+    }
+    wakeUp.notify_one();
+  }
+
+  //Receive the next nMessages messages that arrive on comm, with any source
+  //and tag. The buffers come from alloc, which is called on the progress thread
+  void receive(const MPI_Comm comm, const int nMessages, Allocator alloc)
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      recvComm       = comm;
+      recvAlloc      = alloc;
+      recvRemaining += nMessages;
+    }
+    wakeUp.notify_one();
+  }
+
+  //Returns the next completed receive, if any. c.user is the buffer
+  bool pollReceived(Completion &c)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(received.empty()) return false;
+    c = received.front();
+    received.pop_front();
+    return true;
+  }
+
+  //Returns the next completed request, if any
+  bool poll(Completion &c)
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if(done.empty()) return false;
+    c = done.front();
+    done.pop_front();
+    return true;
+  }
+
+  //Submitted requests that did not complete yet, including the receives that are not matched yet
+  int pending()
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    return nActive + (int)inbox.size() + recvRemaining;
+  }
+
+  private:
+
+  void run()
+  {
+    if(cpu >= 0) HostThreads::bindToCpu(cpu);
+
+    while(true)
+    {
+      int nMatch = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        if(active.empty() && inbox.empty())
+        {
+          //Receives that were never matched are dropped, the owner stopped waiting for them
+          if(stopRequested) break;
+          //Nothing to progress, sleep until a request is submitted
+          if(recvRemaining == 0) wakeUp.wait_for(lock, std::chrono::milliseconds(10));
+        }
+        active.insert(active.end(), inbox.begin(), inbox.end());
+        activeUser.insert(activeUser.end(), inboxUser.begin(), inboxUser.end());
+        inbox.clear();
+        inboxUser.clear();
+        nActive = (int)active.size();
+        nMatch  = recvRemaining;
+      }
+
+      //Match the incoming messages and post their receives
+      while(nMatch > 0)
+      {
+        int         flag = 0;
+        MPI_Message msg;
+        MPI_Status  status;
+        MPI_Improbe(MPI_ANY_SOURCE, MPI_ANY_TAG, recvComm, &flag, &msg, &status);
+        if(!flag) break;
+
+        int count;
+        MPI_Get_count(&status, MPI_BYTE, &count);
+        const Completion c = {recvAlloc(count), status.MPI_TAG, status.MPI_SOURCE, count, true};
+        MPI_Request req;
+        MPI_Imrecv(c.user, count, MPI_BYTE, &msg, &req);
+        active.push_back(req);
+        activeUser.push_back(c);
+        nMatch--;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        recvRemaining--;
+        nSubmitted++;
+        nActive = (int)active.size();
+      }
+      if(active.empty())
+      {
+        if(nMatch > 0) sched_yield();   //Waiting for the next message to arrive
+        continue;
+      }
+
+      int nDone = 0;
+      indices.resize(active.size());
+      MPI_Testsome((int)active.size(), &active[0], &nDone, &indices[0], MPI_STATUSES_IGNORE);
+      nTests++;
+
+      if(nDone == MPI_UNDEFINED || nDone == 0)
+      {
+        sched_yield();
+        continue;
+      }
+
+      //Completed requests are MPI_REQUEST_NULL now, move them to the done queue
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(int i=0; i < nDone; i++)
+        {
+          const Completion &c = activeUser[indices[i]];
+          if(c.isRecv) received.push_back(c);
+          else         done.push_back(c);
+        }
+        nCompleted += nDone;
+
+        size_t j = 0;
+        for(size_t i=0; i < active.size(); i++)
+        {
+          if(active[i] == MPI_REQUEST_NULL) continue;
+          active[j]     = active[i];
+          activeUser[j] = activeUser[i];
+          j++;
+        }
+        active.resize(j);
+        activeUser.resize(j);
+        nActive = (int)j;
+      }
+    }
+  }
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+/*
+ * Bounded lock-free multi-producer / multi-consumer queue.
+ *
+ * Ring buffer of 2^n cells, each with a sequence number that tells producers
+ * and consumers whether the cell is free or filled for the current lap of the
+ * ring (D. Vyukov's bounded MPMC queue). push() and pop() take one CAS on the
+ * shared position and never block; they return false when the queue is full
+ * or empty. T is copied in and out, so it should be a small POD.
+ */
+
+#include <atomic>
+#include <cstddef>
+#include <stdint.h>
+
+template<typename T>
+class MPMCQueue
+{
+  private:
+
+  struct Cell
+  {
+    std::atomic<size_t> sequence;
+    T                   data;
+  };
+
+  //Producers and consumers on separate cache lines
+  char                pad0[64];
+  Cell               *cells;
+  size_t              mask;
+  char                pad1[64];
+  std::atomic<size_t> enqueuePos;
+  char                pad2[64];
+  std::atomic<size_t> dequeuePos;
+  char                pad3[64];
+
+  MPMCQueue(const MPMCQueue&);
+  MPMCQueue& operator=(const MPMCQueue&);
+
+  public:
+
+  //The capacity is rounded up to a power of two
+  explicit MPMCQueue(const size_t minCapacity)
+  {
+    size_t capacity = 2;
+    while(capacity < minCapacity) capacity <<= 1;
+
+    cells = new Cell[capacity];
+    mask  = capacity - 1;
+    for(size_t i=0; i < capacity; i++)
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    enqueuePos.store(0, std::memory_order_relaxed);
+    dequeuePos.store(0, std::memory_order_relaxed);
+  }
+
+  ~MPMCQueue() { delete[] cells; }
+
+  size_t capacity() const { return mask + 1; }
+
+  bool push(const T &value)
+  {
+    Cell  *cell;
+    size_t pos = enqueuePos.load(std::memory_order_relaxed);
+    while(true)
+    {
+      cell = &cells[pos & mask];
+      const size_t   seq  = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+      if(diff == 0)
+      {
+        if(enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(diff < 0)
+        return false;   //Full
+      else
+        pos = enqueuePos.load(std::memory_order_relaxed);
+    }
+    cell->data = value;
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &value)
+  {
+    Cell  *cell;
+    size_t pos = dequeuePos.load(std::memory_order_relaxed);
+    while(true)
+    {
+      cell = &cells[pos & mask];
+      const size_t   seq  = cell->sequence.load(std::memory_order_acquire);
+      const intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+      if(diff == 0)
+      {
+        if(dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+          break;
+      }
+      else if(diff < 0)
+        return false;   //Empty
+      else
+        pos = dequeuePos.load(std::memory_order_relaxed);
+    }
+    value = cell->data;
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+};
@@ -0,0 +1,158 @@
+#pragma once
+
+/*
+ * Node-level shared copy of the local trees.
+ *
+ * Ranks on the same node put their local tree (node sizes, centres,
+ * multipoles and particles) in an MPI-3 shared memory window. A rank then
+ * builds the LET of a peer on the same node itself by walking the peer's
+ * tree directly, instead of the peer building it and sending it over MPI.
+ *
+ * Every rank owns one segment of the window. The window is reallocated
+ * (collectively on the node) when a tree does not fit anymore.
+ *
+ * Synchronisation: publish() ends with a node barrier, after that the
+ * segments of all peers can be read. A segment is overwritten during the
+ * next publish(). The MPI_Allreduce at the start of publish() is what makes
+ * that safe: a peer only enters it once it is done walking our previous
+ * tree, so nobody writes its segment before all peers are done reading.
+ */
+
+#include "mpi.h"
+#include <vector>
+#include <string.h>
+#include <algorithm>
+
+struct NodeSharedTree
+{
+  struct Header
+  {
+    int n;            //Number of particles
+    int nNodes;
+    int cellBeg;      //Start level of the tree walk
+    int cellEnd;
+    int padding[12];  //Keep the arrays 64 byte aligned
+  };
+
+  //Pointers into the segment of one rank
+  struct Tree
+  {
+    int          n, nNodes, cellBeg, cellEnd;
+    const real4 *nodeSize;
+    const real4 *nodeCentre;
+    const real4 *multipole;
+    const real4 *bodies;
+  };
+
+  MPI_Comm nodeComm;
+  MPI_Win  win;
+  int      localRank, nLocal;
+  size_t   segmentSize;             //Bytes per rank
+
+  std::vector<int>    worldToLocal; //-1 if the rank is not on our node
+  std::vector<char *> segments;     //Base of the segment of every local rank
+
+  NodeSharedTree(const int procId, const int nProcs, const MPI_Comm &comm) :
+    win(MPI_WIN_NULL), segmentSize(0), worldToLocal(nProcs, -1)
+  {
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, procId, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_rank(nodeComm, &localRank);
+    MPI_Comm_size(nodeComm, &nLocal);
+
+    std::vector<int> localRanks(nLocal);
+    MPI_Allgather((void*)&procId, 1, MPI_INT, &localRanks[0], 1, MPI_INT, nodeComm);
+    for(int i=0; i < nLocal; i++) worldToLocal[localRanks[i]] = i;
+
+    segments.resize(nLocal, NULL);
+  }
+
+  ~NodeSharedTree()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(finalized) return;
+    freeWindow();
+    MPI_Comm_free(&nodeComm);
+  }
+
+  bool isOnNode(const int rank) const { return worldToLocal[rank] >= 0; }
+  int  nPeers()                 const { return nLocal-1; }
+
+  void freeWindow()
+  {
+    if(win == MPI_WIN_NULL) return;
+    MPI_Win_unlock_all(win);
+    MPI_Win_free(&win);
+  }
+
+  //Collective on the node
+  void allocate(const size_t bytes)
+  {
+    freeWindow();
+    segmentSize = ((bytes + 4095) / 4096) * 4096;
+
+    char *base = NULL;
+    MPI_Win_allocate_shared(segmentSize, 1, MPI_INFO_NULL, nodeComm, &base, &win);
+    for(int i=0; i < nLocal; i++)
+    {
+      MPI_Aint size;
+      int      dispUnit;
+      MPI_Win_shared_query(win, i, &size, &dispUnit, &segments[i]);
+    }
+    MPI_Win_lock_all(MPI_MODE_NOCHECK, win);
+  }
+
+  static size_t treeBytes(const int n, const int nNodes)
+  {
+    return sizeof(Header) + sizeof(real4)*(5*(size_t)nNodes + n);
+  }
+
+  //Collective on the node, copies our tree into the window
+  void publish(const int n, const int nNodes, const int cellBeg, const int cellEnd,
+               const real4 *nodeSize, const real4 *nodeCentre, const real4 *multipole,
+               const real4 *bodies)
+  {
+    //This reduction also guards the overwrite below, no peer is still
+    //reading our previous tree once all of them entered it. Do not remove.
+    unsigned long long need = treeBytes(n, nNodes), maxNeed = 0;
+    MPI_Allreduce(&need, &maxNeed, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, nodeComm);
+    if(maxNeed > segmentSize) allocate((size_t)(1.25*maxNeed));
+
+    char   *seg = segments[localRank];
+    Header  hdr;
+    memset(&hdr, 0, sizeof(Header));
+    hdr.n       = n;
+    hdr.nNodes  = nNodes;
+    hdr.cellBeg = cellBeg;
+    hdr.cellEnd = cellEnd;
+    memcpy(seg, &hdr, sizeof(Header));
+
+    real4 *data = (real4*)(seg + sizeof(Header));
+    memcpy(data,            nodeSize,   sizeof(real4)*nNodes);
+    memcpy(data+1*nNodes,   nodeCentre, sizeof(real4)*nNodes);
+    memcpy(data+2*nNodes,   multipole,  sizeof(real4)*nNodes*3);
+    memcpy(data+5*nNodes,   bodies,     sizeof(real4)*n);
+
+    MPI_Win_sync(win);
+    MPI_Barrier(nodeComm);
+    MPI_Win_sync(win);
+  }
+
+  Tree getTree(const int rank) const
+  {
+    const char   *seg = segments[worldToLocal[rank]];
+    const Header *hdr = (const Header*)seg;
+    const real4 *data = (const real4*)(seg + sizeof(Header));
+
+    Tree t;
+    t.n          = hdr->n;
+    t.nNodes     = hdr->nNodes;
+    t.cellBeg    = hdr->cellBeg;
+    t.cellEnd    = hdr->cellEnd;
+    t.nodeSize   = data;
+    t.nodeCentre = data + 1*t.nNodes;
+    t.multipole  = data + 2*t.nNodes;
+    t.bodies     = data + 5*t.nNodes;
+    return t;
+  }
+};
@@ -0,0 +1,133 @@
+#pragma once
+
+/*
+ * Bounding volume hierarchy over the domains of the remote processes.
+ *
+ * Every process is represented by one axis aligned box. The hierarchy is a
+ * binary tree, build top-down by splitting the boxes at the median of their
+ * centres along the longest axis, with up to LEAF_SIZE boxes per leaf. The
+ * nodes are stored depth-first, the left child directly follows its parent.
+ *
+ * query() returns the processes whose box overlaps a given box, in
+ * O(log nProcs + nFound) instead of testing all processes.
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cfloat>
+
+struct PeerBVH
+{
+  enum {LEAF_SIZE = 4};
+
+  struct Box
+  {
+    float lo[3], hi[3];
+
+    static Box empty()
+    {
+      Box b;
+      for(int k=0; k < 3; k++) { b.lo[k] = FLT_MAX; b.hi[k] = -FLT_MAX; }
+      return b;
+    }
+    void expand(const Box &b)
+    {
+      for(int k=0; k < 3; k++)
+      {
+        lo[k] = std::min(lo[k], b.lo[k]);
+        hi[k] = std::max(hi[k], b.hi[k]);
+      }
+    }
+    bool overlaps(const Box &b) const
+    {
+      return lo[0] <= b.hi[0] && b.lo[0] <= hi[0] &&
+             lo[1] <= b.hi[1] && b.lo[1] <= hi[1] &&
+             lo[2] <= b.hi[2] && b.lo[2] <= hi[2];
+    }
+    float centre(const int k) const { return 0.5f*(lo[k] + hi[k]); }
+  };
+
+  struct Node
+  {
+    Box box;
+    int right;          //Index of the right child, -1 for a leaf
+    int first, count;   //Range in items, for a leaf
+  };
+
+  std::vector<Node> nodes;
+  std::vector<int>  items;    //Process ids, ordered by leaf
+  std::vector<Box>  boxes;    //Box of every process id
+
+  //Build over the given process ids, boxes is indexed by process id
+  void build(const std::vector<Box> &_boxes, const std::vector<int> &ids)
+  {
+    boxes = _boxes;
+    items = ids;
+    nodes.clear();
+    nodes.reserve(2*(items.size()/LEAF_SIZE + 1));
+    if(!items.empty()) buildNode(0, items.size());
+  }
+
+  void query(const Box &b, std::vector<int> &found) const
+  {
+    found.clear();
+    if(nodes.empty()) return;
+
+    int stack[64];
+    int nStack = 0;
+    stack[nStack++] = 0;
+    while(nStack > 0)
+    {
+      const Node &node = nodes[stack[--nStack]];
+      if(!node.box.overlaps(b)) continue;
+      if(node.right < 0)
+      {
+        for(int i=node.first; i < node.first+node.count; i++)
+          if(boxes[items[i]].overlaps(b)) found.push_back(items[i]);
+      }
+      else
+      {
+        stack[nStack++] = node.right;
+        stack[nStack++] = (int)(&node - &nodes[0]) + 1;
+      }
+    }
+  }
+
+  private:
+
+  int buildNode(const int first, const int count)
+  {
+    const int idx = nodes.size();
+    nodes.push_back(Node());
+
+    Box box = Box::empty(), centres = Box::empty();
+    for(int i=first; i < first+count; i++)
+    {
+      const Box &b = boxes[items[i]];
+      box.expand(b);
+      Box c;
+      for(int k=0; k < 3; k++) c.lo[k] = c.hi[k] = b.centre(k);
+      centres.expand(c);
+    }
+    nodes[idx].box   = box;
+    nodes[idx].right = -1;
+    nodes[idx].first = first;
+    nodes[idx].count = count;
+    if(count <= LEAF_SIZE) return idx;
+
+    int axis = 0;
+    for(int k=1; k < 3; k++)
+      if(centres.hi[k]-centres.lo[k] > centres.hi[axis]-centres.lo[axis]) axis = k;
+
+    //Median split, the depth is at most log2(nProcs/LEAF_SIZE)+1
+    const int half = count / 2;
+    const std::vector<Box> &bx = boxes;
+    std::nth_element(items.begin()+first, items.begin()+first+half, items.begin()+first+count,
+                     [&bx, axis](const int a, const int b) { return bx[a].centre(axis) < bx[b].centre(axis); });
+
+    buildNode(first, half);
+    const int right  = buildNode(first+half, count-half);
+    nodes[idx].right = right;
+    return idx;
+  }
+};
@@ -0,0 +1,116 @@
+#pragma once
+
+/*
+ * Topology aware rank order.
+ *
+ * The domains are assigned along the PH curve in rank order, so neighbouring
+ * domains, which exchange the most particles and the largest LETs, have
+ * consecutive ranks. Launchers do not always place consecutive ranks on the
+ * same node (e.g. round-robin placement). reorder() returns a communicator in
+ * which the ranks of a node are consecutive and, within a node, are ordered
+ * by socket and cpu.
+ *
+ * Nodes are found with MPI_Comm_split_type(MPI_COMM_TYPE_SHARED) and ordered
+ * by the lowest original rank on them. The socket and cpu are taken from the
+ * affinity mask; ranks that are not bound to a subset of the node keep their
+ * original relative order.
+ */
+
+#include <mpi.h>
+#include <sched.h>
+#include <unistd.h>
+#include <vector>
+#include <algorithm>
+#include "HostThreads.h"
+
+struct RankReorder
+{
+  struct Entry
+  {
+    int node;     //Lowest original rank on the node
+    int socket;   //-1 if not bound
+    int cpu;      //First cpu of the affinity mask, -1 if not bound
+    int rank;     //Original rank
+    bool operator<(const Entry &b) const
+    {
+      if(node   != b.node)   return node   < b.node;
+      if(socket != b.socket) return socket < b.socket;
+      if(cpu    != b.cpu)    return cpu    < b.cpu;
+      return rank < b.rank;
+    }
+  };
+
+  int nNodes;
+  int nodeId;       //Index of our node in the new order
+  int ranksPerNode;
+  int localRank;    //Rank within the node in the new order
+  int socket;
+  int oldRank, newRank;
+
+  RankReorder() : nNodes(1), nodeId(0), ranksPerNode(1), localRank(0), socket(-1), oldRank(0), newRank(0) {}
+
+  //Socket and first cpu of our affinity mask, -1 if we may run on the full node
+  static void boundCpu(int &socket, int &cpu)
+  {
+    socket = cpu = -1;
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    if(sched_getaffinity(0, sizeof(cpu_set_t), &cpuset) != 0) return;
+
+    int nAllowed = 0, first = -1;
+    for(int i=0; i < CPU_SETSIZE; i++)
+      if(CPU_ISSET(i, &cpuset))
+      {
+        if(first < 0) first = i;
+        nAllowed++;
+      }
+    if(first < 0 || nAllowed >= (int)sysconf(_SC_NPROCESSORS_ONLN)) return;
+
+    cpu    = first;
+    socket = HostThreads::readSysInt(cpu, "physical_package_id", 0);
+  }
+
+  //Returns the reordered communicator, the caller frees it with MPI_Comm_free
+  MPI_Comm reorder(const MPI_Comm &comm)
+  {
+    int nProcs;
+    MPI_Comm_rank(comm, &oldRank);
+    MPI_Comm_size(comm, &nProcs);
+
+    MPI_Comm nodeComm;
+    MPI_Comm_split_type(comm, MPI_COMM_TYPE_SHARED, oldRank, MPI_INFO_NULL, &nodeComm);
+    MPI_Comm_size(nodeComm, &ranksPerNode);
+
+    Entry self;
+    MPI_Allreduce(&oldRank, &self.node, 1, MPI_INT, MPI_MIN, nodeComm);
+    MPI_Comm_free(&nodeComm);
+    boundCpu(self.socket, self.cpu);
+    self.rank = oldRank;
+    socket    = self.socket;
+
+    std::vector<Entry> all(nProcs);
+    MPI_Allgather(&self, 4, MPI_INT, &all[0], 4, MPI_INT, comm);
+    std::sort(all.begin(), all.end());
+
+    nNodes = 0;
+    int nodeStart = 0;
+    for(int i=0; i < nProcs; i++)
+    {
+      if(i == 0 || all[i].node != all[i-1].node)
+      {
+        nNodes++;
+        nodeStart = i;
+      }
+      if(all[i].rank == oldRank)
+      {
+        newRank   = i;
+        nodeId    = nNodes-1;
+        localRank = i - nodeStart;
+      }
+    }
+
+    MPI_Comm newComm;
+    MPI_Comm_split(comm, 0, newRank, &newComm);
+    return newComm;
+  }
+};
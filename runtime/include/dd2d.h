@@ -12,28 +12,33 @@
 #include <cassert>
 #include <mpi.h>
 #include <vector>
-
+#include "MPIAlltoall.h"
+#include "radix.h"
+
+/* BITS is the width of the keys, 64 uses the first two words of the PH key
+ * (20 levels), 96 all three (30 levels, as the tree). The keys are the Keys<>
+ * of the radix sort, they are converted from and to the uint4 PH keys and
+ * boundaries. */
+template<int BITS>
 struct DD2D
 {
-  struct Key
+  struct Key : public Keys<BITS>
   {
-    enum { SIZEFLT = 2}; 
-    unsigned long long key;
+    enum { SIZEFLT = sizeof(Keys<BITS>) / sizeof(float)};
 
-    Key() { assert(sizeof(Key) == SIZEFLT*sizeof(float)); }
-    Key(const unsigned long long _key) : key(_key) {}
+    Key() : Keys<BITS>(0u) { assert(sizeof(Key) == SIZEFLT*sizeof(float)); }
+    Key(const Keys<BITS> &_key) : Keys<BITS>(_key) {}
+    Key(const uint4 _key) : Keys<BITS>(_key) {}
 
-    bool operator< (const Key &a) const { return key <  a.key; }
-    bool operator<=(const Key &a) const { return key <= a.key; }
-    bool operator> (const Key &a) const { return key >  a.key; }
-    bool operator>=(const Key &a) const { return key >= a.key; }
-    bool operator==(const Key &a) const { return key == a.key; }
+    bool operator<=(const Key &a) const { return !(a < *this); }
+    bool operator> (const Key &a) const { return   a < *this;  }
+    bool operator>=(const Key &a) const { return !(*this < a); }
 
-    static Key min() { return Key(0); }
-    static Key max() { return Key(0xFFFFFFFFFFFFFFFFULL); }
+    static Key min() { return Key(make_uint4(0, 0, 0, 0)); }
+    static Key max() { return Key(make_uint4(0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF)); }
 
 
-    bool operator () (const Key &a, const Key &b) {  return a.key < b.key; }
+    bool operator () (const Key &a, const Key &b) {  return a < b; }
   };
 
   private:
@@ -80,7 +85,7 @@ struct DD2D
 
     for (int p = 0; p < np; p++)
       keys2send_size[p] = keys2send[p].size();
-    MPI_Alltoall(&keys2send_size[0], 1, MPI_INT, &keys2recv_size[0], 1, MPI_INT, mpi_comm);
+    All2all::alltoall(&keys2send_size[0], &keys2recv_size[0], sizeof(int), mpi_comm);
     
     for (int p = 0; p < nProc; p++)
       keys2recv_displ[p+1] = keys2recv_displ[p] + keys2recv_size[p];
@@ -0,0 +1,450 @@
+#pragma once
+
+/*
+ * Exact domain decomposition by a parallel histogram splitter search.
+ *
+ * Instead of gathering and sorting a sample of the keys, the nProc-1 splitters
+ * are searched for directly in the full distributed key set. Every process
+ * counts its own (sorted) keys below a set of probe keys, the counts are summed
+ * with an MPI_Allreduce and the search interval of every splitter is narrowed
+ * down to the probes that bracket its target count. This is repeated until
+ * every splitter is within the tolerance of its target.
+ *
+ * The probes of a round are the smallest and largest of the local estimates
+ * of the processes (the key at the same relative position in the local part of
+ * the interval), these bracket the global splitter. NPROBE-2 additional probes
+ * are placed in between. Usually a few rounds are enough.
+ *
+ * Every local key counts with the weight of its process, this is used for
+ * load-balancing (same as the sampling rate in DD2D). Alternatively every key
+ * has its own weight, given as the cumulative sum over the sorted keys.
+ *
+ * With damping < 1 the splitters move only that fraction of the way from
+ * the previous boundaries to the balanced position (in weighted count).
+ *
+ * The keys are the full 96-bit PH keys (x, y and z word of the uint4 keys, as
+ * the tree uses them), stored in two 64-bit words. The probes are interpolated
+ * exactly in 96 bits and the local estimates are reduced with a lexicographic
+ * minimum over both words.
+ *
+ * The search is a sequence of MPI_Iallreduce calls. Constructed with
+ * blocking = false it returns directly, test() then advances the search as far
+ * as the completed reductions allow, wait() completes it. The keys and weights
+ * have to stay valid until the search is done. Every call is collective on
+ * mpi_comm, a separate communicator is needed when the search runs at the same
+ * time as other collectives.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <mpi.h>
+#include <vector>
+
+struct DDHistogram
+{
+  /* 96-bit key, hi holds key.x and lo holds key.y and key.z of the uint4 PH key */
+  struct Key
+  {
+    unsigned long long hi, lo;
+
+    Key() : hi(0), lo(0) {}
+    Key(const unsigned long long _hi, const unsigned long long _lo) : hi(_hi), lo(_lo) {}
+    explicit Key(const uint4 key) : hi(key.x), lo((static_cast<unsigned long long>(key.y) << 32) | key.z) {}
+
+    uint4 get_uint4() const
+    {
+      return make_uint4((uint)hi, (uint)(lo >> 32), (uint)(lo & 0xFFFFFFFF), 0);
+    }
+
+    static Key max() { return Key(0xFFFFFFFFULL, 0xFFFFFFFFFFFFFFFFULL); }
+
+    bool operator< (const Key &a) const { return hi < a.hi || (hi == a.hi && lo < a.lo); }
+    bool operator==(const Key &a) const { return hi == a.hi && lo == a.lo; }
+    bool operator<=(const Key &a) const { return !(a < *this); }
+    bool operator>=(const Key &a) const { return !(*this < a); }
+
+    /* order reversing, used to reduce the maximum with the minimum */
+    Key operator~() const { return Key(~hi, ~lo); }
+
+    Key next() const { return (lo == 0xFFFFFFFFFFFFFFFFULL) ? Key(hi+1, 0) : Key(hi, lo+1); }
+
+    /* a + (b-a)*num/den for a <= b, exact in 96 bits with 32-bit limbs */
+    static Key interpolate(const Key &a, const Key &b, const unsigned int num, const unsigned int den)
+    {
+      unsigned long long d[3], borrow = 0;
+      const unsigned long long wa[3] = {a.lo & 0xFFFFFFFF, a.lo >> 32, a.hi & 0xFFFFFFFF};
+      const unsigned long long wb[3] = {b.lo & 0xFFFFFFFF, b.lo >> 32, b.hi & 0xFFFFFFFF};
+      for (int i = 0; i < 3; i++)
+      {
+        const unsigned long long t = wb[i] - wa[i] - borrow;
+        borrow = (wb[i] < wa[i] + borrow) ? 1 : 0;
+        d[i]   = t & 0xFFFFFFFF;
+      }
+
+      /* (d*num)/den from the top limb down, the product has 4 limbs */
+      unsigned long long p[4], carry = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        const unsigned long long t = d[i]*num + carry;
+        p[i]  = t & 0xFFFFFFFF;
+        carry = t >> 32;
+      }
+      p[3] = carry;
+      unsigned long long q[4], rem = 0;
+      for (int i = 3; i >= 0; i--)
+      {
+        const unsigned long long t = (rem << 32) | p[i];
+        q[i] = t / den;
+        rem  = t % den;
+      }
+
+      /* add to a, the result is at most b so fits in 96 bits */
+      unsigned long long r[3];
+      carry = 0;
+      for (int i = 0; i < 3; i++)
+      {
+        const unsigned long long t = wa[i] + q[i] + carry;
+        r[i]  = t & 0xFFFFFFFF;
+        carry = t >> 32;
+      }
+      return Key(r[2], (r[1] << 32) | r[0]);
+    }
+  };
+
+  enum {NPROBE = 8, MAXROUND = 32};
+
+  enum Phase {PHASE_TOTAL, PHASE_PREV, PHASE_ESTIMATE, PHASE_COUNT, PHASE_DONE};
+
+  private:
+
+  const int nProc;
+  const MPI_Comm mpi_comm;
+
+  const std::vector<Key> &keys;   //Local keys, sorted
+  const double weight;            //Weight of each local key
+  const std::vector<double> *cumWeight; //If set, weight of the keys before index i, size keys.size()+1
+
+  std::vector<Key> boundaries;
+
+  /* search state */
+  Phase       phase;
+  MPI_Request req;
+  double      tolerance, damping;
+  int         nSplit;
+  double      total, mean;
+  double      localTotal;
+  std::vector<Key>    prev;     //Previous boundaries, used when damping < 1
+  std::vector<Key>    lo, hi;   //Search interval of every splitter: count(lo) <= target <= count(hi)
+  std::vector<double> wLo, wHi, target;
+  std::vector<char>   done;
+  std::vector<int>    active;
+  std::vector<Key>    estimate, probes;
+  std::vector<double> wLocal, wGlobal;
+
+  MPI_Datatype keyType;           //Two MPI_UNSIGNED_LONG_LONG
+  MPI_Op       keyMin;            //Lexicographic minimum of two-word keys
+
+  static void keyMinFunction(void *in, void *inout, int *len, MPI_Datatype *)
+  {
+    const Key *a = static_cast<const Key*>(in);
+    Key       *b = static_cast<Key*>(inout);
+    for (int i = 0; i < *len; i++)
+      if (a[i] < b[i]) b[i] = a[i];
+  }
+
+  public:
+
+  int    nRounds;                 //Number of Allreduce rounds used
+  size_t nBytes;                  //Contributed to the Allreduce calls by this process
+  double maxError;                //Largest distance of a splitter to its target, relative to the mean
+
+  const Key& keybeg(const int proc) const {return boundaries[proc  ];}
+  const Key& keyend(const int proc) const {return boundaries[proc+1];}
+
+  private:
+
+  double weightBelow(const int idx) const
+  {
+    return cumWeight ? (*cumWeight)[idx] : weight*idx;
+  }
+
+  //Local weighted number of keys smaller than key
+  double countBelow(const Key key) const
+  {
+    return weightBelow(std::lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+  }
+
+  //Index of the key in [ia, ib) at fraction f of the weight in that range
+  int localPosition(const int ia, const int ib, const double f) const
+  {
+    if (!cumWeight)
+      return std::min(ib-1, ia + std::max(0, (int)(f*(ib-ia))));
+
+    const double w = (*cumWeight)[ia] + f*((*cumWeight)[ib] - (*cumWeight)[ia]);
+    const int  idx = std::upper_bound(cumWeight->begin()+ia, cumWeight->begin()+ib+1, w) - cumWeight->begin() - 1;
+    return std::max(ia, std::min(ib-1, idx));
+  }
+
+  public:
+
+  /* keys must be sorted in increasing order, tolerance is the allowed deviation
+   * of the weighted count per domain relative to the mean */
+  DDHistogram(const int _nProc, const std::vector<Key> &_keys, const double _weight,
+              const double _tolerance, const MPI_Comm &_mpi_comm,
+              const Key *prevBoundaries = NULL, const double _damping = 1.0,
+              const bool blocking = true) :
+    nProc(_nProc), mpi_comm(_mpi_comm), keys(_keys), weight(_weight), cumWeight(NULL), nRounds(0), nBytes(0), maxError(0)
+  {
+    start(_tolerance, prevBoundaries, _damping);
+    if (blocking) wait();
+  }
+
+  /* per key weights, _cumWeight[i] is the sum of the weights of keys[0..i-1] */
+  DDHistogram(const int _nProc, const std::vector<Key> &_keys, const std::vector<double> &_cumWeight,
+              const double _tolerance, const MPI_Comm &_mpi_comm,
+              const Key *prevBoundaries = NULL, const double _damping = 1.0,
+              const bool blocking = true) :
+    nProc(_nProc), mpi_comm(_mpi_comm), keys(_keys), weight(0), cumWeight(&_cumWeight), nRounds(0), nBytes(0), maxError(0)
+  {
+    assert(cumWeight->size() == keys.size()+1);
+    start(_tolerance, prevBoundaries, _damping);
+    if (blocking) wait();
+  }
+
+  ~DDHistogram()
+  {
+    if (phase != PHASE_DONE) wait();
+    MPI_Op_free(&keyMin);
+    MPI_Type_free(&keyType);
+  }
+
+  bool isDone() const { return phase == PHASE_DONE; }
+
+  /* advance the search with the reductions that completed, returns true when done */
+  bool test()
+  {
+    while (phase != PHASE_DONE)
+    {
+      int flag = 0;
+      MPI_Test(&req, &flag, MPI_STATUS_IGNORE);
+      if (!flag) return false;
+      advance();
+    }
+    return true;
+  }
+
+  void wait()
+  {
+    while (phase != PHASE_DONE)
+    {
+      MPI_Wait(&req, MPI_STATUS_IGNORE);
+      advance();
+    }
+  }
+
+  /* number of keys (unweighted) in every domain, collective */
+  void globalCounts(std::vector<double> &counts) const
+  {
+    assert(phase == PHASE_DONE);
+    std::vector<double> local(nProc);
+    int prev = 0;
+    for (int p = 0; p < nProc; p++)
+    {
+      const int next = (p+1 < nProc) ? std::lower_bound(keys.begin(), keys.end(), boundaries[p+1]) - keys.begin()
+                                     : (int)keys.size();
+      local[p] = next - prev;
+      prev     = next;
+    }
+    counts.resize(nProc);
+    MPI_Allreduce(&local[0], &counts[0], nProc, MPI_DOUBLE, MPI_SUM, mpi_comm);
+  }
+
+  private:
+
+  void start(const double _tolerance, const Key *prevBoundaries, const double _damping)
+  {
+    assert(std::is_sorted(keys.begin(), keys.end()));
+
+    tolerance = _tolerance;
+    damping   = _damping;
+    nSplit    = nProc-1;
+    req       = MPI_REQUEST_NULL;
+
+    MPI_Type_contiguous(2, MPI_UNSIGNED_LONG_LONG, &keyType);
+    MPI_Type_commit(&keyType);
+    MPI_Op_create(keyMinFunction, 1, &keyMin);
+
+    boundaries.resize(nProc+1);
+    boundaries[0]     = Key();
+    boundaries[nProc] = Key::max();
+    if (nSplit == 0)
+    {
+      phase = PHASE_DONE;
+      return;
+    }
+
+    if (prevBoundaries && damping < 1.0)
+      prev.assign(prevBoundaries, prevBoundaries + nProc + 1);
+
+    localTotal = weightBelow(keys.size());
+    phase      = PHASE_TOTAL;
+    nBytes    += sizeof(double);
+    MPI_Iallreduce(&localTotal, &total, 1, MPI_DOUBLE, MPI_SUM, mpi_comm, &req);
+  }
+
+  /* post the reduction of the local estimates of the active splitters, or finish */
+  void startRound()
+  {
+    active.clear();
+    for (int s = 0; s < nSplit; s++)
+      if (!done[s]) active.push_back(s);
+
+    if (active.empty() || nRounds >= MAXROUND)
+    {
+      finish();
+      return;
+    }
+
+    const int nActive = active.size();
+
+    /* local estimate of every splitter, min and max are reduced together */
+    estimate.resize(2*nActive);
+    for (int i = 0; i < nActive; i++)
+    {
+      const int s  = active[i];
+      const int ia = std::lower_bound(keys.begin(), keys.end(), lo[s]) - keys.begin();
+      const int ib = std::lower_bound(keys.begin(), keys.end(), hi[s]) - keys.begin();
+
+      Key kmin = hi[s], kmax = lo[s]; //Does not restrict the others if we have no keys in the interval
+      if (ib > ia)
+      {
+        const double f = (target[s] - wLo[s]) / std::max(wHi[s] - wLo[s], 1e-30);
+        kmin = kmax = keys[localPosition(ia, ib, f)];
+      }
+      estimate[2*i  ] =  kmin;
+      estimate[2*i+1] = ~kmax;
+    }
+    phase   = PHASE_ESTIMATE;
+    nBytes += 2*nActive*sizeof(Key);
+    MPI_Iallreduce(MPI_IN_PLACE, &estimate[0], 2*nActive, keyType, keyMin, mpi_comm, &req);
+  }
+
+  /* process the completed reduction and post the next one */
+  void advance()
+  {
+    switch (phase)
+    {
+      case PHASE_TOTAL:
+      {
+        mean = total / nProc;
+
+        lo.assign(nSplit, Key());
+        hi.assign(nSplit, boundaries[nProc]);
+        wLo.assign(nSplit, 0);
+        wHi.assign(nSplit, total);
+        target.resize(nSplit);
+        done.assign(nSplit, 0);
+        for (int s = 0; s < nSplit; s++)
+        {
+          target[s]       = mean*(s+1);
+          boundaries[s+1] = hi[s];
+        }
+
+        if (!prev.empty())
+        {
+          wLocal.resize(nSplit);
+          wGlobal.resize(nSplit);
+          for (int s = 0; s < nSplit; s++)
+            wLocal[s] = countBelow(prev[s+1]);
+          phase   = PHASE_PREV;
+          nBytes += nSplit*sizeof(double);
+          MPI_Iallreduce(&wLocal[0], &wGlobal[0], nSplit, MPI_DOUBLE, MPI_SUM, mpi_comm, &req);
+        }
+        else
+          startRound();
+        break;
+      }
+      case PHASE_PREV:
+      {
+        for (int s = 0; s < nSplit; s++)
+          target[s] = wGlobal[s] + damping*(target[s] - wGlobal[s]);
+        startRound();
+        break;
+      }
+      case PHASE_ESTIMATE:
+      {
+        const int nActive = active.size();
+
+        /* probes: min, max+1 and evenly spaced keys in between */
+        probes.resize(NPROBE*nActive);
+        for (int i = 0; i < nActive; i++)
+        {
+          const int s    = active[i];
+          const Key pmin = std::max(lo[s], estimate[2*i]);
+          Key       pmax = std::max(pmin, ~estimate[2*i+1]);
+          pmax           = (pmax < hi[s]) ? pmax.next() : hi[s];
+          for (int j = 0; j < NPROBE; j++)
+            probes[i*NPROBE+j] = Key::interpolate(pmin, pmax, j, NPROBE-1);
+          probes[i*NPROBE+NPROBE-1] = pmax;
+        }
+
+        wLocal.resize(NPROBE*nActive);
+        wGlobal.resize(NPROBE*nActive);
+        for (int i = 0; i < NPROBE*nActive; i++)
+          wLocal[i] = countBelow(probes[i]);
+        phase   = PHASE_COUNT;
+        nBytes += NPROBE*nActive*sizeof(double);
+        MPI_Iallreduce(&wLocal[0], &wGlobal[0], NPROBE*nActive, MPI_DOUBLE, MPI_SUM, mpi_comm, &req);
+        break;
+      }
+      case PHASE_COUNT:
+      {
+        const int    nActive = active.size();
+        const double tol     = tolerance*mean;
+
+        /* narrow the intervals, every process takes the same decisions */
+        for (int i = 0; i < nActive; i++)
+        {
+          const int s = active[i];
+          for (int j = 0; j < NPROBE; j++)
+          {
+            const Key    p = probes [i*NPROBE+j];
+            const double w = wGlobal[i*NPROBE+j];
+            if (w <= target[s] && p >= lo[s]) { lo[s] = p; wLo[s] = w; }
+            if (w >= target[s] && p <= hi[s]) { hi[s] = p; wHi[s] = w; }
+          }
+
+          const double errLo = target[s] - wLo[s];
+          const double errHi = wHi[s] - target[s];
+          boundaries[s+1] = (errLo <= errHi) ? lo[s] : hi[s];
+
+          /* converged, or no keys left between the bracketing probes */
+          if (std::min(errLo, errHi) <= tol || hi[s] <= lo[s].next() || wHi[s] == wLo[s])
+            done[s] = 1;
+        }
+        nRounds++;
+        startRound();
+        break;
+      }
+      case PHASE_DONE:
+        break;
+    }
+  }
+
+  void finish()
+  {
+    maxError = 0;
+    for (int s = 0; s < nSplit; s++)
+      maxError = std::max(maxError, std::min(target[s] - wLo[s], wHi[s] - target[s]) / mean);
+
+    /* domains must be non-empty in key space */
+    for (int p = 1; p < nProc; p++)
+      boundaries[p] = std::max(boundaries[p], boundaries[p-1].next());
+
+    for (int p = 0; p < nProc; p++)
+      assert(boundaries[p] < boundaries[p+1]);
+
+    phase = PHASE_DONE;
+  }
+};
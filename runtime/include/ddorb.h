@@ -0,0 +1,246 @@
+#pragma once
+
+/*
+ * Domain decomposition by weighted orthogonal recursive bisection (ORB).
+ *
+ * The processes are split recursively in two halves. The particles of a box
+ * are split along its longest axis, at the coordinate where the weight on the
+ * left matches the share of the processes in the left half. The coordinate is
+ * found with a histogram search: the weights of the particles in the search
+ * interval are binned along the axis, summed over all processes with an
+ * MPI_Allreduce, and the interval is narrowed to the bin that contains the
+ * target. This is repeated NROUND times and the split is interpolated in the
+ * last bin. All boxes of one level are searched together, a decomposition
+ * takes NROUND*ceil(log2(nProc)) reductions.
+ *
+ * Unlike the key ranges of the PH-curve the domains are convex boxes, at the
+ * cost of a particle to domain lookup that walks the bisection tree. The tree
+ * has 2*nProc-1 nodes, stored as int4 so it can be copied to the device:
+ *
+ *   split: {axis, split (float bits), left child, right child}
+ *   leaf : {-1,   0,                  process,    0}
+ *
+ * A particle with coordinate < split belongs to the left child. domain()
+ * and the kernels in parallel.cu use exactly this comparison, so the host and
+ * the device agree on the domain of every particle. Positions outside the
+ * current particle extent go to the outer domains, boxes only covers the extent.
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <cfloat>
+#include <cstring>
+#include <mpi.h>
+#include <vector>
+
+struct DDORB
+{
+  enum {NBIN = 64, NROUND = 4};
+
+  struct Box
+  {
+    float lo[3], hi[3];
+  };
+
+  std::vector<int4>   nodes;    //Bisection tree, root at 0
+  std::vector<Box>    boxes;    //Domain of every process, limited to the particle extent
+  std::vector<double> counts;   //Particles per domain
+  std::vector<double> weights;  //Weight per domain
+  int    nRounds;               //Reductions used for the splits
+  size_t nBytes;                //Send by this process
+
+  private:
+
+  struct Part
+  {
+    int p0, p1;   //Processes [p0, p1)
+    int node;     //Tree node
+    Box box;
+  };
+
+  public:
+
+  //weight NULL gives every particle the weight unitWeight
+  DDORB(const int nProc, const real4 *pos, const int n, const double *weight,
+        const double unitWeight, const MPI_Comm &comm) :
+    nodes(2*nProc-1), boxes(nProc), counts(nProc), weights(nProc), nRounds(0), nBytes(0)
+  {
+    //Global extent of the particles
+    float ext[6] = {FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX, FLT_MAX}; //min and -max
+    for(int i=0; i < n; i++)
+    {
+      ext[0] = std::min(ext[0],  pos[i].x); ext[3] = std::min(ext[3], -pos[i].x);
+      ext[1] = std::min(ext[1],  pos[i].y); ext[4] = std::min(ext[4], -pos[i].y);
+      ext[2] = std::min(ext[2],  pos[i].z); ext[5] = std::min(ext[5], -pos[i].z);
+    }
+    MPI_Allreduce(MPI_IN_PLACE, ext, 6, MPI_FLOAT, MPI_MIN, comm);
+    nBytes += sizeof(ext);
+
+    std::vector<Part> level(1), next;
+    level[0].p0   = 0;
+    level[0].p1   = nProc;
+    level[0].node = 0;
+    for(int k=0; k < 3; k++)
+    {
+      level[0].box.lo[k] =  ext[k];
+      level[0].box.hi[k] = -ext[3+k];
+    }
+    int nNodes = 1;
+
+    std::vector<int>    owner(n, 0);        //Part of every particle, -1 once in a leaf
+    std::vector<double> localCount(nProc, 0), localWeight(nProc, 0);
+    std::vector<int>    split;              //Index in level of the parts that are split
+    std::vector<int>    splitIdx;           //For every part its index in split, or -1
+    std::vector<int>    axis;
+    std::vector<double> a, b, below, target;
+    std::vector<double> hist;
+
+    while(!level.empty())
+    {
+      split.clear();
+      splitIdx.assign(level.size(), -1);
+      for(size_t s=0; s < level.size(); s++)
+        if(level[s].p1 - level[s].p0 > 1)
+        {
+          splitIdx[s] = split.size();
+          split.push_back(s);
+        }
+
+      const int nSplit = split.size();
+      axis.resize(nSplit); a.resize(nSplit); b.resize(nSplit);
+      below.assign(nSplit, 0); target.assign(nSplit, -1);
+
+      for(int j=0; j < nSplit; j++)
+      {
+        const Box &box = level[split[j]].box;
+        int ax = 0;
+        for(int k=1; k < 3; k++)
+          if(box.hi[k]-box.lo[k] > box.hi[ax]-box.lo[ax]) ax = k;
+        axis[j] = ax;
+        a[j]    = box.lo[ax];
+        b[j]    = box.hi[ax];
+      }
+
+      //Narrow the interval of every split down to one bin
+      for(int round=0; round < NROUND && nSplit > 0; round++)
+      {
+        hist.assign(nSplit*(NBIN+1), 0);  //Weight below the interval, and the bins
+        for(int i=0; i < n; i++)
+        {
+          if(owner[i] < 0) continue;
+          const int j = splitIdx[owner[i]];
+          if(j < 0) continue;
+          const double x = coord(pos[i], axis[j]);
+          const double w = weight ? weight[i] : unitWeight;
+          if(x < a[j])  { hist[j*(NBIN+1)] += w; continue; }
+          if(x >= b[j] && round > 0) continue;   //Above the interval, the first covers the full box
+          const double dx  = (b[j]-a[j]) / NBIN;
+          const int    bin = dx > 0 ? std::min((int)((x - a[j]) / dx), NBIN-1) : NBIN-1;
+          hist[j*(NBIN+1) + 1 + bin] += w;
+        }
+        MPI_Allreduce(MPI_IN_PLACE, &hist[0], hist.size(), MPI_DOUBLE, MPI_SUM, comm);
+        nBytes += hist.size()*sizeof(double);
+        nRounds++;
+
+        for(int j=0; j < nSplit; j++)
+        {
+          const double *h = &hist[j*(NBIN+1)];
+          if(round == 0)
+          {
+            //The interval is the full box, the total weight is known after the first round
+            const Part &part = level[split[j]];
+            const int    mid = part.p0 + (part.p1 - part.p0)/2;
+            double total = 0;
+            for(int k=0; k <= NBIN; k++) total += h[k];
+            target[j] = total * (mid - part.p0) / (double)(part.p1 - part.p0);
+          }
+
+          double       cum = h[0];
+          const double dx  = (b[j]-a[j]) / NBIN;
+          int k = 0;
+          while(k < NBIN-1 && cum + h[1+k] < target[j]) cum += h[1+k++];
+
+          below[j] = cum;
+          const double frac = h[1+k] > 0 ? std::max(0.0, std::min(1.0, (target[j] - cum) / h[1+k])) : 0;
+          const double lo   = a[j] + k*dx;
+          if(round == NROUND-1)
+            a[j] = lo + frac*dx;    //The split
+          else
+          {
+            a[j] = lo;
+            b[j] = lo + dx;
+          }
+        }
+      }
+
+      //Create the children, the particles of a leaf are done
+      next.clear();
+      std::vector<int> firstChild(level.size(), -1);
+      for(size_t s=0; s < level.size(); s++)
+      {
+        const Part &part = level[s];
+        const int   j    = splitIdx[s];
+        if(j < 0)
+        {
+          nodes[part.node]  = make_int4(-1, 0, part.p0, 0);
+          boxes[part.p0]    = part.box;
+          continue;
+        }
+
+        const float sp = (float)a[j];
+        Part left = part, right = part;
+        left.p1   = right.p0 = part.p0 + (part.p1 - part.p0)/2;
+        left.box.hi[axis[j]] = right.box.lo[axis[j]] = sp;
+        left.node  = nNodes++;
+        right.node = nNodes++;
+
+        int spBits;
+        memcpy(&spBits, &sp, sizeof(int));
+        nodes[part.node] = make_int4(axis[j], spBits, left.node, right.node);
+
+        firstChild[s] = next.size();
+        next.push_back(left);
+        next.push_back(right);
+      }
+
+      for(int i=0; i < n; i++)
+      {
+        if(owner[i] < 0) continue;
+        const Part &part = level[owner[i]];
+        const int   j    = splitIdx[owner[i]];
+        if(j < 0)
+        {
+          localCount [part.p0] += 1;
+          localWeight[part.p0] += weight ? weight[i] : unitWeight;
+          owner[i] = -1;
+        }
+        else
+          owner[i] = firstChild[owner[i]] + (coord(pos[i], axis[j]) < (float)a[j] ? 0 : 1);
+      }
+      level.swap(next);
+    }
+    assert(nNodes == 2*nProc-1);
+
+    MPI_Allreduce(&localCount [0], &counts [0], nProc, MPI_DOUBLE, MPI_SUM, comm);
+    MPI_Allreduce(&localWeight[0], &weights[0], nProc, MPI_DOUBLE, MPI_SUM, comm);
+    nBytes += 2*nProc*sizeof(double);
+  }
+
+  static float coord(const real4 &p, const int axis)
+  {
+    return axis == 0 ? p.x : (axis == 1 ? p.y : p.z);
+  }
+
+  //Process that owns position p
+  int domain(const real4 &p) const
+  {
+    int idx = 0;
+    while(nodes[idx].x >= 0)
+    {
+      float sp;
+      memcpy(&sp, &nodes[idx].y, sizeof(float));
+      idx = coord(p, nodes[idx].x) < sp ? nodes[idx].z : nodes[idx].w;
+    }
+    return nodes[idx].z;
+  }
+};
@@ -41,6 +41,25 @@ typedef struct bodyStruct
 #endif
 } bodyStruct;
 
+//Minimal state of a particle that migrates to another process. Ppos and Pvel
+//are not send, the receiver rebuilds them with the predictor. Plain floats so
+//the struct is not padded to the alignment of real4 (72 instead of 96 bytes)
+typedef struct migrationStruct
+{
+  float  pos [4];
+  float  vel [4];
+  float  acc0[4];
+  float2 time;
+  unsigned long long id;
+  float  h;
+  float  pad;       //Size must be a multiple of sizeof(double), see the exchange
+
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+  uint  key [4];
+  float acc1[4];
+#endif
+} migrationStruct;
+
 
 
 
@@ -36,6 +36,7 @@
 #include "tipsyIO.h"
 #include "log.h"
 #include "FileIO.h"
+#include "LoadBalance.h"
 
 
 
@@ -213,6 +214,8 @@ class tree_structure
     
     uint startLevelMin;                   //The level from which we start the tree-walk
                                           //this is decided by the tree-structure creation
+    int buildCount;                       //Number of times the tree has been (re)build, used
+                                          //to check if cached node indices are still valid
 
     //Variables used for iteration
     int n_active_groups;
@@ -268,6 +271,7 @@ class tree_structure
     my_dev::dev_mem<float4> groupCenterInfo;
 
     my_dev::dev_mem<uint4> parallelBoundaries;
+    my_dev::dev_mem<int4>  orbNodes;          //Bisection tree of the ORB decomposition
 
     //Combined buffers:
     /*
@@ -288,7 +292,7 @@ class tree_structure
 
     
 
-  tree_structure(){ n = 0;}
+  tree_structure(){ n = 0; buildCount = 0;}
 
 
   void setN(int particles) { n = particles; }
@@ -334,6 +338,15 @@ protected:
   float theta;
 
   bool  useDirectGravity;
+  int   letCodecBits;       //LET compression, 0 off, 32 lossless, otherwise position bits
+  bool  useNeighbourComm;   //Use neighbourhood collectives for the LET and particle exchange
+  bool  useNodeSharedLET;   //Build the LETs of processes on the same node from shared memory
+  bool  useAsyncDD;         //Search the boundaries of the next update during the gravity computation
+  float grpTreeDeltaTol;    //Broadcast only the group-tree nodes that moved more than this, 0 is off
+  int   commMatrixInterval; //Steps per dump of the per peer communication statistics, 0 is off
+  bool  useProgressThread;  //Complete the LET sends and receives on a dedicated MPI progress thread
+  bool  useORB;             //Orthogonal recursive bisection instead of the PH-curve domains
+  int   letStreamMB;        //Walk the received LETs in batches of at most this size (MB) as they arrive, 0 is off
 
   //Simulation statistics
   double Ekin, Ekin0, Ekin1;
@@ -397,7 +410,10 @@ protected:
   my_dev::kernel internalMoveSFC2;
   my_dev::kernel extractOutOfDomainParticlesAdvancedSFC2;
   my_dev::kernel insertNewParticlesSFC;
+  my_dev::kernel insertNewParticlesRecord;
   my_dev::kernel domainCheckSFCAndAssign;
+  my_dev::kernel internalMoveORB;
+  my_dev::kernel domainCheckORBAndAssign;
 
   ///////////////////////
 
@@ -513,6 +529,7 @@ public:
 
   void iterate(bool amuse = false);
   void iterate_setup(); 
+  void iterate_benchmark(const float drift);
   void iterate_teardown(IterationData &idata); 
   bool iterate_once(IterationData &idata); 
 
@@ -545,6 +562,32 @@ public:
   double prevDurStep;   //Duration of gravity time in previous step
   double thisPartLETExTime;     //The time it took to communicate with the neighbours during the last step
 
+  //Time and volume of the parallel phases, accumulated until reset. Reported by bench_let
+  struct ParallelStats
+  {
+    double tDomain;                     //Boundary search, incl. the key computation
+    double tExchange;                   //Particle exchange
+    double tBuild;                      //Sort, tree-construction and properties (GPU)
+    double tHostTree;                   //build_GroupTree on the particle keys
+    double tGrpTree;                    //Group tree extraction and exchange
+    double tLET;                        //essential_tree_exchangeV2
+    double tGravity;                    //Local and LET gravity, incl. tGrpTree and tLET
+    unsigned long long bytesDomain;     //Send by the boundary search
+    unsigned long long bytesExchange;   //Particles send to other processes
+    unsigned long long bytesGrpTree;    //Small (all-gather) and full group trees send
+    unsigned long long bytesLET;        //LETs send, after compression
+    int    nExchanged;                  //Particles send to other processes
+    int    nGrpTreeNodes;               //Nodes in our small and full group tree
+    int    nQuickChecks;                //Remote boundaries tested against our tree
+    int    nQuickPruned;                //Remote boundaries skipped by the peer BVH, without a tree walk
+    int    nHostTreeNodes;              //Nodes build by build_GroupTree
+    int    nLETs, nLETNodes;            //LETs build and their nodes
+    int    nLETBatches;                 //Merged batches of received LETs, one remote walk each
+    double tQuickCheck;                 //In getLEToptQuickTreevsTree, summed over the LET threads
+
+    void reset() { *this = ParallelStats(); }
+  } parStats;
+
   double4 *currentRLow, *currentRHigh;  //Contains the actual domain distribution, to be used
                                         //during the LET-tree generatino
 
@@ -562,6 +605,7 @@ public:
 
   float maxExecTimePrevStep;      //Maximum duration of gravity computation over all processes
   float avgExecTimePrevStep;      //Average duration of gravity computation over all processes
+  LoadBalanceController lbController; //Decides when and how far the domain boundaries are updated
 
 
   int grpTree_n_nodes;
@@ -574,11 +618,14 @@ public:
   real4 rMaxGlobal;
   
   bool letRunning;
+  int  letStagedSize;             //Merged batch in remoteTree that still has to be walked, 0 if none
+  bool letStagedActive;           //That batch is the last one of this step
   
   sampleRadInfo *curSysState;
 
   //Functions
   void mpiSetup();
+  void mpiRelease();
 
 
   //Utility
@@ -654,6 +701,11 @@ public:
                                            int    totalCount,   uint4 *parallelBoundaries, float lastExectime,
                                            bool initialSetup);
 
+  void updateBoundaryORB(double f_lb, double timeShare, double mem_cap, bool initialSetup);
+
+  void startAsyncDomainUpdate(float lastExecTime);
+  void progressAsyncDomainUpdate();
+
   void essential_tree_exchangeV2(tree_structure &tree,
                                  tree_structure &remote,
                                  vector<real4> &topLevelTrees,
@@ -675,6 +727,8 @@ public:
                                       int            *treeBuffersSource,
                                       real4         **treeBuffers);
 
+  void launchStagedLET();
+
 
   int recursiveTopLevelCheck(uint4 checkNode, real4* treeBoxSizes, real4* treeBoxCenters, real4* treeBoxMoments,
                           real4* grpCenter, real4* grpSize, int &DistanceCheck, int &DistanceCheckPP, int maxLevel);
@@ -703,6 +757,25 @@ public:
   float get_t_current() const       { return t_current; }
   void setUseDirectGravity(bool s)  { useDirectGravity = s;    }
   bool getUseDirectGravity() const  { return useDirectGravity; }
+  void setLETCompression(int bits)  { letCodecBits = bits;     }
+  int  getLETCompression() const    { return letCodecBits;     }
+  void setUseNeighbourComm(bool s)  { useNeighbourComm = s;    }
+  bool getUseNeighbourComm() const  { return useNeighbourComm; }
+  void setUseNodeSharedLET(bool s)  { useNodeSharedLET = s;    }
+  bool getUseNodeSharedLET() const  { return useNodeSharedLET; }
+  void setUseAsyncDD(bool s)        { useAsyncDD = s;          }
+  bool getUseAsyncDD() const        { return useAsyncDD;       }
+  void setGrpTreeDelta(float tol)   { grpTreeDeltaTol = tol;   }
+  float getGrpTreeDelta() const     { return grpTreeDeltaTol;  }
+  void setCommMatrix(int interval);
+  int  getCommMatrix() const        { return commMatrixInterval; }
+  void commMatrixEndStep();
+  void setUseProgressThread(bool s) { useProgressThread = s;   }
+  bool getUseProgressThread() const { return useProgressThread; }
+  void setUseORB(bool s)            { useORB = s;              }
+  bool getUseORB() const            { return useORB;           }
+  void setLETStream(int mb)         { letStreamMB = mb;        }
+  int  getLETStream() const         { return letStreamMB;      }
 
   octree(const MPI_Comm &comm,
          my_dev::context *devContext_,
@@ -725,6 +798,18 @@ public:
   {
     iter            = 0;
     t_current       = t_previous = 0;
+    letCodecBits    = 0;
+    useNeighbourComm = false;
+    useNodeSharedLET = false;
+    useAsyncDD       = false;
+    grpTreeDeltaTol  = 0;
+    commMatrixInterval = 0;
+    useProgressThread  = false;
+    useORB             = false;
+    letStreamMB        = 0;
+    letStagedSize      = 0;
+    letStagedActive    = false;
+    parStats.reset();
     src_directory   = NULL;
 
     if(argv != NULL)  execPath = argv[0];
@@ -804,6 +889,8 @@ public:
 #endif
   }
   ~octree() {
+    mpiRelease();
+
     delete[] currentRLow;
     delete[] currentRHigh;
     delete[] curSysState;
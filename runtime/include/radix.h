@@ -35,6 +35,9 @@ struct Keys<32>
 
     operator uint() const {return get_uint(0);}
 
+    bool operator< (const Keys &a) const { return key <  a.key; }
+    bool operator==(const Keys &a) const { return key == a.key; }
+
 #if 1
     Keys(const uint4 value) : key(static_cast<ulong>(value.x)) {}
     uint4 get_uint4() const 
@@ -73,6 +76,9 @@ struct Keys<64>
 
 
     operator uint() const {return get_uint(0);}
+
+    bool operator< (const Keys &a) const { return key <  a.key; }
+    bool operator==(const Keys &a) const { return key == a.key; }
 #if 1
     Keys(const uint4 value) :
       key((static_cast<ulong>(value.x) << 32) | static_cast<ulong>(value.y)) {}
@@ -114,6 +120,9 @@ struct Keys<96>
 
 
     operator uint() const {return get_uint(0);}
+
+    bool operator< (const Keys &a) const { return key <  a.key; }
+    bool operator==(const Keys &a) const { return key == a.key; }
 #if 1
     Keys(const uint4 value) :
       key((static_cast<ulong>(value.x) << 64) | 
@@ -0,0 +1,108 @@
+/*
+ * Benchmark of the all-to-all algorithms in MPIAlltoall.h
+ *
+ * mpirun -np 64 ./bench_alltoall [bytes per message] [fraction of non-empty messages] [ranks per node] [iterations]
+ *
+ * ranks per node > 0 emulates nodes of that size for the hierarchical exchange,
+ * 0 uses the real (shared memory) node layout. Every algorithm is checked
+ * against MPI_Alltoall / MPI_Alltoallv.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "MPIAlltoall.h"
+
+static unsigned int message(const int src, const int dst, const int i)
+{
+  return (src*2654435761u) ^ (dst*40503u) ^ (i*2246822519u);
+}
+
+int main(int argc, char *argv[])
+{
+  MPI_Init(&argc, &argv);
+  MPI_Comm comm = MPI_COMM_WORLD;
+
+  int rank, nProc;
+  MPI_Comm_rank(comm, &rank);
+  MPI_Comm_size(comm, &nProc);
+
+  const int    bytes        = (argc > 1) ? atoi(argv[1]) : 64;
+  const double density      = (argc > 2) ? atof(argv[2]) : 1.0;
+  const int    ranksPerNode = (argc > 3) ? atoi(argv[3]) : 0;
+  const int    nIter        = (argc > 4) ? atoi(argv[4]) : 20;
+
+  All2all a2a(comm, ranksPerNode);
+  if(rank == 0)
+    fprintf(stderr, "bench_alltoall: nProc= %d nNodes= %d bytes= %d density= %g iterations= %d\n",
+            nProc, a2a.nNodes, bytes, density, nIter);
+
+  /* fixed size blocks */
+  {
+    const int nWords = std::max(1, bytes / (int)sizeof(unsigned int));
+    std::vector<unsigned int> sbuf((size_t)nWords*nProc), rbuf(sbuf.size()), ref(sbuf.size());
+    for(int d=0; d < nProc; d++)
+      for(int i=0; i < nWords; i++) sbuf[(size_t)d*nWords+i] = message(rank, d, i);
+    MPI_Alltoall(&sbuf[0], nWords, MPI_UNSIGNED, &ref[0], nWords, MPI_UNSIGNED, comm);
+
+    const All2all::Algorithm algs[] = {All2all::PAIRWISE, All2all::BRUCK, All2all::AUTO};
+    for(int a=0; a < 3; a++)
+    {
+      MPI_Barrier(comm);
+      const double t0 = MPI_Wtime();
+      for(int it=0; it < nIter; it++)
+        All2all::alltoall(&sbuf[0], &rbuf[0], nWords*sizeof(unsigned int), comm, algs[a]);
+      double dt = (MPI_Wtime() - t0) / nIter, dtMax;
+      MPI_Reduce(&dt, &dtMax, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+      int bad = (rbuf != ref), nBad;
+      MPI_Reduce(&bad, &nBad, 1, MPI_INT, MPI_SUM, 0, comm);
+      if(rank == 0)
+        fprintf(stderr, "alltoall  %-13s %10.3f usec  errors: %d\n", All2all::name(algs[a]), 1e6*dtMax, nBad);
+    }
+  }
+
+  /* variable size, a fraction of the pairs is empty */
+  {
+    const int nWords = std::max(1, bytes / (int)sizeof(unsigned int));
+    std::vector<int> scounts(nProc), rcounts(nProc), sdispls(nProc+1, 0), rdispls(nProc+1, 0);
+    for(int d=0; d < nProc; d++)
+    {
+      //Same decision on both sides of a pair
+      const unsigned int h = message(std::min(rank, d), std::max(rank, d), 0) % 1000;
+      scounts[d]   = (d == rank || h < density*1000) ? nWords : 0;
+      sdispls[d+1] = sdispls[d] + scounts[d];
+    }
+    MPI_Alltoall(&scounts[0], 1, MPI_INT, &rcounts[0], 1, MPI_INT, comm);
+    for(int s=0; s < nProc; s++) rdispls[s+1] = rdispls[s] + rcounts[s];
+
+    std::vector<unsigned int> sbuf(sdispls[nProc]+1), rbuf(rdispls[nProc]+1), ref(rdispls[nProc]+1);
+    for(int d=0; d < nProc; d++)
+      for(int i=0; i < scounts[d]; i++) sbuf[sdispls[d]+i] = message(rank, d, i);
+    MPI_Alltoallv(&sbuf[0], &scounts[0], &sdispls[0], MPI_UNSIGNED,
+                  &ref[0],  &rcounts[0], &rdispls[0], MPI_UNSIGNED, comm);
+
+    const All2all::Algorithm algs[] = {All2all::PAIRWISE, All2all::SPARSE, All2all::HIERARCHICAL, All2all::AUTO};
+    for(int a=0; a < 4; a++)
+    {
+      MPI_Barrier(comm);
+      const double t0 = MPI_Wtime();
+      for(int it=0; it < nIter; it++)
+      {
+        rbuf.assign(rbuf.size(), 0);
+        a2a.alltoallv(&sbuf[0], &scounts[0], &sdispls[0], &rbuf[0], &rcounts[0], &rdispls[0],
+                      sizeof(unsigned int), algs[a]);
+      }
+      double dt = (MPI_Wtime() - t0) / nIter, dtMax;
+      MPI_Reduce(&dt, &dtMax, 1, MPI_DOUBLE, MPI_MAX, 0, comm);
+
+      int bad = (rbuf != ref), nBad;
+      MPI_Reduce(&bad, &nBad, 1, MPI_INT, MPI_SUM, 0, comm);
+      if(rank == 0)
+        fprintf(stderr, "alltoallv %-13s %10.3f usec  errors: %d\n", All2all::name(algs[a]), 1e6*dtMax, nBad);
+    }
+  }
+
+  MPI_Finalize();
+  return 0;
+}
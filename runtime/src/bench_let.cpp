@@ -0,0 +1,293 @@
+/*
+ * Benchmark of the parallel code paths: domain decomposition
+ * (exchangeSamplesAndUpdateBoundarySFC), particle exchange, host tree-build
+ * (build_GroupTree), group tree exchange and the LET construction / exchange
+ * (essential_tree_exchangeV2 incl. getLEToptQuickTreevsTree)
+ *
+ * mpirun -np 8 ./bench_let --plummer 100000 --steps 20
+ * mpirun -np 8 ./bench_let --infile model3_child_compact.tipsy
+ *
+ * Meant to run many processes on a single machine, the processes share the
+ * GPUs of the machine. Every step the particles are moved along their velocity
+ * and the full parallel path is executed, without the time integration.
+ * Reported are per phase the time (average and maximum over the processes) and
+ * the bytes and nodes send (total over the processes) per step. Run once with
+ * and once without --orb to compare the LET volume and imbalance of the ORB and
+ * PH-curve domains.
+ */
+
+#include <omp.h>
+#include <mpi.h>
+
+#include <iostream>
+#include <stdlib.h>
+#include <vector>
+#include <sstream>
+#include "log.h"
+#include "anyoption.h"
+#include "HostThreads.h"
+#include "octree.h"
+
+#include <FileIO.h>
+#include <ICGenerators.h>
+
+#if ENABLE_LOG
+  bool ENABLE_RUNTIME_LOG;
+  bool PREPEND_RANK;
+  int  PREPEND_RANK_PROCID;
+  int  PREPEND_RANK_NPROCS;
+#endif
+
+using namespace std;
+
+volatile IOSharedData_t ioSharedData;
+
+long long my_dev::base_mem::currentMemUsage;
+long long my_dev::base_mem::maxMemUsage;
+
+static void printPhase(const char *name, const double t, const int nProcs, const int nSteps,
+                       const MPI_Comm comm, const int procId,
+                       const unsigned long long bytes = 0, const long long count = 0, const char *countName = "")
+{
+  double tSum = 0, tMax = 0;
+  unsigned long long bytesSum = 0;
+  long long countSum = 0;
+  MPI_Reduce(&t,     &tSum,     1, MPI_DOUBLE,             MPI_SUM, 0, comm);
+  MPI_Reduce(&t,     &tMax,     1, MPI_DOUBLE,             MPI_MAX, 0, comm);
+  MPI_Reduce(&bytes, &bytesSum, 1, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, comm);
+  MPI_Reduce(&count, &countSum, 1, MPI_LONG_LONG,          MPI_SUM, 0, comm);
+
+  if(procId == 0)
+    fprintf(stderr, "%-12s avg: %10.3f ms  max: %10.3f ms  send: %10.3f MB  %s %lld\n", name,
+            1e3*tSum/nProcs/nSteps, 1e3*tMax/nSteps, bytesSum/(1024*1024.)/nSteps, countName, countSum/nSteps);
+}
+
+int main(int argc, char** argv)
+{
+  my_dev::base_mem::currentMemUsage = 0;
+  my_dev::base_mem::maxMemUsage     = 0;
+
+  vector<real4>   bodyPositions;
+  vector<real4>   bodyVelocities;
+  vector<ullong>  bodyIDs;
+
+  float eps         = 0.05f;
+  float theta       = 0.75f;
+  float timeStep    = 1.0f / 16.0f;
+  float drift       = 1.0f;
+  int   nPlummer    = -1;
+  int   nSteps      = 10;
+  int   nWarmup     = 2;
+  int   letCompress = 0;
+  bool  neighbourComm = false;
+  float grpDelta      = 0;
+  int   commMatrix    = 0;
+  bool  progressThread = false;
+  bool  useORB         = false;
+  int   letStream      = 0;
+  string fileName;
+
+#if ENABLE_LOG
+  ENABLE_RUNTIME_LOG = false;
+  PREPEND_RANK       = false;
+#endif
+
+  {
+    AnyOption opt;
+
+#define ADDUSAGE(line) {{std::stringstream oss; oss << line; opt.addUsage(oss.str());}}
+
+    ADDUSAGE("bench_let command line usage:");
+    ADDUSAGE("                  ");
+    ADDUSAGE(" -h  --help             Prints this help ");
+    ADDUSAGE(" -i  --infile #         Input snapshot filename in Tipsy format");
+    ADDUSAGE("     --plummer #        use Plummer model with # particles per proc");
+    ADDUSAGE(" -s  --steps #          measured steps [" << nSteps << "]");
+    ADDUSAGE("     --warmup #         steps before the measurement [" << nWarmup << "]");
+    ADDUSAGE(" -t  --dt #             time step [" << timeStep << "]");
+    ADDUSAGE(" -d  --drift #          move the particles # time steps along their velocity per step [" << drift << "]");
+    ADDUSAGE(" -e  --eps #            softening (will be squared) [" << eps << "]");
+    ADDUSAGE(" -o  --theta #          opening angle (theta) [" << theta << "]");
+#if ENABLE_LOG
+    ADDUSAGE("     --log              enable logging ");
+#endif
+    ADDUSAGE("     --letcompress #    compress LET data, 0 off, 32 lossless, <32 store positions with # bits [" << letCompress << "]");
+    ADDUSAGE("     --neighbourcomm    use MPI neighbourhood collectives for the LET and particle exchange [" << (neighbourComm ? "on" : "off") << "]");
+    ADDUSAGE("     --grpdelta #       broadcast only group-tree changes larger than # times the node size, 0 is off [" << grpDelta << "]");
+    ADDUSAGE("     --commmatrix #     dump per peer communication volume and wait times every # steps, 0 is off [" << commMatrix << "]");
+    ADDUSAGE("     --progressthread   complete the LET sends and receives on a dedicated MPI progress thread [" << (progressThread ? "on" : "off") << "]");
+    ADDUSAGE("     --orb              orthogonal recursive bisection domains instead of the PH-curve [" << (useORB ? "on" : "off") << "]");
+    ADDUSAGE("     --letstream #      walk the received LETs in batches of at most # MB as they arrive, 0 is off [" << letStream << "]");
+
+    opt.setFlag  ( "help" ,   'h');
+    opt.setOption( "infile",  'i');
+    opt.setOption( "plummer");
+    opt.setOption( "steps",   's');
+    opt.setOption( "warmup");
+    opt.setOption( "dt",      't');
+    opt.setOption( "drift",   'd');
+    opt.setOption( "eps",     'e');
+    opt.setOption( "theta",   'o');
+#if ENABLE_LOG
+    opt.setFlag("log");
+#endif
+    opt.setOption("letcompress");
+    opt.setFlag("neighbourcomm");
+    opt.setOption("grpdelta");
+    opt.setOption("commmatrix");
+    opt.setOption("letstream");
+    opt.setFlag("progressthread");
+    opt.setFlag("orb");
+
+    opt.processCommandArgs( argc, argv );
+
+    if( ! opt.hasOptions() ||  opt.getFlag( "help" ) || opt.getFlag( 'h' ) )
+    {
+      opt.printUsage();
+      ::exit(0);
+    }
+
+#if ENABLE_LOG
+    if (opt.getFlag("log"))           ENABLE_RUNTIME_LOG = true;
+#endif
+    if (opt.getFlag("neighbourcomm")) neighbourComm = true;
+    if (opt.getFlag("progressthread")) progressThread = true;
+    if (opt.getFlag("orb"))           useORB         = true;
+
+    char *optarg = NULL;
+    if ((optarg = opt.getValue("infile")))       fileName    = string(optarg);
+    if ((optarg = opt.getValue("plummer")))      nPlummer    = atoi(optarg);
+    if ((optarg = opt.getValue("steps")))        nSteps      = std::max(atoi(optarg), 1);
+    if ((optarg = opt.getValue("warmup")))       nWarmup     = std::max(atoi(optarg), 0);
+    if ((optarg = opt.getValue("dt")))           timeStep    = (float) atof(optarg);
+    if ((optarg = opt.getValue("drift")))        drift       = (float) atof(optarg);
+    if ((optarg = opt.getValue("eps")))          eps         = (float) atof(optarg);
+    if ((optarg = opt.getValue("theta")))        theta       = (float) atof(optarg);
+    if ((optarg = opt.getValue("grpdelta")))     grpDelta    = std::max((float)atof(optarg), 0.0f);
+    if ((optarg = opt.getValue("commmatrix")))   commMatrix  = std::max(atoi(optarg), 0);
+    if ((optarg = opt.getValue("letstream")))    letStream   = std::max(atoi(optarg), 0);
+    if ((optarg = opt.getValue("letcompress")))  letCompress = std::min(std::max(atoi(optarg), 0), 32);
+
+    if (fileName.empty() && nPlummer <= 0)
+    {
+      opt.printUsage();
+      ::exit(0);
+    }
+#undef ADDUSAGE
+  }
+
+  int provided;
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+  assert(MPI_THREAD_MULTIPLE == provided);
+
+  MPI_Comm mpiCommWorld = MPI_COMM_WORLD;
+  int procId, nProcs;
+  MPI_Comm_size(mpiCommWorld, &nProcs);
+  MPI_Comm_rank(mpiCommWorld, &procId);
+#if ENABLE_LOG
+  PREPEND_RANK_PROCID = procId;
+  PREPEND_RANK_NPROCS = nProcs;
+#endif
+
+  std::stringstream logStream;
+  ostream &logFile = logStream;
+
+  my_dev::context cudaContext;
+  const int devID = procId % getNumberOfCUDADevices();
+  cudaContext.create(logFile, false);
+  cudaContext.createQueue(devID);
+
+  octree *tree = new octree(mpiCommWorld, &cudaContext, argv, devID, theta, eps,
+                            "", -1, 0.0, 0.1, true, false, false, timeStep);
+  tree->setLETCompression(letCompress);
+  tree->setUseNeighbourComm(neighbourComm);
+  tree->setGrpTreeDelta(grpDelta);
+  tree->setUseProgressThread(progressThread && nProcs > 1);
+  tree->setUseORB(useORB);
+  tree->setLETStream(letStream);
+
+  HostThreads &hostThreads = HostThreads::instance();
+  hostThreads.setup(false, procId, nProcs, mpiCommWorld, tree->getUseProgressThread());
+  hostThreads.bindComputeThread();
+  if(procId == 0) hostThreads.print(stderr, procId);
+
+  if (!fileName.empty())
+  {
+    float sTime = 0;
+    tree->fileIO->readFile(mpiCommWorld, bodyPositions, bodyVelocities, bodyIDs, fileName,
+                           procId, nProcs, sTime, 1, false);
+    MPI_Bcast(&sTime, 1, MPI_FLOAT, 0, mpiCommWorld);
+    tree->set_t_current(sTime);
+  }
+  else
+    generatePlummerModel(bodyPositions, bodyVelocities, bodyIDs, procId, nProcs, nPlummer);
+
+  tree->mpiSumParticleCount((int)bodyPositions.size());
+  tree->load_kernels();
+
+  tree->localTree.setN((int)bodyPositions.size());
+  tree->allocateParticleMemory(tree->localTree);
+  for(uint i=0; i < bodyPositions.size(); i++)
+  {
+    tree->localTree.bodies_pos[i]  = bodyPositions[i];
+    tree->localTree.bodies_Ppos[i] = bodyPositions[i];
+    tree->localTree.bodies_vel[i]  = bodyVelocities[i];
+    tree->localTree.bodies_Pvel[i] = bodyVelocities[i];
+    tree->localTree.bodies_ids[i]  = bodyIDs[i];
+    tree->localTree.bodies_time[i] = make_float2(tree->get_t_current(), tree->get_t_current());
+  }
+  tree->localTree.bodies_time.h2d();
+  tree->localTree.bodies_pos. h2d();
+  tree->localTree.bodies_vel. h2d();
+  tree->localTree.bodies_Ppos.h2d();
+  tree->localTree.bodies_Pvel.h2d();
+  tree->localTree.bodies_ids. h2d();
+
+  omp_set_num_threads(hostThreads.getLETThreads());
+
+  if(procId == 0)
+    fprintf(stderr, "bench_let: nProcs= %d nGPUs= %d N= %llu steps= %d warmup= %d drift= %g theta= %g\n",
+            nProcs, getNumberOfCUDADevices(), tree->nTotalFreq_ull, nSteps, nWarmup, drift, theta);
+
+  tree->iterate_setup();
+  for(int i=0; i < nWarmup; i++)
+    tree->iterate_benchmark(drift);
+
+  tree->mpiSync();
+  tree->parStats.reset();
+  tree->setCommMatrix(commMatrix);  //Only the measured steps
+  const double t0 = tree->get_time();
+  for(int i=0; i < nSteps; i++)
+    tree->iterate_benchmark(drift);
+  const double tStep = tree->get_time() - t0;
+
+  const octree::ParallelStats &s = tree->parStats;
+  printPhase("domain",    s.tDomain,     nProcs, nSteps, mpiCommWorld, procId, s.bytesDomain);
+  printPhase("exchange",  s.tExchange,   nProcs, nSteps, mpiCommWorld, procId, s.bytesExchange, s.nExchanged,     "particles:");
+  printPhase("build",     s.tBuild,      nProcs, nSteps, mpiCommWorld, procId);
+  printPhase("hosttree",  s.tHostTree,   nProcs, nSteps, mpiCommWorld, procId, 0,               s.nHostTreeNodes, "nodes:");
+  printPhase("grptree",   s.tGrpTree,    nProcs, nSteps, mpiCommWorld, procId, s.bytesGrpTree,  s.nGrpTreeNodes,  "nodes:");
+  printPhase("quickcheck",s.tQuickCheck, nProcs, nSteps, mpiCommWorld, procId, 0,               s.nQuickChecks,   "checks:");
+  printPhase("qcpruned",  0,             nProcs, nSteps, mpiCommWorld, procId, 0,               s.nQuickPruned,   "peers:");
+  printPhase("let",       s.tLET,        nProcs, nSteps, mpiCommWorld, procId, s.bytesLET,      s.nLETNodes,      "nodes:");
+  printPhase("gravity",   s.tGravity,    nProcs, nSteps, mpiCommWorld, procId, 0,               s.nLETs,          "LETs:");
+  printPhase("letbatches",0,             nProcs, nSteps, mpiCommWorld, procId, 0,               s.nLETBatches,    "walks:");
+  printPhase("step",      tStep,         nProcs, nSteps, mpiCommWorld, procId);
+
+  //Imbalance of the final decomposition
+  {
+    const double local[2] = {(double)tree->localTree.n, s.tGravity};
+    double maxVal[2], sumVal[2];
+    MPI_Reduce(local, maxVal, 2, MPI_DOUBLE, MPI_MAX, 0, mpiCommWorld);
+    MPI_Reduce(local, sumVal, 2, MPI_DOUBLE, MPI_SUM, 0, mpiCommWorld);
+    if(procId == 0)
+      fprintf(stderr, "%-12s particles: %.3f x mean  gravity: %.3f x mean\n", useORB ? "imbal. ORB" : "imbal. SFC",
+              maxVal[0]*nProcs/std::max(sumVal[0], 1.0), maxVal[1]*nProcs/std::max(sumVal[1], 1e-30));
+  }
+
+  delete tree;
+  tree = NULL;
+
+  MPI_Finalize();
+  return 0;
+}
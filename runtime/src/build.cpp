@@ -87,9 +87,12 @@ void octree::allocateParticleMemory(tree_structure &tree)
   {
     int remoteSize = (int)(n_bodies*0.5); //TODO some more realistic number
     if(remoteSize < 1024 ) remoteSize = 2048;
+    //When streaming, the batches are limited to the budget so that is all we need
+    if(letStreamMB > 0) remoteSize = (int)((letStreamMB*1024LL*1024LL)/sizeof(real4));
 
     this->remoteTree.fullRemoteTree.cmalloc(remoteSize, true);
     tree.parallelBoundaries.cmalloc(mpiGetNProcs()+1, true);
+    tree.orbNodes.cmalloc(2*mpiGetNProcs(), true);
   }
 
 }
@@ -198,6 +201,7 @@ void octree::allocateTreePropMemory(tree_structure &tree)
 void octree::build (tree_structure &tree) {
 
   devContext->startTiming(execStream->s());
+  tree.buildCount++;
   int level      = 0;
   int validCount = 0;
   int offset     = 0;
@@ -411,13 +415,24 @@ void octree::parallelDataSummary(tree_structure &tree,
                                  bool initialSetup) {
   double t0 = get_time();
 
-  bool updateBoundaries = false;
+  bool updateBoundaries = true;
 
-  //Update if the maximum duration is 10% larger than average duration
-  //and always update the first couple of iterations to create load-balance
-  if(iter < 32 || (  100*((maxExecTimePrevStep-avgExecTimePrevStep) / avgExecTimePrevStep) > 10 ))
+  //The initial setup always updates, otherwise the controller decides based on the
+  //predicted imbalance and the cost of the previous update
+  if(!initialSetup)
   {
-    updateBoundaries = true;
+    const LoadBalanceController::Decision lb = lbController.decide(rebuild_tree_rate);
+    updateBoundaries = lb.update;
+
+    //Use the predicted instead of the last execution time for the load-balance weights
+    const double predicted = lbController.predictedLocalTime(rebuild_tree_rate);
+    if(predicted > 0) lastExecTime = predicted;
+
+    char buff5[1024];
+    sprintf(buff5,"LBCTRL-%d: Iter: %d imbalance: %lg predicted: %lg gain: %lg cost: %lg balancing: %d update: %d damping: %lg nUpdates: %d\n",
+                  procId, iter, lb.imbalance, lb.predicted, lb.gain, lb.cost,
+                  (int)lbController.balancing, (int)lb.update, lb.damping, lbController.nUpdates);
+    devContext->writeLogEvent(buff5);
   }
 
   //updateBoundaries = true; //TEST, keep always update for now
@@ -437,6 +452,9 @@ void octree::parallelDataSummary(tree_structure &tree,
 
     /* added by evghenii, needed for 2D domain decomposition in parallel.cpp */
     tree.bodies_key.d2h(true,execStream->s());
+
+    //The ORB decomposition bisects the current positions
+    if(useORB) tree.bodies_pos.d2h(tree.n, true, execStream->s());
   }
 
    //Get the global boundaries and compute the corner / size of tree
@@ -468,6 +486,14 @@ void octree::parallelDataSummary(tree_structure &tree,
                                          initialSetup);
    }
 
+   //Start the boundary search of the next update on the keys of the predicted positions,
+   //it completes during the gravity computation of this step
+   if(useAsyncDD && !useORB && !initialSetup && iter > 0)
+   {
+     tree.bodies_key.d2h(true, execStream->s());
+     startAsyncDomainUpdate(lastExecTime);
+   }
+
 
     domComp = get_time()-t0;
     char buff5[1024];
@@ -482,6 +508,15 @@ void octree::parallelDataSummary(tree_structure &tree,
 
     LOGF(stderr, "Redistribute domain took: %f\n", get_time()-t0);
 
+#ifdef USE_MPI
+    //Cost of this update, the controller only updates again if it expects to gain more
+    if(updateBoundaries && !initialSetup)
+    {
+      double cost = domComp + domExch;
+      MPI_Allreduce(&cost, &lbController.updateCost, 1, MPI_DOUBLE, MPI_MAX, mpiCommWorld);
+    }
+#endif
+
   /*************************/
 
 }
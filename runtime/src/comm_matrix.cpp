@@ -0,0 +1,211 @@
+/*
+ * Aggregates the per peer communication statistics written with --commmatrix
+ * (see CommMatrix.h) over all processes and intervals.
+ *
+ * ./comm_matrix [-n top] [-p phase -o matrix.txt] commMatrix-<nProcs>-*.cmx
+ *
+ * Prints per phase the totals, the top pairs by bytes and by wait time and
+ * per rank the send / receive volume and wait time. With -p and -o the dense
+ * nProcs x nProcs byte matrix (row = sender) of that phase is written, for
+ * plotting. Collectives are on the diagonal and are reported separately.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+#include "CommMatrix.h"
+
+struct Pair
+{
+  unsigned long long bytes;
+  unsigned int       nMsg;
+  double             tWait;
+  Pair() : bytes(0), nMsg(0), tWait(0) {}
+};
+
+static bool readFile(const char *fileName, int &nProcs, int &nSteps,
+                     std::vector<std::vector<Pair> > &send, std::vector<std::vector<Pair> > &recv)
+{
+  FILE *in = fopen(fileName, "rb");
+  if(!in)
+  {
+    fprintf(stderr, "Can not open %s\n", fileName);
+    return false;
+  }
+
+  CommMatrix::Header h;
+  while(fread(&h, sizeof(h), 1, in) == 1)
+  {
+    if(h.magic != CommMatrix::MAGIC || h.version != CommMatrix::VERSION)
+    {
+      fprintf(stderr, "%s: not a communication matrix (version %d)\n", fileName, CommMatrix::VERSION);
+      fclose(in);
+      return false;
+    }
+    if(nProcs < 0)
+    {
+      nProcs = h.nProcs;
+      send.assign(CommMatrix::NPHASE, std::vector<Pair>((size_t)nProcs*nProcs));
+      recv.assign(CommMatrix::NPHASE, std::vector<Pair>((size_t)nProcs*nProcs));
+    }
+    if(h.nProcs != nProcs || h.procId < 0 || h.procId >= nProcs)
+    {
+      fprintf(stderr, "%s: written by rank %d of %d, expected %d ranks\n", fileName, h.procId, h.nProcs, nProcs);
+      fclose(in);
+      return false;
+    }
+    if(h.procId == 0) nSteps += h.nSteps;
+
+    std::vector<CommMatrix::Record> records(h.nRecords);
+    if(h.nRecords > 0 && fread(&records[0], sizeof(CommMatrix::Record), h.nRecords, in) != (size_t)h.nRecords)
+    {
+      fprintf(stderr, "%s: truncated\n", fileName);
+      break;
+    }
+
+    for(int i=0; i < h.nRecords; i++)
+    {
+      const CommMatrix::Record &r = records[i];
+      if(r.phase < 0 || r.phase >= CommMatrix::NPHASE || r.peer < 0 || r.peer >= nProcs) continue;
+      //Send: row is this process, receive: row is the source
+      Pair &s = send[r.phase][(size_t)h.procId*nProcs + r.peer];
+      s.bytes += r.bytesSend;
+      s.nMsg  += r.nSend;
+      s.tWait += r.tWait;
+      Pair &q = recv[r.phase][(size_t)r.peer*nProcs + h.procId];
+      q.bytes += r.bytesRecv;
+      q.nMsg  += r.nRecv;
+    }
+  }
+  fclose(in);
+  return true;
+}
+
+int main(int argc, char *argv[])
+{
+  int         nTop      = 10;
+  int         outPhase  = -1;
+  const char *outFile   = NULL;
+  std::vector<const char*> files;
+
+  for(int i=1; i < argc; i++)
+  {
+    if     (!strcmp(argv[i], "-n") && i+1 < argc) nTop    = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "-o") && i+1 < argc) outFile = argv[++i];
+    else if(!strcmp(argv[i], "-p") && i+1 < argc)
+    {
+      ++i;
+      for(int p=0; p < CommMatrix::NPHASE; p++)
+        if(!strcmp(argv[i], CommMatrix::phaseName(p))) outPhase = p;
+      if(outPhase < 0)
+      {
+        fprintf(stderr, "Unknown phase: %s\n", argv[i]);
+        return 1;
+      }
+    }
+    else files.push_back(argv[i]);
+  }
+
+  if(files.empty())
+  {
+    fprintf(stderr, "Usage: %s [-n top] [-p let|grptree|exchange|domain -o matrix.txt] file.cmx [file.cmx ...]\n", argv[0]);
+    return 1;
+  }
+
+  int nProcs = -1, nSteps = 0;
+  std::vector<std::vector<Pair> > send, recv;
+  for(size_t i=0; i < files.size(); i++)
+    if(!readFile(files[i], nProcs, nSteps, send, recv)) return 1;
+  if(nProcs <= 0) return 1;
+
+  if((int)files.size() != nProcs)
+    fprintf(stderr, "Warning: %d files for %d ranks, the totals are incomplete\n", (int)files.size(), nProcs);
+
+  fprintf(stdout, "nProcs: %d steps: %d\n", nProcs, nSteps);
+  const double MB = 1024*1024.;
+
+  for(int p=0; p < CommMatrix::NPHASE; p++)
+  {
+    const std::vector<Pair> &m = send[p];
+
+    unsigned long long bytesP2P = 0, bytesColl = 0, nMsg = 0;
+    double tWaitP2P = 0, tColl = 0, tCollMax = 0;
+    std::vector<int> pairs;
+    for(int i=0; i < nProcs; i++)
+      for(int j=0; j < nProcs; j++)
+      {
+        const Pair &e = m[(size_t)i*nProcs + j];
+        if(i == j)
+        {
+          bytesColl += e.bytes;
+          tColl     += e.tWait;
+          tCollMax   = std::max(tCollMax, e.tWait);
+          continue;
+        }
+        bytesP2P += e.bytes;
+        nMsg     += e.nMsg;
+        tWaitP2P += e.tWait;
+        if(e.bytes > 0 || e.tWait > 0) pairs.push_back(i*nProcs + j);
+      }
+    if(pairs.empty() && bytesColl == 0 && tColl == 0) continue;
+
+    fprintf(stdout, "\n== %s ==\n", CommMatrix::phaseName(p));
+    fprintf(stdout, "point-to-point: %10.3f MB  messages: %llu  pairs: %d  wait: %.3f s\n",
+            bytesP2P/MB, nMsg, (int)pairs.size(), tWaitP2P);
+    fprintf(stdout, "collective:     %10.3f MB  time avg: %.3f s  max: %.3f s\n",
+            bytesColl/MB, tColl/nProcs, tCollMax);
+
+    const int n = std::min((int)pairs.size(), nTop);
+    std::partial_sort(pairs.begin(), pairs.begin() + n, pairs.end(),
+                      [&m](const int a, const int b) { return m[a].bytes > m[b].bytes; });
+    fprintf(stdout, "top pairs by volume:\n");
+    for(int k=0; k < n; k++)
+      fprintf(stdout, "  %5d -> %5d %10.3f MB  messages: %u\n",
+              pairs[k] / nProcs, pairs[k] % nProcs, m[pairs[k]].bytes/MB, m[pairs[k]].nMsg);
+
+    std::partial_sort(pairs.begin(), pairs.begin() + n, pairs.end(),
+                      [&m](const int a, const int b) { return m[a].tWait > m[b].tWait; });
+    fprintf(stdout, "top pairs by wait (rank waiting on peer):\n");
+    for(int k=0; k < n; k++)
+      fprintf(stdout, "  %5d <- %5d %10.3f ms\n",
+              pairs[k] / nProcs, pairs[k] % nProcs, 1e3*m[pairs[k]].tWait);
+
+    fprintf(stdout, "per rank:  rank    send MB    recv MB   wait ms  coll ms\n");
+    for(int i=0; i < nProcs; i++)
+    {
+      unsigned long long bs = 0, br = 0;
+      double tw = 0;
+      for(int j=0; j < nProcs; j++)
+      {
+        if(i == j) continue;
+        bs += m[(size_t)i*nProcs + j].bytes;
+        tw += m[(size_t)i*nProcs + j].tWait;
+        br += recv[p][(size_t)j*nProcs + i].bytes;
+      }
+      fprintf(stdout, "         %5d %10.3f %10.3f %9.3f %8.3f\n", i, bs/MB, br/MB, 1e3*tw,
+              1e3*m[(size_t)i*nProcs + i].tWait);
+    }
+  }
+
+  if(outPhase >= 0 && outFile)
+  {
+    FILE *out = fopen(outFile, "w");
+    if(!out)
+    {
+      fprintf(stderr, "Can not open %s\n", outFile);
+      return 1;
+    }
+    for(int i=0; i < nProcs; i++)
+    {
+      for(int j=0; j < nProcs; j++)
+        fprintf(out, "%llu ", send[outPhase][(size_t)i*nProcs + j].bytes);
+      fprintf(out, "\n");
+    }
+    fclose(out);
+    fprintf(stdout, "\nWrote the %s matrix to %s\n", CommMatrix::phaseName(outPhase), outFile);
+  }
+
+  return 0;
+}
@@ -59,6 +59,78 @@ void octree::makeLET()
 }
 
 
+//One step of the parallel code without the time integration: domain update,
+//particle exchange, tree-build, group tree and LET exchange including the
+//gravity. The particles are moved drift*timeStep along their velocity first so
+//boundaries and LETs change between steps. Used by bench_let, see parStats
+void octree::iterate_benchmark(const float drift)
+{
+#ifdef USE_MPI
+  if(drift != 0)
+  {
+    localTree.bodies_pos.d2h(localTree.n);
+    localTree.bodies_vel.d2h(localTree.n);
+    for(int i=0; i < localTree.n; i++)
+    {
+      real4       pos = localTree.bodies_pos[i];
+      const real4 vel = localTree.bodies_vel[i];
+      pos.x += drift*timeStep*vel.x;
+      pos.y += drift*timeStep*vel.y;
+      pos.z += drift*timeStep*vel.z;
+      localTree.bodies_pos [i] = pos;
+      localTree.bodies_Ppos[i] = pos;
+    }
+    localTree.bodies_pos. h2d(localTree.n);
+    localTree.bodies_Ppos.h2d(localTree.n);
+  }
+
+  //Update the boundaries every step, equal split as the timings are not representative
+  double domUp = 0, domEx = 0;
+  parallelDataSummary(localTree, 1, 1, domUp, domEx, true);
+  parStats.tDomain   += domUp;
+  parStats.tExchange += domEx;
+
+  double t0 = get_time();
+  sort_bodies(localTree, true);
+  build(localTree);
+  allocateTreePropMemory(localTree);
+  compute_properties(localTree);
+  execStream->sync();
+  parStats.tBuild += get_time() - t0;
+
+  //Host tree-construction on the particle keys. Every leaf holds at least one
+  //particle and every level has at most n/17 non-leaf nodes
+  t0 = get_time();
+  {
+    static std::vector<uint4> keys, nodeKeys;
+    static std::vector<uint2> nodes;
+    static std::vector<uint>  nodeLevels(MAXLEVELS+1);
+    const int maxNodes = localTree.n + (localTree.n/17 + 1)*MAXLEVELS + 64*MAXLEVELS;
+    localTree.bodies_key.d2h(localTree.n);
+    keys.assign(&localTree.bodies_key[0], &localTree.bodies_key[0] + localTree.n);
+    nodes.resize(maxNodes);
+    nodeKeys.resize(maxNodes);
+
+    int nLevels, nNodes, startGrp, endGrp;
+    build_GroupTree(localTree.n, &keys[0], &nodes[0], &nodeKeys[0], &nodeLevels[0],
+                    nLevels, nNodes, startGrp, endGrp);
+    assert(nNodes <= maxNodes);
+    parStats.nHostTreeNodes += nNodes;
+  }
+  parStats.tHostTree += get_time() - t0;
+
+  t0 = get_time();
+  approximate_gravity(localTree);
+  makeLET();
+  gravStream->sync();
+  parStats.tGravity += get_time() - t0;
+
+  commMatrixEndStep();
+  iter++;
+#endif
+}
+
+
 
 void octree::iterate_setup() {
 
@@ -229,7 +301,11 @@ bool octree::iterate_once(IterationData &idata) {
 
       runningLETTimeSum = 0;
 
-      if(nProcs > 1) makeLET();
+      if(nProcs > 1)
+      {
+        makeLET();
+        progressAsyncDomainUpdate();
+      }
     }//else if useDirectGravity
 
     gravStream->sync(); //Syncs the gravity stream, including any gravity computations due to LET actions
@@ -241,6 +317,7 @@ bool octree::iterate_once(IterationData &idata) {
 
 
     //Compute the total number of interactions that we executed
+    //the per particle counts are also used as cost by the domain decomposition
     tTempTime = get_time();
 #if 1
    localTree.interactions.d2h();
@@ -306,10 +383,12 @@ bool octree::iterate_once(IterationData &idata) {
       MPI_Allreduce(&lastTotal, &maxExecTimePrevStep, 1, MPI_FLOAT, MPI_MAX, mpiCommWorld);
       MPI_Allreduce(&lastTotal, &avgExecTimePrevStep, 1, MPI_FLOAT, MPI_SUM, mpiCommWorld);
       avgExecTimePrevStep /= nProcs;
+      lbController.addSample(lastTotal, maxExecTimePrevStep, avgExecTimePrevStep);
 
       devContext->stopTiming("Unbalance", 12, execStream->s());
       idata.lastWaitTime  += get_time() - t1;
       idata.totalWaitTime += idata.lastWaitTime;
+      commMatrixEndStep();
       #endif
     }
     
@@ -58,7 +58,10 @@ void octree::load_kernels() {
   internalMoveSFC2.						  create("internalMoveSFC2", 						(const void*)&gpu_internalMoveSFC2);
   extractOutOfDomainParticlesAdvancedSFC2.create("extractOutOfDomainParticlesAdvancedSFC2", (const void*)&gpu_extractOutOfDomainParticlesAdvancedSFC2);
   insertNewParticlesSFC.				  create("insertNewParticlesSFC", 					(const void*)&gpu_insertNewParticlesSFC);
+  insertNewParticlesRecord.			  create("insertNewParticlesRecord", 				(const void*)&gpu_insertNewParticlesRecord);
   domainCheckSFCAndAssign.				  create("domainCheckSFCAndAssign", 				(const void*)&gpu_domainCheckSFCAndAssign);
+  internalMoveORB.						  create("internalMoveORB", 						(const void*)&gpu_internalMoveORB);
+  domainCheckORBAndAssign.				  create("domainCheckORBAndAssign", 				(const void*)&gpu_domainCheckORBAndAssign);
 
   //Other
   directGrav.create("dev_direct_gravity", (const void*)&dev_direct_gravity);
@@ -48,6 +48,7 @@ http://github.com/treecode/Bonsai
 #ifdef USE_MPI
   #include <omp.h>
   #include <mpi.h>
+  #include "RankReorder.h"
 #endif
 
 #include <iostream>
@@ -61,6 +62,7 @@ http://github.com/treecode/Bonsai
 #include <omp.h>
 #include "log.h"
 #include "anyoption.h"
+#include "HostThreads.h"
 #include "renderloop.h"
 
 #include <array>
@@ -200,6 +202,16 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
   bool diskmode   = false;
   bool stereo     = false;
   bool restartSim = false;
+  int  letCompress = 0;
+  bool neighbourComm = false;
+  bool nodeSharedLET = false;
+  bool asyncDD       = false;
+  float grpDelta     = 0;
+  int   commMatrix   = 0;
+  bool  reorderRanks = false;
+  bool  progressThread = false;
+  bool  useORB         = false;
+  int   letStream      = 0;
 
   float quickDump  = 0.0;
   float quickRatio = 0.1;
@@ -278,6 +290,16 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     ADDUSAGE("     --prepend-rank     prepend the MPI rank in front of the log-lines ");
 #endif
     ADDUSAGE("     --direct           enable N^2 direct gravitation [" << (direct ? "on" : "off") << "]");
+    ADDUSAGE("     --letcompress #    compress LET data, 0 off, 32 lossless, <32 store positions with # bits [" << letCompress << "]");
+    ADDUSAGE("     --neighbourcomm    use MPI neighbourhood collectives for the LET and particle exchange [" << (neighbourComm ? "on" : "off") << "]");
+    ADDUSAGE("     --nodesharedlet    build the LETs of processes on the same node from shared memory [" << (nodeSharedLET ? "on" : "off") << "]");
+    ADDUSAGE("     --asyncdd          search the next domain boundaries during the gravity computation [" << (asyncDD ? "on" : "off") << "]");
+    ADDUSAGE("     --grpdelta #       broadcast only group-tree changes larger than # times the node size, 0 is off [" << grpDelta << "]");
+    ADDUSAGE("     --commmatrix #     dump per peer communication volume and wait times every # steps, 0 is off [" << commMatrix << "]");
+    ADDUSAGE("     --reorderranks     order the ranks by node and socket so consecutive domains share a node [" << (reorderRanks ? "on" : "off") << "]");
+    ADDUSAGE("     --progressthread   complete the LET sends and receives on a dedicated MPI progress thread [" << (progressThread ? "on" : "off") << "]");
+    ADDUSAGE("     --orb              orthogonal recursive bisection domains instead of the PH-curve [" << (useORB ? "on" : "off") << "]");
+    ADDUSAGE("     --letstream #      walk the received LETs in batches of at most # MB as they arrive, 0 is off [" << letStream << "]");
 #ifdef USE_OPENGL
 		ADDUSAGE("     --fullscreen #     set fullscreen mode string");
     ADDUSAGE("     --displayfps       enable on-screen FPS display");
@@ -338,6 +360,16 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     opt.setFlag("prepend-rank");
 #endif
     opt.setFlag("direct");
+    opt.setOption("letcompress");
+    opt.setFlag("neighbourcomm");
+    opt.setFlag("nodesharedlet");
+    opt.setFlag("asyncdd");
+    opt.setFlag("reorderranks");
+    opt.setFlag("progressthread");
+    opt.setFlag("orb");
+    opt.setOption("grpdelta");
+    opt.setOption("commmatrix");
+    opt.setOption("letstream");
 #ifdef USE_OPENGL
     opt.setOption( "fullscreen");
     opt.setOption( "Tglow");
@@ -357,6 +389,12 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     }
 
     if (opt.getFlag("direct"))          direct        = true;
+    if (opt.getFlag("neighbourcomm"))   neighbourComm = true;
+    if (opt.getFlag("nodesharedlet"))   nodeSharedLET = true;
+    if (opt.getFlag("asyncdd"))         asyncDD = true;
+    if (opt.getFlag("reorderranks"))    reorderRanks  = true;
+    if (opt.getFlag("progressthread"))  progressThread = true;
+    if (opt.getFlag("orb"))             useORB        = true;
     if (opt.getFlag("restart"))         restartSim    = true;
     if (opt.getFlag("displayfps"))      displayFPS    = true;
     if (opt.getFlag("diskmode"))        diskmode      = true;
@@ -396,6 +434,10 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     if ((optarg = opt.getValue("rebuild")))      rebuild_tree_rate  = atoi  (optarg);
     if ((optarg = opt.getValue("reducebodies"))) reduce_bodies_factor = atoi  (optarg);
     if ((optarg = opt.getValue("reducedust")))	 reduce_dust_factor = atoi  (optarg);
+    if ((optarg = opt.getValue("grpdelta")))     grpDelta           = std::max((float)atof(optarg), 0.0f);
+    if ((optarg = opt.getValue("commmatrix")))   commMatrix         = std::max(atoi(optarg), 0);
+    if ((optarg = opt.getValue("letstream")))    letStream          = std::max(atoi(optarg), 0);
+    if ((optarg = opt.getValue("letcompress")))  letCompress        = std::min(std::max(atoi(optarg), 0), 32);
 #if USE_OPENGL
     if ((optarg = opt.getValue("fullscreen")))	 fullScreenMode     = string(optarg);
     if ((optarg = opt.getValue("Tglow")))	 TstartGlow  = (float)atof(optarg);
@@ -512,6 +554,21 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
 
       MPI_Comm_size(mpiCommWorld, &nProcs);
       MPI_Comm_rank(mpiCommWorld, &procId);
+
+      //The snapshot shared memory of --usempiio is keyed by the rank, the paired IO process
+      //uses its own (not reordered) rank, so the reorder is only done without it
+      const bool reorderForIO = reorderRanks && useMPIIO;
+      if (reorderForIO) reorderRanks = false;
+
+      //Consecutive ranks, and therefore neighbouring domains, on the same node and socket
+      RankReorder rankOrder;
+      MPI_Comm reorderedComm = MPI_COMM_NULL;  //Freed at shutdown, after the tree released its communicators
+      if (reorderRanks && nProcs > 1 && !mpiRenderMode)
+      {
+        reorderedComm = rankOrder.reorder(mpiCommWorld);
+        mpiCommWorld  = reorderedComm;
+        MPI_Comm_rank(mpiCommWorld, &procId);
+      }
 #else
     MPI_Comm mpiCommWorld = 0;
     procId                = 0;
@@ -540,6 +597,9 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     my_dev::context cudaContext;
 
     if(nProcs > 1) devID = procId % getNumberOfCUDADevices();
+#ifdef USE_MPI
+    if(nProcs > 1 && reorderRanks && !mpiRenderMode) devID = rankOrder.localRank % getNumberOfCUDADevices();
+#endif
 
     cudaContext.create(logFile, false); //Do logging to file and enable timing (false = enabled)
     cudaContext.createQueue(devID);
@@ -561,6 +621,15 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
                                 timeStep,
                                 tEnd, iterEnd,
                                 rebuild_tree_rate, direct, shrMemPID);
+    tree->setLETCompression(letCompress);
+    tree->setUseNeighbourComm(neighbourComm);
+    tree->setUseNodeSharedLET(nodeSharedLET);
+    tree->setUseAsyncDD(asyncDD);
+    tree->setGrpTreeDelta(grpDelta);
+    tree->setCommMatrix(commMatrix);
+    tree->setUseProgressThread(progressThread && nProcs > 1);
+    tree->setUseORB(useORB);
+    tree->setLETStream(letStream);
 
 
 
@@ -599,6 +668,26 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
       cerr << "[INIT]\tRuntime logging is DISABLED \n";
 #endif
     cerr << "[INIT]\tDirect gravitation is " << (direct ? "ENABLED" : "DISABLED") << endl;
+    if (letCompress > 0)
+      cerr << "[INIT]\tLET compression: " << (letCompress == 32 ? "lossless" : "lossy") << " (" << letCompress << " bits)\n";
+    cerr << "[INIT]\tNeighbourhood collectives are " << (neighbourComm ? "ENABLED" : "DISABLED") << endl;
+    cerr << "[INIT]\tNode shared memory LETs are " << (nodeSharedLET ? "ENABLED" : "DISABLED") << endl;
+    cerr << "[INIT]\tAsynchronous domain decomposition is " << (asyncDD ? "ENABLED" : "DISABLED") << endl;
+    if (grpDelta > 0)
+      cerr << "[INIT]\tGroup-tree broadcast as delta, tolerance: " << grpDelta << endl;
+    if (commMatrix > 0)
+      cerr << "[INIT]\tCommunication matrix written every " << commMatrix << " steps" << endl;
+    if (letStream > 0)
+      cerr << "[INIT]\tLETs are walked as they arrive, in batches of at most " << letStream << " MB" << endl;
+    cerr << "[INIT]\tMPI progress thread is " << (progressThread && nProcs > 1 ? "ENABLED" : "DISABLED") << endl;
+    cerr << "[INIT]\tDomain decomposition: " << (useORB ? "orthogonal recursive bisection" : "PH-curve") << endl;
+#ifdef USE_MPI
+    if (reorderRanks && nProcs > 1 && !mpiRenderMode)
+      cerr << "[INIT]\tRanks ordered by topology, nodes: " << rankOrder.nNodes
+           << " ranks/node: " << rankOrder.ranksPerNode << " (rank 0 was " << rankOrder.oldRank << ")" << endl;
+    if (reorderForIO)
+      cerr << "[INIT]\tRank reorder is DISABLED, the MPI-IO snapshot processes pair by the original rank" << endl;
+#endif
 #if USE_OPENGL
     cerr << "[INIT]\tTglow = " << TstartGlow << endl;
     cerr << "[INIT]\tdTglow = " << dTstartGlow << endl;
@@ -612,30 +701,17 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
   }
   assert(quickRatio > 0 && quickRatio <= 1);
 
+  //Divide the cores of this node over the compute, LET and IO threads
+  HostThreads &hostThreads = HostThreads::instance();
 #ifdef USE_MPI
+  hostThreads.setup(!useMPIIO, procId, nProcs, mpiCommWorld, tree->getUseProgressThread());
+#else
+  hostThreads.setup(!useMPIIO, procId, nProcs);
+#endif
+  hostThreads.bindComputeThread();
+  if(procId == 0) hostThreads.print(stderr, procId);
 
-  //Used on Titan and Piz Daint
-  #if 1
-    omp_set_num_threads(16);
-  #pragma omp parallel
-    {
-      int tid = omp_get_thread_num();
-      cpu_set_t cpuset;
-      CPU_ZERO(&cpuset);
-      pthread_getaffinity_np(pthread_self()  , sizeof( cpu_set_t ), &cpuset );
-
-      int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-
-      int i, set=-1;
-      for (i = 0; i < CPU_SETSIZE; i++)
-        if (CPU_ISSET(i, &cpuset))
-          set = i;
-      //    fprintf(stderr,"[Proc: %d ] Thread %d bound to: %d Total cores: %d\n",
-      //        procId, tid,  set, num_cores);
-    }
-  #endif
-
-
+#ifdef USE_MPI
   #if 0
     omp_set_num_threads(4);
     //default
@@ -799,7 +875,7 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
 
 
   #ifdef USE_MPI
-    omp_set_num_threads(4); //Startup the OMP threads to be used during LET phase
+    omp_set_num_threads(hostThreads.getLETThreads()); //Startup the OMP threads to be used during LET phase
   #endif
 
 
@@ -830,6 +906,7 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     const int tid = omp_get_thread_num();
     if (tid == 0)
     {
+      hostThreads.bindComputeThread();
       //Catch exceptions to add some extra print info
       try
       {
@@ -851,6 +928,7 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
     {
       assert(!useMPIIO);
       /* IO */
+      hostThreads.bindIOThread();
       sleep(1);
       while(!simulationFinished)
       {
@@ -917,6 +995,7 @@ int main(int argc, char** argv, MPI_Comm comm, int shrMemPID)
   displayTimers();
 
 #ifdef USE_MPI
+  if (reorderedComm != MPI_COMM_NULL) MPI_Comm_free(&reorderedComm);
   //Finalize MPI if we initialized it ourselves, otherwise the driver will do it.
   if (!mpiInitialized) MPI_Finalize();
 #endif
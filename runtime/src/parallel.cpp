@@ -7,7 +7,10 @@
 #include "radix.h"
 #include <parallel/algorithm>
 #include <map>
+#include <deque>
 #include "dd2d.h"
+#include "ddhist.h"
+#include "ddorb.h"
 
 
 #ifdef __ALTIVEC__
@@ -114,15 +117,10 @@
 
 #else
 
-    //Uncomment the below to use 256 (AVX) bit instructions instead of 128 (SSE)
-    //#define USE_AVX
-
     #include <xmmintrin.h>
     #include <immintrin.h>
     typedef float  _v4sf  __attribute__((vector_size(16)));
     typedef int    _v4si  __attribute__((vector_size(16)));
-    typedef float  _v8sf  __attribute__((vector_size(32)));
-    typedef int    _v8si  __attribute__((vector_size(32)));
 
 
     #define AND              __builtin_ia32_andps
@@ -160,8 +158,59 @@ extern "C" uint2 thrust_partitionDomains( my_dev::dev_mem<uint2> &validList,
 
 
 #define USE_GROUP_TREE  //If this is defined we convert boundaries into a group
+#define USE_LET_REUSE   //If this is defined we reuse the LET node-set of the previous step if the tree is not rebuild
+#define USE_PERSISTENT_EXCHANGE //If this is defined the particle and group-tree exchange use pre-posted persistent requests
+#define USE_HISTOGRAM_DD        //If this is defined the domain boundaries are searched in the full key set instead of a sample
+#define ASYNC_DD_MAX_AGE 2      //Steps, an asynchronous boundary search that was started earlier is discarded
+#ifdef __SIZEOF_INT128__
+#define DD2D_KEY_BITS 96        //Key width of the sample based domain decomposition, 64 or 96 (the full PH key)
+#else
+#define DD2D_KEY_BITS 64
+#endif
+#define USE_MIGRATION_RECORD    //If this is defined the particle exchange sends migrationStruct instead of bodyStruct
+#define USE_PEER_PRUNING        //If this is defined far away processes skip the quick-check tree walks (PeerBVH)
+#define USE_DIRECT_RECEIVE      //If this is defined the exchanged particles are received at their final offset in a pinned device buffer
 #define NMAXPROC 32768
 
+#ifdef USE_MIGRATION_RECORD
+typedef migrationStruct exchangeStruct;
+#else
+typedef bodyStruct      exchangeStruct;
+#endif
+
+static inline void packParticle(const bodyStruct &b, migrationStruct &m)
+{
+  memcpy(m.pos,  &b.pos,  sizeof(m.pos));
+  memcpy(m.vel,  &b.vel,  sizeof(m.vel));
+  memcpy(m.acc0, &b.acc0, sizeof(m.acc0));
+  m.time = b.time;
+  m.id   = b.id;
+  m.h    = b.Pvel.w;    //The extract kernel stores h in Pvel.w
+  m.pad  = 0;
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+  memcpy(m.key,  &b.key,  sizeof(m.key));
+  memcpy(m.acc1, &b.acc1, sizeof(m.acc1));
+#endif
+}
+
+static inline void unpackParticle(const migrationStruct &m, bodyStruct &b)
+{
+  memcpy(&b.pos,  m.pos,  sizeof(m.pos));
+  memcpy(&b.vel,  m.vel,  sizeof(m.vel));
+  memcpy(&b.acc0, m.acc0, sizeof(m.acc0));
+  b.time   = m.time;
+  b.id     = m.id;
+  b.Ppos   = b.pos;     //Replaced by the predictor after the insert
+  b.Pvel   = b.vel;
+  b.Pvel.w = m.h;       //The insert kernel takes h from Pvel.w
+#ifdef DO_BLOCK_TIMESTEP_EXCHANGE_MPI
+  memcpy(&b.key,  m.key,  sizeof(m.key));
+  memcpy(&b.acc1, m.acc1, sizeof(m.acc1));
+#endif
+}
+
+static inline void unpackParticle(const bodyStruct &m, bodyStruct &b) { b = m; }
+
 /*
  *
  * OpenMP magic / chaos here, to prevent realloc of
@@ -192,14 +241,7 @@ struct GETLETBUFFERS
 
   std::vector<int>  groupSIMDkeys;
 
-#ifdef USE_AVX /* AVX */
-    #ifndef __AVX__
-        #error "AVX is not defined"
-    #endif
-    std::vector< std::pair<v4sf,v4sf> > groupSplitFlag;
-#else
-  std::vector<v4sf> groupSplitFlag;
-#endif
+  std::vector<uint> groupSplitFlag; //Result of the opening test, one flag per group
 
   char padding[512 -
                ( sizeof(LETBuffer_node) +
@@ -225,8 +267,161 @@ struct GETLETBUFFERS
 #include <omp.h>
 
 #include "MPIComm.h"
+#include "HostThreads.h"
+#include "LETCodec.h"
+#include "MPINeighbourComm.h"
+#include "NodeSharedTree.h"
+#include "MPIPersistent.h"
+#include "GroupTreeDelta.h"
+#include "CommMatrix.h"
+#include "MPIProgress.h"
+#include "MPMCQueue.h"
+#include "LETBufferPool.h"
+#include "PeerBVH.h"
 template <> MPI_Datatype MPIComm_datatype<float>() {return MPI_FLOAT; }
 MPIComm *myComm;
+NeighbourComm *exchangeNeighbours = NULL;   //Graph of the particle exchange
+NeighbourComm *letNeighbours      = NULL;   //Graph of the LET size exchange
+NodeSharedTree *nodeSharedTree    = NULL;   //Local trees of the processes on this node
+PersistentExchange *particleExchange = NULL;  //Pre-posted receives of the particle exchange
+PersistentExchange *grpTreeExchange  = NULL;  //Pre-posted receives of the full group-tree exchange
+GroupTreeDelta     *grpTreeDelta     = NULL;  //Sent and received copies of the broadcast group-trees
+CommMatrix         *commMatrix       = NULL;  //Per peer communication statistics, NULL if disabled
+MPIProgress        *letProgress      = NULL;  //Completes the LET sends and receives, NULL if disabled
+LETBufferPool      *letBufferPool    = NULL;  //Send and receive buffers of the LET exchange
+#ifdef USE_DIRECT_RECEIVE
+my_dev::dev_mem<exchangeStruct> *exchangeRecvBuffer = NULL;  //Received particles, pinned host and device copy
+#endif
+
+static std::vector<real4> fullBoundaryTree; //Our own group-tree, build by sendCurrentInfoGrpTree
+
+#ifdef USE_HISTOGRAM_DD
+/* cost of every key as prefix sum: the interactions scaled by the time per interaction
+ * of this process (f_time), blended with the particle count by alpha */
+static void domainCost(const std::vector<double> &work, const double f_time, const double workMean,
+                       const double alpha, std::vector<double> &cost)
+{
+  const int n = work.size();
+  cost.resize(n+1);
+  cost[0] = 0;
+  for (int i = 0; i < n; i++)
+    cost[i+1] = cost[i] + (1-alpha)*f_time*(work[i] + 0.01*workMean)/workMean + alpha;
+}
+
+//Sort the keys and reorder the work with them
+static void sortKeysAndWork(std::vector<DDHistogram::Key> &keys, std::vector<double> &work)
+{
+  if (std::is_sorted(keys.begin(), keys.end())) return;
+
+  const int n = keys.size();
+  std::vector<int> order(n);
+  for (int i = 0; i < n; i++) order[i] = i;
+  std::sort(order.begin(), order.end(),
+            [&keys](const int a, const int b) { return keys[a] < keys[b]; });
+
+  std::vector<DDHistogram::Key> keys_tmp(keys);
+  std::vector<double>           work_tmp(work);
+  for (int i = 0; i < n; i++)
+  {
+    keys[i] = keys_tmp[order[i]];
+    work[i] = work_tmp[order[i]];
+  }
+}
+
+/*
+ * Boundary search of the next domain update that runs during the gravity
+ * computation of this step. Started on the keys of the predicted positions
+ * and the interactions of the previous step, progressed from the LET
+ * communication thread and completed in exchangeSamplesAndUpdateBoundarySFC.
+ * The snapshot is taken on the tree rebuild steps, before the particles
+ * migrate. That does not change the global key set the search runs on, and
+ * the interactions are only in the particle order before migration. The
+ * result is used by the next update, which is rebuild_tree_rate steps later,
+ * and only when that is at most ASYNC_DD_MAX_AGE steps.
+ * Uses its own communicator so the non-blocking reductions can not interleave
+ * with the collectives of the LET exchange.
+ */
+struct AsyncDomainUpdate
+{
+  MPI_Comm comm;
+  std::vector<DDHistogram::Key> keys, keysPrev;
+  std::vector<double>           work, cost;
+  double       localSum[2], globalSum[2];  //Work and execution time
+  MPI_Request  sumReq;
+  DDHistogram *dd;
+  double       damping;
+  double       nTotal;
+  int          nProcs;
+  bool         failed;    //No work data, use the synchronous search
+  int          startIter;
+
+  AsyncDomainUpdate(const MPI_Comm &world) : sumReq(MPI_REQUEST_NULL), dd(NULL), failed(false), startIter(-1)
+  {
+    MPI_Comm_dup(world, &comm);
+  }
+
+  ~AsyncDomainUpdate()
+  {
+    int finalized = 0;
+    MPI_Finalized(&finalized);
+    if(finalized) return;
+    wait();
+    reset();
+    MPI_Comm_free(&comm);
+  }
+
+  bool pending() const { return startIter >= 0; }
+
+  //Start the search once the sums are known, returns true when the search is done
+  bool test()
+  {
+    if(!pending() || failed) return true;
+    if(!dd)
+    {
+      int flag = 0;
+      MPI_Test(&sumReq, &flag, MPI_STATUS_IGNORE);
+      if(!flag) return false;
+      startSearch();
+      if(failed) return true;
+    }
+    return dd->test();
+  }
+
+  void wait()
+  {
+    if(!pending() || failed) return;
+    if(!dd)
+    {
+      MPI_Wait(&sumReq, MPI_STATUS_IGNORE);
+      startSearch();
+      if(failed) return;
+    }
+    dd->wait();
+  }
+
+  void startSearch()
+  {
+    if(globalSum[0] <= 0)
+    {
+      failed = true;
+      return;
+    }
+    const double f_time = std::max(0.5, std::min(2.0, localSum[1] / std::max(globalSum[1], 1e-30) * globalSum[0] / std::max(localSum[0], 1.0)));
+    domainCost(work, f_time, globalSum[0] / nTotal, 0.0, cost);
+    dd = new DDHistogram(nProcs, keys, cost, 0.001, comm, &keysPrev[0], damping, false);
+  }
+
+  void reset()
+  {
+    delete dd;
+    dd        = NULL;
+    failed    = false;
+    startIter = -1;
+  }
+};
+
+AsyncDomainUpdate *asyncDD = NULL;
+#endif
 
 static MPI_Datatype MPI_V4SF = 0;
 
@@ -275,14 +470,6 @@ static inline _v4sf __abs(const _v4sf x)
   return AND(x, (_v4sf)mask);
 }
 
-#ifdef __AVX__
-static inline _v8sf __abs8(const _v8sf x)
-{
-  const _v8si mask = {0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff,
-    0x7fffffff, 0x7fffffff, 0x7fffffff, 0x7fffffff};
-  return __builtin_ia32_andps256(x, (_v8sf)mask);
-}
-#endif
 
 
 
@@ -298,26 +485,6 @@ inline void _v4sf_transpose(_v4sf &a, _v4sf &b, _v4sf &c, _v4sf &d){
     d = VMERGEHIGH(t1, t3);
 }
 
-#ifdef __AVX__
-static inline _v8sf pack_2xmm(const _v4sf a, const _v4sf b){
-
-  _v8sf p = {0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f,0.0f}; // just avoid warning
-        p = __builtin_ia32_vinsertf128_ps256(p, a, 0);
-        p = __builtin_ia32_vinsertf128_ps256(p, b, 1);
-  return p;
-}
-inline void _v8sf_transpose(_v8sf &a, _v8sf &b, _v8sf &c, _v8sf &d){
-  _v8sf t0 = __builtin_ia32_unpcklps256(a, c); // |c1|a1|c0|a0|
-  _v8sf t1 = __builtin_ia32_unpckhps256(a, c); // |c3|a3|c2|a2|
-  _v8sf t2 = __builtin_ia32_unpcklps256(b, d); // |d1|b1|d0|b0|
-  _v8sf t3 = __builtin_ia32_unpckhps256(b, d); // |d3|b3|d2|b2|
-
-  a = __builtin_ia32_unpcklps256(t0, t2);
-  b = __builtin_ia32_unpckhps256(t0, t2);
-  c = __builtin_ia32_unpcklps256(t1, t3);
-  d = __builtin_ia32_unpckhps256(t1, t3);
-}
-#endif
 
 
 
@@ -361,49 +528,6 @@ inline _v4sf split_node_grav_impbh_box4a( // takes 4 tree nodes and returns 4-bi
   return ret;
 }
 
-#ifdef __AVX__
-inline std::pair<v4sf,v4sf> split_node_grav_impbh_box8a( // takes 4 tree nodes and returns 4-bit integer
-    const _v4sf  nodeCOM,
-    const _v4sf  boxCenter[8],
-    const _v4sf  boxSize  [8])
-{
-  _v8sf com = pack_2xmm(nodeCOM, nodeCOM);
-  _v8sf ncx = __builtin_ia32_shufps256(com, com, 0x00);
-  _v8sf ncy = __builtin_ia32_shufps256(com, com, 0x55);
-  _v8sf ncz = __builtin_ia32_shufps256(com, com, 0xaa);
-  _v8sf size = __abs8(__builtin_ia32_shufps256(com, com, 0xff));
-
-
-  _v8sf bcx = pack_2xmm(boxCenter[0], boxCenter[4]);
-  _v8sf bcy = pack_2xmm(boxCenter[1], boxCenter[5]);
-  _v8sf bcz = pack_2xmm(boxCenter[2], boxCenter[6]);
-  _v8sf bcw = pack_2xmm(boxCenter[3], boxCenter[7]);
-  _v8sf_transpose(bcx, bcy, bcz, bcw);
-
-  _v8sf bsx = pack_2xmm(boxSize[0], boxSize[4]);
-  _v8sf bsy = pack_2xmm(boxSize[1], boxSize[5]);
-  _v8sf bsz = pack_2xmm(boxSize[2], boxSize[6]);
-  _v8sf bsw = pack_2xmm(boxSize[3], boxSize[7]);
-  _v8sf_transpose(bsx, bsy, bsz, bsw);
-
-  _v8sf dx = __abs8(bcx - ncx) - bsx;
-  _v8sf dy = __abs8(bcy - ncy) - bsy;
-  _v8sf dz = __abs8(bcz - ncz) - bsz;
-
-  const _v8sf zero = {0.0f, 0.0f, 0.0f, 0.0f, 0.0f,0.0f,0.0f,0.0f};
-  dx = __builtin_ia32_maxps256(dx, zero);
-  dy = __builtin_ia32_maxps256(dy, zero);
-  dz = __builtin_ia32_maxps256(dz, zero);
-
-  const _v8sf ds2 = dx*dx + dy*dy + dz*dz;
-
-  _v8sf ret = __builtin_ia32_cmpps256(ds2, size, 18);
-
-  const _v4sf ret1 = __builtin_ia32_vextractf128_ps256(ret, 0);
-  const _v4sf ret2 = __builtin_ia32_vextractf128_ps256(ret, 1);
-  return std::make_pair(ret1,ret2);
-}
-#endif
 
 
 
@@ -449,68 +573,231 @@ inline int split_node_grav_impbh_box4simd1( // takes 4 tree nodes and returns 4-
   return ret;
 }
 
-#ifdef __AVX__
-template<bool TRANSPOSE>
-inline int split_node_grav_impbh_box8simd1( // takes 4 tree nodes and returns 4-bit integer
-    const _v4sf  ncx1,
-    const _v4sf  ncy1,
-    const _v4sf  ncz1,
-    const _v4sf  size1,
-    const _v4sf  boxCenter[4],
-    const _v4sf  boxSize  [4])
+/*
+ * Opening-test kernels used by the LET tree walks. There is one version per
+ * instruction set, the best one supported by the CPU is selected at startup
+ * (see selectLETSplitKernels) so a single binary runs on all our nodes.
+ *
+ * splitFlags: test one node against a list of groups (AoS, indexed through
+ *             groupList) and write a non-zero flag for every group that
+ *             requires the node to be opened. flags must be able to hold
+ *             nGroups rounded up to LET_SPLIT_MAXW.
+ * splitAny  : test one node against groups stored as blocks of 4 transposed
+ *             _v4sf (x,y,z,w) and return non-zero if any group opens the node.
+ *             nEntries is a multiple of LET_SPLIT_MAXW.
+ */
+#define LET_SPLIT_MAXW 16
+
+typedef void (*splitFlagsFn)(const _v4sf nodeCOM, const _v4sf *grpCentre, const _v4sf *grpSize,
+                             const int *groupList, const int nGroups, uint *flags);
+typedef int  (*splitAnyFn)  (const _v4sf nodeCOM, const _v4sf *centreSIMD, const _v4sf *sizeSIMD,
+                             const int nEntries);
+
+struct LETSplitKernels
+{
+  const char   *name;
+  int           width;      //Number of groups per test
+  splitFlagsFn  splitFlags;
+  splitAnyFn    splitAny;
+};
+
+static void splitFlagsSSE(const _v4sf nodeCOM, const _v4sf *grpCentre, const _v4sf *grpSize,
+                          const int *groupList, const int nGroups, uint *flags)
+{
+  for (int ib = 0; ib < nGroups; ib += 4)
+  {
+    _v4sf centre[4], size[4];
+    for (int laneIdx = 0; laneIdx < 4; laneIdx++)
+    {
+      const int group = groupList[std::min(ib+laneIdx, nGroups-1)];
+      centre[laneIdx] = grpCentre[group];
+      size  [laneIdx] = grpSize  [group];
+    }
+    const _v4sf split = split_node_grav_impbh_box4a(nodeCOM, centre, size);
+    memcpy(&flags[ib], &split, sizeof(_v4sf));
+  }
+}
+
+static int splitAnySSE(const _v4sf nodeCOM, const _v4sf *centreSIMD, const _v4sf *sizeSIMD,
+                       const int nEntries)
+{
+  const _v4sf ncx  = VECPERMUTE(nodeCOM, nodeCOM, 0x00);
+  const _v4sf ncy  = VECPERMUTE(nodeCOM, nodeCOM, 0x55);
+  const _v4sf ncz  = VECPERMUTE(nodeCOM, nodeCOM, 0xaa);
+  const _v4sf ncw  = VECPERMUTE(nodeCOM, nodeCOM, 0xff);
+  const _v4sf size = __abs(ncw);
+
+  for (int ib = 0; ib < nEntries; ib += 4)
+    if (split_node_grav_impbh_box4simd1<false>(ncx, ncy, ncz, size, &centreSIMD[ib], &sizeSIMD[ib]))
+      return 1;
+  return 0;
+}
+
+#ifndef __ALTIVEC__
+
+__attribute__((target("avx2")))
+static void splitFlagsAVX2(const _v4sf nodeCOM, const _v4sf *grpCentre, const _v4sf *grpSize,
+                           const int *groupList, const int nGroups, uint *flags)
 {
-    const _v8sf zero = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0};
+  const float *centre = (const float*)grpCentre;
+  const float *size   = (const float*)grpSize;
 
-    _v4sf bcx1 =  (boxCenter[0]);
-    _v4sf bcy1 =  (boxCenter[1]);
-    _v4sf bcz1 =  (boxCenter[2]);
-    _v4sf bcw1 =  (boxCenter[3]);
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 zero    = _mm256_setzero_ps();
+  const __m256 ncx     = _mm256_set1_ps(nodeCOM[0]);
+  const __m256 ncy     = _mm256_set1_ps(nodeCOM[1]);
+  const __m256 ncz     = _mm256_set1_ps(nodeCOM[2]);
+  const __m256 nsize   = _mm256_set1_ps(fabsf(nodeCOM[3]));
 
-    _v4sf bcx2 =  (boxCenter[4]);
-    _v4sf bcy2 =  (boxCenter[5]);
-    _v4sf bcz2 =  (boxCenter[6]);
-    _v4sf bcw2 =  (boxCenter[7]);
+  for (int ib = 0; ib < nGroups; ib += 8)
+  {
+    int lanes[8];
+    for (int laneIdx = 0; laneIdx < 8; laneIdx++)
+      lanes[laneIdx] = 4*groupList[std::min(ib+laneIdx, nGroups-1)];
+    const __m256i idx = _mm256_loadu_si256((const __m256i*)lanes);
+
+    __m256 dx = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_i32gather_ps(centre+0, idx, 4), ncx), absMask),
+                              _mm256_i32gather_ps(size+0, idx, 4));
+    __m256 dy = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_i32gather_ps(centre+1, idx, 4), ncy), absMask),
+                              _mm256_i32gather_ps(size+1, idx, 4));
+    __m256 dz = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_i32gather_ps(centre+2, idx, 4), ncz), absMask),
+                              _mm256_i32gather_ps(size+2, idx, 4));
+    dx = _mm256_max_ps(dx, zero);
+    dy = _mm256_max_ps(dy, zero);
+    dz = _mm256_max_ps(dz, zero);
+
+    const __m256 ds2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    _mm256_storeu_ps((float*)&flags[ib], _mm256_cmp_ps(ds2, nsize, _CMP_LE_OS));
+  }
+}
 
-    _v8sf bcx = pack_2xmm(bcx1, bcx2);
-    _v8sf bcy = pack_2xmm(bcy1, bcy2);
-    _v8sf bcz = pack_2xmm(bcz1, bcz2);
-    _v8sf bcw = pack_2xmm(bcw1, bcw2);
+//Two blocks of 4 transposed groups per test
+__attribute__((target("avx2")))
+static int splitAnyAVX2(const _v4sf nodeCOM, const _v4sf *centreSIMD, const _v4sf *sizeSIMD,
+                        const int nEntries)
+{
+  const __m128 *c = (const __m128*)centreSIMD;
+  const __m128 *s = (const __m128*)sizeSIMD;
 
-    _v4sf bsx1 =  (boxSize[0]);
-    _v4sf bsy1 =  (boxSize[1]);
-    _v4sf bsz1 =  (boxSize[2]);
-    _v4sf bsw1 =  (boxSize[3]);
+  const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+  const __m256 zero    = _mm256_setzero_ps();
+  const __m256 ncx     = _mm256_set1_ps(nodeCOM[0]);
+  const __m256 ncy     = _mm256_set1_ps(nodeCOM[1]);
+  const __m256 ncz     = _mm256_set1_ps(nodeCOM[2]);
+  const __m256 nsize   = _mm256_set1_ps(fabsf(nodeCOM[3]));
 
-    _v4sf bsx2 =  (boxSize[4]);
-    _v4sf bsy2 =  (boxSize[5]);
-    _v4sf bsz2 =  (boxSize[6]);
-    _v4sf bsw2 =  (boxSize[7]);
+  for (int ib = 0; ib < nEntries; ib += 8)
+  {
+    __m256 dx = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_set_m128(c[ib+4], c[ib+0]), ncx), absMask),
+                              _mm256_set_m128(s[ib+4], s[ib+0]));
+    __m256 dy = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_set_m128(c[ib+5], c[ib+1]), ncy), absMask),
+                              _mm256_set_m128(s[ib+5], s[ib+1]));
+    __m256 dz = _mm256_sub_ps(_mm256_and_ps(_mm256_sub_ps(_mm256_set_m128(c[ib+6], c[ib+2]), ncz), absMask),
+                              _mm256_set_m128(s[ib+6], s[ib+2]));
+    dx = _mm256_max_ps(dx, zero);
+    dy = _mm256_max_ps(dy, zero);
+    dz = _mm256_max_ps(dz, zero);
+
+    const __m256 ds2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    if (_mm256_movemask_ps(_mm256_cmp_ps(ds2, nsize, _CMP_LE_OS)))
+      return 1;
+  }
+  return 0;
+}
 
-    _v8sf bsx = pack_2xmm(bsx1, bsx2);
-    _v8sf bsy = pack_2xmm(bsy1, bsy2);
-    _v8sf bsz = pack_2xmm(bsz1, bsz2);
-    _v8sf bsw = pack_2xmm(bsw1, bsw2);
+__attribute__((target("avx512f")))
+static void splitFlagsAVX512(const _v4sf nodeCOM, const _v4sf *grpCentre, const _v4sf *grpSize,
+                             const int *groupList, const int nGroups, uint *flags)
+{
+  const float *centre = (const float*)grpCentre;
+  const float *size   = (const float*)grpSize;
 
-    if (TRANSPOSE) assert(0); //Arrays should be set as v8sf to get this to work
+  const __m512 zero    = _mm512_setzero_ps();
+  const __m512 ncx     = _mm512_set1_ps(nodeCOM[0]);
+  const __m512 ncy     = _mm512_set1_ps(nodeCOM[1]);
+  const __m512 ncz     = _mm512_set1_ps(nodeCOM[2]);
+  const __m512 nsize   = _mm512_set1_ps(fabsf(nodeCOM[3]));
+  const __m512i allSet = _mm512_set1_epi32(-1);
 
-    _v8sf ncx  = pack_2xmm(ncx1, ncx1);
-    _v8sf ncy  = pack_2xmm(ncy1, ncy1);
-    _v8sf ncz  = pack_2xmm(ncz1, ncz1);
-    _v8sf size = pack_2xmm(size1, size1);
+  for (int ib = 0; ib < nGroups; ib += 16)
+  {
+    int lanes[16];
+    for (int laneIdx = 0; laneIdx < 16; laneIdx++)
+      lanes[laneIdx] = 4*groupList[std::min(ib+laneIdx, nGroups-1)];
+    const __m512i idx = _mm512_loadu_si512(lanes);
+
+    __m512 dx = _mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(_mm512_i32gather_ps(idx, centre+0, 4), ncx)),
+                              _mm512_i32gather_ps(idx, size+0, 4));
+    __m512 dy = _mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(_mm512_i32gather_ps(idx, centre+1, 4), ncy)),
+                              _mm512_i32gather_ps(idx, size+1, 4));
+    __m512 dz = _mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(_mm512_i32gather_ps(idx, centre+2, 4), ncz)),
+                              _mm512_i32gather_ps(idx, size+2, 4));
+    dx = _mm512_max_ps(dx, zero);
+    dy = _mm512_max_ps(dy, zero);
+    dz = _mm512_max_ps(dz, zero);
+
+    const __m512 ds2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+    const __mmask16 split = _mm512_cmp_ps_mask(ds2, nsize, _CMP_LE_OS);
+    _mm512_storeu_si512(&flags[ib], _mm512_maskz_mov_epi32(split, allSet));
+  }
+}
 
-    _v8sf dx = __abs8(bcx - ncx) - (bsx);
-    _v8sf dy = __abs8(bcy - ncy) - (bsy);
-    _v8sf dz = __abs8(bcz - ncz) - (bsz);
+//Four blocks of 4 transposed groups per test
+__attribute__((target("avx512f")))
+static int splitAnyAVX512(const _v4sf nodeCOM, const _v4sf *centreSIMD, const _v4sf *sizeSIMD,
+                          const int nEntries)
+{
+  const __m128 *c = (const __m128*)centreSIMD;
+  const __m128 *s = (const __m128*)sizeSIMD;
 
+  const __m512 zero    = _mm512_setzero_ps();
+  const __m512 ncx     = _mm512_set1_ps(nodeCOM[0]);
+  const __m512 ncy     = _mm512_set1_ps(nodeCOM[1]);
+  const __m512 ncz     = _mm512_set1_ps(nodeCOM[2]);
+  const __m512 nsize   = _mm512_set1_ps(fabsf(nodeCOM[3]));
 
-    dx = __builtin_ia32_maxps256(dx, zero);
-    dy = __builtin_ia32_maxps256(dy, zero);
-    dz = __builtin_ia32_maxps256(dz, zero);
+  for (int ib = 0; ib < nEntries; ib += 16)
+  {
+    __m512 bc[3], bs[3];
+    for (int k = 0; k < 3; k++)
+    {
+      bc[k] = _mm512_insertf32x4(_mm512_insertf32x4(_mm512_insertf32x4(_mm512_broadcast_f32x4(
+                c[ib+k]), c[ib+4+k], 1), c[ib+8+k], 2), c[ib+12+k], 3);
+      bs[k] = _mm512_insertf32x4(_mm512_insertf32x4(_mm512_insertf32x4(_mm512_broadcast_f32x4(
+                s[ib+k]), s[ib+4+k], 1), s[ib+8+k], 2), s[ib+12+k], 3);
+    }
+    __m512 dx = _mm512_max_ps(_mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(bc[0], ncx)), bs[0]), zero);
+    __m512 dy = _mm512_max_ps(_mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(bc[1], ncy)), bs[1]), zero);
+    __m512 dz = _mm512_max_ps(_mm512_sub_ps(_mm512_abs_ps(_mm512_sub_ps(bc[2], ncz)), bs[2]), zero);
 
-    const _v8sf ds2 = dx*dx + dy*dy + dz*dz;
-    return  _mm256_movemask_ps( __builtin_ia32_cmpps256(ds2, size, 18)); //18 indicates is Less or Equal OP
+    const __m512 ds2 = _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(dx, dx), _mm512_mul_ps(dy, dy)), _mm512_mul_ps(dz, dz));
+    if (_mm512_cmp_ps_mask(ds2, nsize, _CMP_LE_OS))
+      return 1;
+  }
+  return 0;
 }
+#endif //__ALTIVEC__
+
+//Pick the widest kernel the CPU supports. BONSAI_LET_SIMD=sse|avx2|avx512
+//can be used to select a narrower one, e.g. for benchmarking
+static LETSplitKernels selectLETSplitKernels()
+{
+  const LETSplitKernels sse = {"sse", 4, splitFlagsSSE, splitAnySSE};
+#ifndef __ALTIVEC__
+  const LETSplitKernels avx2   = {"avx2",   8,  splitFlagsAVX2,   splitAnyAVX2};
+  const LETSplitKernels avx512 = {"avx512", 16, splitFlagsAVX512, splitAnyAVX512};
+
+  const char *env  = getenv("BONSAI_LET_SIMD");
+  const int   want = !env ? 2 : (!strcmp(env, "avx512") ? 2 : (!strcmp(env, "avx2") ? 1 : 0));
+
+  __builtin_cpu_init();
+  if (want >= 2 && __builtin_cpu_supports("avx512f")) return avx512;
+  if (want >= 1 && __builtin_cpu_supports("avx2"))    return avx2;
 #endif
+  return sse;
+}
+
+static const LETSplitKernels letSplitKernels = selectLETSplitKernels();
 
 template<typename T>
 struct Swap
@@ -1036,6 +1323,9 @@ void octree::mpiSetup()
 
   LOGF(   stderr, "Proc id: %d @ %s , total processes: %d (mpiInit) \n", procId, processor_name, nProcs);
   fprintf(stderr, "Proc id: %d @ %s , total processes: %d (mpiInit) \n", procId, processor_name, nProcs);
+#ifdef USE_MPI
+  if(procId == 0) fprintf(stderr, "[INIT]\tLET opening test kernel: %s (%d wide)\n", letSplitKernels.name, letSplitKernels.width);
+#endif
 
 
   currentRLow          = new double4[nProcs];
@@ -1045,6 +1335,73 @@ void octree::mpiSetup()
   globalGrpTreeOffsets = new uint[nProcs];
 }
 
+//Free the buffers of the LET sends that the progress thread completed,
+//returns the number of freed buffers
+//Receive buffer of a LET, encoded LETs are not a multiple of real4
+static void* allocLETRecvBuffer(const int bytes)
+{
+  return letBufferPool->get<real4>((bytes + sizeof(real4) - 1) / sizeof(real4));
+}
+
+static int freeCompletedLETSends()
+{
+  int nFreed = 0;
+  MPIProgress::Completion c;
+  while(letProgress && letProgress->poll(c))
+  {
+    letBufferPool->release(c.user);
+    nFreed++;
+  }
+  return nFreed;
+}
+
+//Release the communicators and requests that are kept between steps,
+//pre-posted receives have to be cancelled before MPI_Finalize
+void octree::mpiRelease()
+{
+#ifdef USE_MPI
+  delete particleExchange;   particleExchange   = NULL;
+  delete grpTreeExchange;    grpTreeExchange    = NULL;
+  delete exchangeNeighbours; exchangeNeighbours = NULL;
+  delete letNeighbours;      letNeighbours      = NULL;
+  delete nodeSharedTree;     nodeSharedTree     = NULL;
+  delete grpTreeDelta;       grpTreeDelta       = NULL;
+  delete commMatrix;         commMatrix         = NULL;  //Writes the last, partial, interval
+  if(letProgress)
+  {
+    letProgress->stop();   //Waits for the outstanding LET sends
+    freeCompletedLETSends();
+  }
+  delete letProgress;        letProgress        = NULL;
+  delete letBufferPool;      letBufferPool      = NULL;
+#ifdef USE_DIRECT_RECEIVE
+  delete exchangeRecvBuffer; exchangeRecvBuffer = NULL;
+#endif
+#ifdef USE_HISTOGRAM_DD
+  delete asyncDD;            asyncDD            = NULL;
+#endif
+#endif
+}
+
+
+
+void octree::setCommMatrix(int interval)
+{
+  commMatrixInterval = std::max(interval, 0);
+#ifdef USE_MPI
+  delete commMatrix;
+  commMatrix = NULL;
+  if(commMatrixInterval > 0)
+    commMatrix = new CommMatrix(procId, nProcs, commMatrixInterval);
+#endif
+}
+
+void octree::commMatrixEndStep()
+{
+#ifdef USE_MPI
+  if(commMatrix) commMatrix->endStep(iter);
+#endif
+}
 
 
 //Utility functions
@@ -1097,6 +1454,62 @@ int octree::SumOnRootRank(int value)
 
 //Functions related to domain decomposition
 
+#ifdef USE_HISTOGRAM_DD
+//Snapshot of the keys and work for the next update, collective
+void octree::startAsyncDomainUpdate(float lastExecTime)
+{
+#ifdef USE_MPI
+  //The search would be too old by the time the next update uses it
+  if(rebuild_tree_rate > ASYNC_DD_MAX_AGE)
+  {
+    static bool warned = false;
+    if(procId == 0 && !warned)
+      fprintf(stderr, "Asynchronous domain decomposition needs a rebuild rate of at most %d, using the synchronous search\n",
+              ASYNC_DD_MAX_AGE);
+    warned = true;
+    return;
+  }
+
+  if(!asyncDD) asyncDD = new AsyncDomainUpdate(mpiCommWorld);
+
+  //The previous search was not used, complete it so the reductions stay matched
+  asyncDD->wait();
+  asyncDD->reset();
+
+  const int n = localTree.n;
+  asyncDD->keys.resize(n);
+  asyncDD->work.resize(n);
+  asyncDD->localSum[0] = 0;
+  for (int i = 0; i < n; i++)
+  {
+    asyncDD->keys[i] = DDHistogram::Key(localTree.bodies_key[i]);
+    asyncDD->work[i] = (double)localTree.interactions[i].x + (double)localTree.interactions[i].y;
+    asyncDD->localSum[0] += asyncDD->work[i];
+  }
+  asyncDD->localSum[1] = lastExecTime;
+  sortKeysAndWork(asyncDD->keys, asyncDD->work);
+
+  asyncDD->keysPrev.resize(nProcs+1);
+  for (int p = 0; p <= nProcs; p++)
+    asyncDD->keysPrev[p] = DDHistogram::Key(localTree.parallelBoundaries[p]);
+  asyncDD->damping   = lbController.nextDamping();
+  asyncDD->nTotal    = nTotalFreq_ull;
+  asyncDD->nProcs    = nProcs;
+  asyncDD->startIter = iter;
+
+  MPI_Iallreduce(asyncDD->localSum, asyncDD->globalSum, 2, MPI_DOUBLE, MPI_SUM, asyncDD->comm, &asyncDD->sumReq);
+#endif
+}
+
+//Advance the search with the reductions that completed, not thread-safe
+void octree::progressAsyncDomainUpdate()
+{
+  if(asyncDD) asyncDD->test();
+}
+#else
+void octree::startAsyncDomainUpdate(float lastExecTime) {}
+void octree::progressAsyncDomainUpdate() {}
+#endif
 
 
 void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSamples2,
@@ -1127,6 +1540,8 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
     /* LB step */
 
     double f_lb = 1.0;
+    double timeShare = 1.0 / nProcs;   /* fraction of the total execution time spent by this process */
+    double mem_cap   = HUGE_VAL;       /* maximum number of particles per process relative to the mean */
 #if 1  /* LB: use load balancing */
     {
       static double prevDurStep = -1;
@@ -1158,6 +1573,7 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 #if 1  /* MEMB: constrain LB to maintain ballanced memory use */
       {
         const double mem_imballance = 0.3;
+        mem_cap = 1.0 + mem_imballance;
 
         double fac = 1.0;
 
@@ -1170,12 +1586,127 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 
 #endif  /* MEMB: end memory balance */
 
+      timeShare = timeLocal / timeSum;
       f_lb  = timeLocal / timeSum * nProcs;
       f_lb *= (double)nloc_mean/(double)nkeys_loc;
       f_lb  = std::max(std::min(fmax, f_lb), fmin);
     }
 #endif
 
+    if (useORB)
+    {
+      updateBoundaryORB(f_lb, timeShare, mem_cap, initialSetup);
+      return;
+    }
+
+#ifdef USE_HISTOGRAM_DD
+    /*** exact splitter search on all keys, weighted by the load-balance factor ***/
+
+    /* the search was started during the previous step on the keys and interactions of
+     * that step, only the memory constraint is checked here */
+    DDHistogram *ddp = NULL;
+    size_t ddBytes   = 0;   //Send by the searches that were not used
+    if (asyncDD && asyncDD->pending())
+    {
+      asyncDD->wait();
+      const bool recent = iter - asyncDD->startIter <= ASYNC_DD_MAX_AGE;
+      if (!initialSetup && !asyncDD->failed && recent)
+      {
+        std::vector<double> counts;
+        asyncDD->dd->globalCounts(counts);
+        const double maxCount = *std::max_element(counts.begin(), counts.end());
+        if (procId == 0)
+          fprintf(stderr, " asynchronous domain decomposition, started at iter: %d rounds: %d max. particles: %g x mean\n",
+                  asyncDD->startIter, asyncDD->dd->nRounds, maxCount / nloc_mean);
+        if (maxCount <= mem_cap*nloc_mean)
+        {
+          ddp         = asyncDD->dd;  //Refers to the keys of asyncDD, these stay valid until the next start
+          asyncDD->dd = NULL;
+        }
+      }
+      asyncDD->reset();
+    }
+
+    static std::vector<DDHistogram::Key> keys_loc;
+    static std::vector<double>           work_loc, cost_loc;
+    if (!ddp)
+    {
+      keys_loc.resize(nkeys_loc);
+      work_loc.resize(nkeys_loc);
+      for (int i = 0; i < nkeys_loc; i++)
+        keys_loc[i] = DDHistogram::Key(localTree.bodies_key[i]);
+
+      /* cost of a particle: its interactions (approximate + direct) during the
+       * previous step, these were copied to the host at the end of that step */
+      double work[2] = {0, 0}, workSum[2];
+      if (!initialSetup && iter > 0)
+      {
+        for (int i = 0; i < nkeys_loc; i++)
+        {
+          work_loc[i] = (double)localTree.interactions[i].x + (double)localTree.interactions[i].y;
+          work[0]    += work_loc[i];
+        }
+      }
+      work[1] = timeShare;
+      MPI_Allreduce(work, workSum, 2, MPI_DOUBLE, MPI_SUM, mpiCommWorld);
+      const bool useWork = workSum[0] > 0;
+
+      //The keys are build on the current positions, these are only sorted up to the last tree-build
+      sortKeysAndWork(keys_loc, work_loc);
+
+      /* the controller limits how far the boundaries move per update */
+      std::vector<DDHistogram::Key> keys_prev(nProcs+1);
+      for (int p = 0; p <= nProcs; p++)
+        keys_prev[p] = DDHistogram::Key(parallelBoundaries[p]);
+      const double damping = initialSetup ? 1.0 : lbController.last.damping;
+
+      if (useWork)
+      {
+        /* time per interaction of this process relative to the mean, corrects for
+         * the LET and hardware differences the interaction count does not capture */
+        const double f_time   = std::max(0.5, std::min(2.0, timeShare / workSum[1] * workSum[0] / std::max(work[0], 1.0)));
+        const double workMean = workSum[0] / nTotalFreq_ull;
+
+        /* balance the work, if a process would get more than mem_cap times the mean number
+         * of particles, blend the particle count into the weights until it fits */
+        std::vector<double> counts;
+        for (int blend = 0; blend <= 4; blend++)
+        {
+          const double alpha = 0.25*blend;
+          domainCost(work_loc, f_time, workMean, alpha, cost_loc);
+
+          if (ddp) ddBytes += ddp->nBytes;  //Previous blend
+          delete ddp;
+          ddp = new DDHistogram(nProcs, keys_loc, cost_loc, 0.001, mpiCommWorld, &keys_prev[0], damping);
+
+          ddp->globalCounts(counts);
+          const double maxCount = *std::max_element(counts.begin(), counts.end());
+          if (procId == 0)
+            fprintf(stderr, " cost weighted domain decomposition, blend: %g rounds: %d max. particles: %g x mean\n",
+                    alpha, ddp->nRounds, maxCount / nloc_mean);
+          if (maxCount <= mem_cap*nloc_mean) break;
+        }
+      }
+      else
+        ddp = new DDHistogram(nProcs, keys_loc, f_lb, 0.001, mpiCommWorld, &keys_prev[0], damping);
+    }
+
+    const DDHistogram &dd = *ddp;
+
+    /* distribute keys, all 96 bits */
+    for (int p = 0; p < nProcs; p++)
+      parallelBoundaries[p] = dd.keybeg(p).get_uint4();
+    parallelBoundaries[nProcs] = make_uint4(0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
+
+    const double dt = get_time() - t0;
+    if (procId == 0)
+      fprintf(stderr, " it took %g sec to complete histogram domain decomposition, rounds: %d max. error: %g \n",
+              dt, dd.nRounds, dd.maxError);
+    ddBytes              += dd.nBytes;
+    parStats.bytesDomain += ddBytes;
+    if (commMatrix) commMatrix->collective(CommMatrix::DOMAIN, ddBytes, dt);
+    delete ddp;
+#else
     /*** particle sampling ***/
 
     const int npx = myComm->n_proc_i;  /* number of procs doing domain decomposition */
@@ -1192,7 +1723,8 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
     else
       nsamples_glb = nloc_mean / 30;
 
-    std::vector<DD2D::Key> key_sample1d, key_sample2d;
+    typedef DD2D<DD2D_KEY_BITS> DD;
+    std::vector<DD::Key> key_sample1d, key_sample2d;
     key_sample1d.reserve(nsamples_glb);
     key_sample2d.reserve(nsamples_glb);
 
@@ -1203,43 +1735,29 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
     const double stride1d = std::max(nTot/nsamples1d_glb, 1.0);
     const double stride2d = std::max(nTot/nsamples2d_glb, 1.0);
     for (double i = 0; i < (double)nkeys_loc; i += stride1d)
-    {
-      const uint4 key = localTree.bodies_key[(int)i];
-      key_sample1d.push_back(DD2D::Key(
-            (static_cast<unsigned long long>(key.y) ) |
-            (static_cast<unsigned long long>(key.x) << 32)
-            ));
-    }
+      key_sample1d.push_back(DD::Key(localTree.bodies_key[(int)i]));
     for (double i = 0; i < (double)nkeys_loc; i += stride2d)
-    {
-      const uint4 key = localTree.bodies_key[(int)i];
-      key_sample2d.push_back(DD2D::Key(
-            (static_cast<unsigned long long>(key.y) ) |
-            (static_cast<unsigned long long>(key.x) << 32)
-            ));
-    }
+      key_sample2d.push_back(DD::Key(localTree.bodies_key[(int)i]));
 
     //JB, TODO check if this is the correct location to put this
     //and or use parallel sort
-    std::sort(key_sample1d.begin(), key_sample1d.end(), DD2D::Key());
-    std::sort(key_sample2d.begin(), key_sample2d.end(), DD2D::Key());
+    std::sort(key_sample1d.begin(), key_sample1d.end(), DD::Key());
+    std::sort(key_sample2d.begin(), key_sample2d.end(), DD::Key());
 
-    const DD2D dd(procId, npx, nProcs, key_sample1d, key_sample2d, mpiCommWorld);
+    const DD dd(procId, npx, nProcs, key_sample1d, key_sample2d, mpiCommWorld);
+    const size_t ddBytes  = (key_sample1d.size() + key_sample2d.size())*sizeof(DD::Key);
+    parStats.bytesDomain += ddBytes;
 
     /* distribute keys */
     for (int p = 0; p < nProcs; p++)
-    {
-      const DD2D::Key key = dd.keybeg(p);
-      parallelBoundaries[p] = (uint4){
-        (uint)((key.key >> 32) & 0x00000000FFFFFFFF),
-          (uint)((key.key      ) & 0x00000000FFFFFFFF),
-          0,0};
-    }
+      parallelBoundaries[p] = dd.keybeg(p).get_uint4();
     parallelBoundaries[nProcs] = make_uint4(0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFFFFFF);
 
     const double dt = get_time() - t0;
     if (procId == 0)
       fprintf(stderr, " it took %g sec to complete 2D domain decomposition\n", dt);
+    if (commMatrix) commMatrix->collective(CommMatrix::DOMAIN, ddBytes, dt);
+#endif
   }
 #endif
 
@@ -1390,6 +1908,89 @@ void octree::exchangeSamplesAndUpdateBoundarySFC(uint4 *sampleKeys2,    int  nSa
 #endif
 }
 
+/* Domain decomposition by orthogonal recursive bisection (ddorb.h) of the current
+ * positions, instead of the key ranges on the PH-curve. The particles are weighted like
+ * the histogram decomposition: the interactions of the previous step, blended with the
+ * particle count when a process would get more than mem_cap times the mean number of
+ * particles. The bisection tree is copied to localTree.orbNodes, the redistribution
+ * assigns the predicted positions with it */
+void octree::updateBoundaryORB(double f_lb, double timeShare, double mem_cap, bool initialSetup)
+{
+#ifdef USE_MPI
+  const double t0 = get_time();
+
+  const int n         = localTree.n;
+  const int nloc_mean = nTotalFreq_ull/nProcs;
+  const real4 *pos    = &localTree.bodies_pos[0];
+
+  static std::vector<double> work_loc, weight_loc;
+  work_loc.resize(n);
+
+  double work[2] = {0, 0}, workSum[2];
+  if (!initialSetup && iter > 0)
+  {
+    for (int i = 0; i < n; i++)
+    {
+      work_loc[i] = (double)localTree.interactions[i].x + (double)localTree.interactions[i].y;
+      work[0]    += work_loc[i];
+    }
+  }
+  work[1] = timeShare;
+  MPI_Allreduce(work, workSum, 2, MPI_DOUBLE, MPI_SUM, mpiCommWorld);
+
+  DDORB *ddp     = NULL;
+  size_t ddBytes = 0;
+  if (workSum[0] > 0)
+  {
+    const double f_time   = std::max(0.5, std::min(2.0, timeShare / workSum[1] * workSum[0] / std::max(work[0], 1.0)));
+    const double workMean = workSum[0] / nTotalFreq_ull;
+
+    weight_loc.resize(n);
+    for (int blend = 0; blend <= 4; blend++)
+    {
+      const double alpha = 0.25*blend;
+      for (int i = 0; i < n; i++)
+        weight_loc[i] = (1-alpha)*f_time*(work_loc[i] + 0.01*workMean)/workMean + alpha;
+
+      if (ddp) ddBytes += ddp->nBytes;  //Previous blend
+      delete ddp;
+      ddp = new DDORB(nProcs, pos, n, &weight_loc[0], 1.0, mpiCommWorld);
+
+      const double maxCount = *std::max_element(ddp->counts.begin(), ddp->counts.end());
+      if (procId == 0)
+        fprintf(stderr, " cost weighted ORB decomposition, blend: %g rounds: %d max. particles: %g x mean\n",
+                alpha, ddp->nRounds, maxCount / nloc_mean);
+      if (maxCount <= mem_cap*nloc_mean) break;
+    }
+  }
+  else
+    ddp = new DDORB(nProcs, pos, n, NULL, f_lb, mpiCommWorld);
+
+  const DDORB &dd = *ddp;
+  for (int i = 0; i < 2*nProcs-1; i++)
+    localTree.orbNodes[i] = dd.nodes[i];
+  localTree.orbNodes.h2d(2*nProcs-1);
+
+  const double dt = get_time() - t0;
+  if (procId == 0)
+  {
+    double maxCount = 0, maxWeight = 0, sumWeight = 0;
+    for (int p = 0; p < nProcs; p++)
+    {
+      maxCount   = std::max(maxCount,  dd.counts[p]);
+      maxWeight  = std::max(maxWeight, dd.weights[p]);
+      sumWeight += dd.weights[p];
+    }
+    fprintf(stderr, " it took %g sec to complete ORB domain decomposition, rounds: %d max. particles: %g x mean max. cost: %g x mean\n",
+            dt, dd.nRounds, maxCount / nloc_mean, maxWeight / (sumWeight / nProcs));
+  }
+  ddBytes              += dd.nBytes;
+  parStats.bytesDomain += ddBytes;
+  if (commMatrix) commMatrix->collective(CommMatrix::DOMAIN, ddBytes, dt);
+  delete ddp;
+#endif
+}
+
 //Uses one communication by storing data in one buffer and communicate required information,
 //such as box-sizes and number of sample particles on this process. Nsample is set to 0
 //since it is not used in this function/hash-method
@@ -1404,9 +2005,21 @@ void octree::sendCurrentRadiusInfo(real4 &rmin, real4 &rmax)
   curProcState.rmax         = make_double4(rmax.x, rmax.y, rmax.z, rmax.w);
 
 #ifdef USE_MPI
+  #if defined(USE_PERSISTENT_EXCHANGE) && MPI_VERSION >= 4
+    //Same buffers every call, so use a persistent collective
+    static sampleRadInfo sendState;
+    static MPI_Request   allgatherReq = MPI_REQUEST_NULL;
+    if(allgatherReq == MPI_REQUEST_NULL)
+      MPI_Allgather_init(&sendState, sizeof(sampleRadInfo), MPI_BYTE, curSysState,
+                         sizeof(sampleRadInfo), MPI_BYTE, mpiCommWorld, MPI_INFO_NULL, &allgatherReq);
+    sendState = curProcState;
+    MPI_Start(&allgatherReq);
+    MPI_Wait (&allgatherReq, MPI_STATUS_IGNORE);
+  #else
   //Get the number of sample particles and the domain size information
   MPI_Allgather(&curProcState, sizeof(sampleRadInfo), MPI_BYTE,  curSysState,
       sizeof(sampleRadInfo), MPI_BYTE, mpiCommWorld);
+  #endif
 #else
   curSysState[0] = curProcState;
 #endif
@@ -1481,11 +2094,22 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
   boundariesGPU.h2d();
 
 
-  domainCheckSFCAndAssign.set_args(0, &localTree.n, &nProcs, &lowerBoundary, &upperBoundary,
-                                      boundariesGPU.p(), localTree.bodies_key.p(), validList2.p(),
-                                      idList.p(), &procId);
-  domainCheckSFCAndAssign.setWork(localTree.n, 128);
-  domainCheckSFCAndAssign.execute2(execStream->s());
+  if(useORB)
+  {
+    //Domains by the bisection tree on the predicted positions
+    domainCheckORBAndAssign.set_args(0, &localTree.n, localTree.orbNodes.p(), localTree.bodies_Ppos.p(),
+                                        validList2.p(), idList.p(), &procId);
+    domainCheckORBAndAssign.setWork(localTree.n, 128);
+    domainCheckORBAndAssign.execute2(execStream->s());
+  }
+  else
+  {
+    domainCheckSFCAndAssign.set_args(0, &localTree.n, &nProcs, &lowerBoundary, &upperBoundary,
+                                        boundariesGPU.p(), localTree.bodies_key.p(), validList2.p(),
+                                        idList.p(), &procId);
+    domainCheckSFCAndAssign.setWork(localTree.n, 128);
+    domainCheckSFCAndAssign.execute2(execStream->s());
+  }
   execStream->sync();
 
   //After this we don't need boundariesGPU anymore so can overwrite that memory space
@@ -1620,13 +2244,21 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
 
         double t3 = get_time();
         //Internal particle movement
-        internalMoveSFC2.set_args(0, &validCount, &localTree.n, &lowerBoundary, &upperBoundary,
-                validList3.p(), atomicBuff.p(), localTree.bodies_Ppos.p(),
-                localTree.bodies_Pvel.p(), localTree.bodies_pos.p(), localTree.bodies_vel.p(),
-                localTree.bodies_acc0.p(), localTree.bodies_acc1.p(), localTree.bodies_time.p(),
-                localTree.bodies_ids.p(), localTree.bodies_key.p(), localTree.bodies_h.p());
-        internalMoveSFC2.setWork(validCount, 128);
-        internalMoveSFC2.execute2(execStream->s());
+        my_dev::kernel &internalMove = useORB ? internalMoveORB : internalMoveSFC2;
+        if(useORB)
+          internalMoveORB.set_args(0, &validCount, &localTree.n, &procId, localTree.orbNodes.p(),
+                  validList3.p(), atomicBuff.p(), localTree.bodies_Ppos.p(),
+                  localTree.bodies_Pvel.p(), localTree.bodies_pos.p(), localTree.bodies_vel.p(),
+                  localTree.bodies_acc0.p(), localTree.bodies_acc1.p(), localTree.bodies_time.p(),
+                  localTree.bodies_ids.p(), localTree.bodies_key.p(), localTree.bodies_h.p());
+        else
+          internalMoveSFC2.set_args(0, &validCount, &localTree.n, &lowerBoundary, &upperBoundary,
+                  validList3.p(), atomicBuff.p(), localTree.bodies_Ppos.p(),
+                  localTree.bodies_Pvel.p(), localTree.bodies_pos.p(), localTree.bodies_vel.p(),
+                  localTree.bodies_acc0.p(), localTree.bodies_acc1.p(), localTree.bodies_time.p(),
+                  localTree.bodies_ids.p(), localTree.bodies_key.p(), localTree.bodies_h.p());
+        internalMove.setWork(validCount, 128);
+        internalMove.execute2(execStream->s());
         //execStream->sync(); LOGF(stderr,"Internal move: %lg  Since start: %lg \n", get_time()-t3,get_time()-tStart);
 
     } //if tid == 0
@@ -1649,8 +2281,17 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
       }
 
       double tStarta2a = get_time();
-      MPI_Alltoall(nparticles, 1, MPI_INT, nreceive, 1, MPI_INT, mpiCommWorld);
+      if(useNeighbourComm)
+      {
+        if(!exchangeNeighbours) exchangeNeighbours = new NeighbourComm(procId, nProcs, mpiCommWorld);
+        const int noParticles = 0;
+        exchangeNeighbours->alltoall(nparticles, nreceive, 1, &noParticles,
+                                     [](const int *count) { return count[0] == 0; });
+      }
+      else
+        MPI_Alltoall(nparticles, 1, MPI_INT, nreceive, 1, MPI_INT, mpiCommWorld);
       ta2aSize = get_time()-tStarta2a;
+      if (commMatrix) commMatrix->collective(CommMatrix::EXCHANGE, nProcs*sizeof(int), ta2aSize);
     }//if tid == 1
   } //omp section
 
@@ -1665,9 +2306,13 @@ void octree::gpuRedistributeParticles_SFC(uint4 *boundaries)
                                                         nExportParticles);
   double tEnd = get_time();
 
+  parStats.nExchanged    += nExportParticles;
+  parStats.bytesExchange += (unsigned long long)nExportParticles*sizeof(exchangeStruct) + nProcs*sizeof(int);
+
   char buff5[1024];
-  sprintf(buff5,"EXCHANGE-%d: tCheckDomain: %lg ta2aSize: %lg tSort: %lg tExtract: %lg tDomainEx: %lg nExport: %d nImport: %d \n",
-      procId, tCheck-tStart, ta2aSize, tSort-tCheck, tExtract-tSort, tEnd-tExtract,nExportParticles, localTree.n - (currentN-nExportParticles));
+  sprintf(buff5,"EXCHANGE-%d: tCheckDomain: %lg ta2aSize: %lg tSort: %lg tExtract: %lg tDomainEx: %lg nExport: %d nImport: %d nNeighbours: %d\n",
+      procId, tCheck-tStart, ta2aSize, tSort-tCheck, tExtract-tSort, tEnd-tExtract,nExportParticles, localTree.n - (currentN-nExportParticles),
+      exchangeNeighbours ? exchangeNeighbours->nNeighbours() : nProcs-1);
   devContext->writeLogEvent(buff5);
 
   if(!doInOneGo) delete[] extraBodyBuffer;
@@ -1709,41 +2354,144 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
     recvCount     += nreceive[i];
   }
 
-  static std::vector<bodyStruct> recv_buffer3;
+#ifdef USE_DIRECT_RECEIVE
+  //The counts are exchanged before we get here, so every source is received directly at its
+  //final offset in one pinned buffer. That buffer is copied to the device as a whole and a
+  //kernel inserts the particles, there is no staging or unpacking on the host
+  if(!exchangeRecvBuffer)
+  {
+    exchangeRecvBuffer = new my_dev::dev_mem<exchangeStruct>;
+    exchangeRecvBuffer->cmalloc(std::max((int)(recvCount*MULTI_GPU_MEM_INCREASE), 1024), true);
+  }
+  else if(exchangeRecvBuffer->get_size() < (int)recvCount)
+    exchangeRecvBuffer->cresize_nocpy((int)(recvCount*MULTI_GPU_MEM_INCREASE), false);
+  exchangeStruct *recvData = &(*exchangeRecvBuffer)[0];
+#else
+  static std::vector<exchangeStruct> recv_buffer3;
   recv_buffer3.resize(recvCount);
+  exchangeStruct *recvData = recv_buffer3.data();
+#endif
+
+#ifdef USE_MIGRATION_RECORD
+  //Only the state that can not be rebuild is send
+  static std::vector<exchangeStruct> send_buffer;
+  send_buffer.resize(nToSend);
+#pragma omp parallel for
+  for (int i = 0; i < nToSend; i++)
+    packParticle(particlesToSend[i], send_buffer[i]);
+  const exchangeStruct *sendData = send_buffer.data();
+#else
+  const exchangeStruct *sendData = particlesToSend;
+#endif
+  static_assert(sizeof(exchangeStruct) % sizeof(double) == 0, "The exchange counts in doubles");
+
+  int recvOffset = 0;
 
-  int recvOffset = 0;
-
 
   static MPI_Status stat[NMAXPROC];
   static MPI_Request req[NMAXPROC*2];
+  static int      reqPeer[NMAXPROC*2];
   assert(nProcs < NMAXPROC);
 
   //TODO this loop could overflow if scount > INT_MAX (same for rcount)
   int nreq = 0;
-  for (int dist = 1; dist < nProcs; dist++)
+  if(useNeighbourComm)
   {
-    const int src    = (nProcs + procId - dist) % nProcs;
-    const int dst    = (nProcs + procId + dist) % nProcs;
-    const int scount = nparticles[dst] * (sizeof(bodyStruct) / sizeof(double));
-    const int rcount = nreceive  [src] * (sizeof(bodyStruct) / sizeof(double));
+    //The counts were exchanged via the neighbour graph, so it covers all non-zero counts
+    static std::vector<int> scounts, sdispls, rcounts, rdispls;
+    scounts.resize(nProcs); sdispls.resize(nProcs);
+    rcounts.resize(nProcs); rdispls.resize(nProcs);
+    const int nDbl = sizeof(exchangeStruct) / sizeof(double);
+    for (int i = 0; i < nProcs; i++)
+    {
+      scounts[i] = (i == procId) ? 0 : nparticles[i] * nDbl;
+      sdispls[i] = nsendDispls[i] * nDbl;
+      rcounts[i] = (i == procId) ? 0 : nreceive[i] * nDbl;
+      rdispls[i] = recvOffset * nDbl;
+      recvOffset += rcounts[i] / nDbl;
+    }
+    const double tA2A = get_time();
+    exchangeNeighbours->alltoallv(sendData, &scounts[0], &sdispls[0],
+                                  recvData, &rcounts[0], &rdispls[0], MPI_DOUBLE);
+    if (commMatrix)
+    {
+      //The neighbour collective can not be split per peer, its time goes to the diagonal
+      commMatrix->wait(CommMatrix::EXCHANGE, procId, get_time()-tA2A);
+      for (int i = 0; i < nProcs; i++)
+      {
+        if (scounts[i] > 0) commMatrix->send(CommMatrix::EXCHANGE, i, scounts[i]*sizeof(double));
+        if (rcounts[i] > 0) commMatrix->recv(CommMatrix::EXCHANGE, i, rcounts[i]*sizeof(double));
+      }
+    }
+  }
+  else
+  {
+#ifdef USE_PERSISTENT_EXCHANGE
+    if(!particleExchange)
+      particleExchange = new PersistentExchange(nProcs, mpiCommWorld, MPI_DOUBLE, sizeof(double), 20);
+    static std::vector<std::pair<const void*, int> > recvParts; //Location and offset of the received data
+    recvParts.clear();
+#endif
+    for (int dist = 1; dist < nProcs; dist++)
+    {
+      const int src    = (nProcs + procId - dist) % nProcs;
+      const int dst    = (nProcs + procId + dist) % nProcs;
+      const int scount = nparticles[dst] * (sizeof(exchangeStruct) / sizeof(double));
+      const int rcount = nreceive  [src] * (sizeof(exchangeStruct) / sizeof(double));
 
-    assert(scount >= 0);
-    assert(rcount >= 0);
+      assert(scount >= 0);
+      assert(rcount >= 0);
 
-    if (scount > 0)
+      if (commMatrix)
+      {
+        if (scount > 0) commMatrix->send(CommMatrix::EXCHANGE, dst, scount*sizeof(double));
+        if (rcount > 0) commMatrix->recv(CommMatrix::EXCHANGE, src, rcount*sizeof(double));
+      }
+
+#ifdef USE_PERSISTENT_EXCHANGE
+      if (scount > 0) particleExchange->send(dst, &sendData[nsendDispls[dst]], scount);
+      if (rcount > 0)
+      {
+        recvParts.push_back(std::make_pair(particleExchange->recv(src, rcount), recvOffset));
+        recvOffset += nreceive[src];
+      }
+#else
+      if (scount > 0)
+      {
+        reqPeer[nreq] = dst;
+        MPI_Isend((void*)&sendData[nsendDispls[dst]], scount, MPI_DOUBLE, dst, 1, mpiCommWorld, &req[nreq++]);
+      }
+      if(rcount > 0)
+      {
+        reqPeer[nreq] = src;
+        MPI_Irecv(&recvData[recvOffset], rcount, MPI_DOUBLE, src, 1, mpiCommWorld, &req[nreq++]);
+        recvOffset += nreceive[src];
+      }
+#endif
+    }
+#ifdef USE_PERSISTENT_EXCHANGE
+    if (commMatrix)
     {
-      MPI_Isend(&particlesToSend[nsendDispls[dst]], scount, MPI_DOUBLE, dst, 1, mpiCommWorld, &req[nreq++]);
+      static std::vector<double> peerWait;
+      particleExchange->waitAll(&peerWait);
+      commMatrix->addWait(CommMatrix::EXCHANGE, peerWait);
     }
-    if(rcount > 0)
+    else
+      particleExchange->waitAll();
+    for(size_t i=0; i < recvParts.size(); i++)
     {
-      MPI_Irecv(&recv_buffer3[recvOffset], rcount, MPI_DOUBLE, src, 1, mpiCommWorld, &req[nreq++]);
-      recvOffset += nreceive[src];
+      const int end = (i+1 < recvParts.size()) ? recvParts[i+1].second : recvOffset;
+      memcpy(&recvData[recvParts[i].second], recvParts[i].first,
+             sizeof(exchangeStruct)*(end-recvParts[i].second));
     }
+#endif
   }
 
   double t94 = get_time();
-  MPI_Waitall(nreq, req, stat);
+  if (commMatrix)
+    commMatrix->waitAll(CommMatrix::EXCHANGE, nreq, req, reqPeer);
+  else
+    MPI_Waitall(nreq, req, stat);
   double tSendEnd = get_time();
 
   //If we arrive here all particles have been exchanged, move them to the GPU
@@ -1789,6 +2537,29 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
   tree.generalBuffer1.cresize_nocpy(3*(memSize)*4 + 4096, false);
 
 
+#ifdef USE_DIRECT_RECEIVE
+  double tAllocComplete = get_time();
+
+  if(recvCount > 0)
+  {
+    exchangeRecvBuffer->h2d(recvCount, false, execStream->s());
+
+#ifdef USE_MIGRATION_RECORD
+    my_dev::kernel &insertNew = insertNewParticlesRecord;
+#else
+    my_dev::kernel &insertNew = insertNewParticlesSFC;
+#endif
+    int nInsert      = recvCount;
+    int insertOffset = 0;
+    insertNew.set_args(0,
+            &nToSend, &nInsert, &tree.n, &insertOffset, localTree.bodies_Ppos.p(),
+            localTree.bodies_Pvel.p(), localTree.bodies_pos.p(), localTree.bodies_vel.p(),
+            localTree.bodies_acc0.p(), localTree.bodies_acc1.p(), localTree.bodies_time.p(),
+            localTree.bodies_ids.p(), localTree.bodies_key.p(), localTree.bodies_h.p(), exchangeRecvBuffer->p());
+    insertNew.setWork(nInsert, 128);
+    insertNew.execute2(execStream->s());
+  }
+#else
   //Now we have to copy the data in batches in case the generalBuffer1 is not large enough
   //Amount we can store:
   int spaceInIntSize    = 3*(memSize)*4;
@@ -1810,7 +2581,7 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
       //Copy the data from the MPI receive buffers into the GPU-send buffer
 #pragma omp parallel for
         for(int cpIdx=0; cpIdx < items; cpIdx++)
-          bodyBuffer[cpIdx] = recv_buffer3[insertOffset+cpIdx]; //TODO can't we just copy directly from recv_buffer3?
+          unpackParticle(recvData[insertOffset+cpIdx], bodyBuffer[cpIdx]);
 
       bodyBuffer.h2d(items);
 
@@ -1834,6 +2605,23 @@ int octree::gpu_exchange_particles_with_overflow_check_SFC2(tree_structure &tree
     }// if items > 0
     insertOffset += items;
   } //for recvCount
+#endif
+
+#ifdef USE_MIGRATION_RECORD
+  if(recvCount > 0)
+  {
+    //Rebuild Ppos and Pvel of the received particles with the same kernel
+    //and input as the sender used, so they are bit identical
+    int   nInsert = recvCount;
+    const int first = tree.n - nToSend;
+    void *pos  = tree.bodies_pos. a(first), *vel  = tree.bodies_vel. a(first);
+    void *acc0 = tree.bodies_acc0.a(first), *time = tree.bodies_time.a(first);
+    void *Ppos = tree.bodies_Ppos.a(first), *Pvel = tree.bodies_Pvel.a(first);
+    predictParticles.set_args(0, &nInsert, &t_current, &t_previous, &pos, &vel, &acc0, &time, &Ppos, &Pvel);
+    predictParticles.setWork(nInsert, 128);
+    predictParticles.execute2(execStream->s());
+  }
+#endif
 
   //Resize the arrays of the tree
   tree.setN(newN);
@@ -2187,7 +2975,6 @@ void octree::sendCurrentInfoGrpTree()
   //Wait for multipole data to be copied
   localTree.multipole.waitForCopyEvent();
 
-  static std::vector<real4> fullBoundaryTree;
   static std::vector<real4> SmallBoundaryTree;
 
   //Build the small-tree
@@ -2286,21 +3073,69 @@ void octree::sendCurrentInfoGrpTree()
 
 
   //MPI_Allgatherv for the small tree and Isend/IRecv for the fulltree
+  int nGrpDeltaChanged = -1;
+  unsigned long long grpBytesSend = 0;
+  if(grpTreeDeltaTol > 0)
+  {
+    //Only the changed parts of the small tree are broadcast, the receivers patch their copy
+    if(!grpTreeDelta) grpTreeDelta = new GroupTreeDelta(nProcs, grpTreeDeltaTol, 16);
+    const std::vector<real4> &message = grpTreeDelta->encode(SmallBoundaryTree, iter);
+    nGrpDeltaChanged = grpTreeDelta->nChanged;
+
+    static std::vector<int>   msgSizes, msgCounts, msgDispl;
+    static std::vector<real4> msgRecv;
+    msgSizes.resize(nProcs);
+    msgCounts.resize(nProcs);
+    msgDispl.resize(nProcs+1);
+
+    int msgSize = message.size();
+    MPI_Allgather(&msgSize, 1, MPI_INT, &msgSizes[0], 1, MPI_INT, mpiCommWorld);
+    grpBytesSend += sizeof(int) + msgSize*sizeof(real4);
+
+    msgDispl[0] = 0;
+    for(int i=0; i < nProcs; i++)
+    {
+      msgCounts[i]  = 4*msgSizes[i];
+      msgDispl[i+1] = msgDispl[i] + msgCounts[i];
+    }
+    msgRecv.resize(msgDispl[nProcs]/4 + 1);
+    MPI_Allgatherv((void*)&message[0], 4*msgSize, MPI_FLOAT,
+                   &msgRecv[0], &msgCounts[0], &msgDispl[0], MPI_FLOAT, mpiCommWorld);
+    allGatherVSize = msgDispl[nProcs]*sizeof(float);
+
+    for(int i=0; i < nProcs; i++)
+    {
+      const std::vector<real4> &tree = (i == procId) ? SmallBoundaryTree :
+                                       grpTreeDelta->decode(i, &msgRecv[msgDispl[i]/4], msgSizes[i]);
+      assert((int)tree.size() == abs(globalGroupSizeArrayRecv[i].y));
+      memcpy(&globalGrpTreeCntSize[this->globalGrpTreeOffsets[i]], &tree[0], tree.size()*sizeof(real4));
+    }
+  }
+  else
   {
     nGroups = SmallBoundaryTree.size();
+    grpBytesSend += nGroups*sizeof(real4);
     MPI_Allgatherv(&SmallBoundaryTree[0], sizeof(real4)*nGroups, MPI_BYTE,
                    globalGrpTreeCntSize, &groupRecvSizesSmall[0],   &displacement[0], MPI_BYTE,
                    mpiCommWorld);
   }
 
   double t2 = get_time();
+  if (commMatrix) commMatrix->collective(CommMatrix::GRPTREE, grpBytesSend + 2*nProcs*sizeof(int), t2-t0);
 
   //Send / receive loop like particle exchange
   static MPI_Status stat[NMAXPROC];
   static MPI_Request req[NMAXPROC*2];
+  static int      reqPeer[NMAXPROC*2];
   assert(nProcs < NMAXPROC);
 
   int nreq = 0;
+#ifdef USE_PERSISTENT_EXCHANGE
+  if(!grpTreeExchange)
+    grpTreeExchange = new PersistentExchange(nProcs, mpiCommWorld, MPI_BYTE, 1, 22);
+  static std::vector<std::pair<const void*, int> > recvParts; //Location and source of the received trees
+  recvParts.clear();
+#endif
   for (int dist = 1; dist < nProcs; dist++)
   {
     const int src    = (nProcs + procId - dist) % nProcs;
@@ -2311,23 +3146,59 @@ void octree::sendCurrentInfoGrpTree()
 
     if (scount > 0)
     {
+#ifdef USE_PERSISTENT_EXCHANGE
+      grpTreeExchange->send(dst, &fullBoundaryTree[0], scount);
+#else
+      reqPeer[nreq] = dst;
       MPI_Isend(&fullBoundaryTree[0], scount, MPI_BYTE, dst, 1, mpiCommWorld, &req[nreq++]);
+#endif
+      grpBytesSend += scount;
+      if (commMatrix) commMatrix->send(CommMatrix::GRPTREE, dst, scount);
       LOGF(stderr,"Sending to: %d size: %d \n", dst, (int)(scount / sizeof(real4)));
     }
     if(rcount > 0)
     {
+#ifdef USE_PERSISTENT_EXCHANGE
+      recvParts.push_back(std::make_pair(grpTreeExchange->recv(src, rcount), src));
+#else
+      reqPeer[nreq] = src;
       MPI_Irecv(&globalGrpTreeCntSize[offset], rcount, MPI_BYTE, src, 1, mpiCommWorld, &req[nreq++]);
+#endif
+      if (commMatrix) commMatrix->recv(CommMatrix::GRPTREE, src, rcount);
       LOGF(stderr,"Receiving from: %d size: %d Offset: %d \n",
                     src, globalGroupSizeArrayRecv[src].x, offset);
     }
   }
-  MPI_Waitall(nreq, req, stat);
+  if (commMatrix)
+    commMatrix->waitAll(CommMatrix::GRPTREE, nreq, req, reqPeer);
+  else
+    MPI_Waitall(nreq, req, stat);
+#ifdef USE_PERSISTENT_EXCHANGE
+  if (commMatrix)
+  {
+    static std::vector<double> peerWait;
+    grpTreeExchange->waitAll(&peerWait);
+    commMatrix->addWait(CommMatrix::GRPTREE, peerWait);
+  }
+  else
+    grpTreeExchange->waitAll();
+  for(size_t i=0; i < recvParts.size(); i++)
+  {
+    const int src = recvParts[i].second;
+    memcpy(&globalGrpTreeCntSize[this->globalGrpTreeOffsets[src]], recvParts[i].first,
+           globalGroupSizeArrayRecv[src].x * sizeof(real4));
+  }
+#endif
 
 
   double tEndGrp = get_time();
+  parStats.tGrpTree      += tEndGrp - tStartGrp;
+  parStats.bytesGrpTree  += grpBytesSend;
+  parStats.nGrpTreeNodes += host_float_as_int(SmallBoundaryTree[0].y) + host_float_as_int(fullBoundaryTree[0].y);
+
   char buff5[1024];
-  sprintf(buff5,"BLETTIME-%d: Iter: %d tGrpSend: %lg nGrpSizeSmall: %d nGrpSizeLarge: %d nSmall: %d nLarge: %d tAllgather: %lg tAllGatherv: %lg tSendRecv: %lg AllGatherVSize: %f\n",
-                 procId, iter, tEndGrp-tStartGrp, nGroupsSmallSet, nGroupsFullSet, nGroupsSmall, nGroupsLarge, t1-t0, t2-t1, tEndGrp-t2, allGatherVSize / (1024*1024.));
+  sprintf(buff5,"BLETTIME-%d: Iter: %d tGrpSend: %lg nGrpSizeSmall: %d nGrpSizeLarge: %d nSmall: %d nLarge: %d tAllgather: %lg tAllGatherv: %lg tSendRecv: %lg AllGatherVSize: %f nDeltaChanged: %d\n",
+                 procId, iter, tEndGrp-tStartGrp, nGroupsSmallSet, nGroupsFullSet, nGroupsSmall, nGroupsLarge, t1-t0, t2-t1, tEndGrp-t2, allGatherVSize / (1024*1024.), nGrpDeltaChanged);
   devContext->writeLogEvent(buff5);
 
 #endif
@@ -2430,15 +3301,6 @@ int getLEToptQuickTreevsTree(
   const _v4sf* grpNodeCenterInfoV = (const _v4sf*)groupCentreInfo;
 
 
-#ifdef USE_AVX  /* AVX */
-    #ifndef __AVX__
-        #error "AVX is not defined"
-    #endif
-      const int SIMDW  = 8;
-      #define AVXIMBH
-    #else
-      const int SIMDW  = 4; //#define SSEIMBH
-#endif
 
   bufferStruct.LETBuffer_node.clear();
   bufferStruct.LETBuffer_ptcl.clear();
@@ -2477,28 +3339,16 @@ int getLEToptQuickTreevsTree(
       const int groupEnd = nodePacked.z;
 
 
-      bufferStruct.groupSplitFlag.clear();
-      for (int ib = groupBeg; ib < groupEnd; ib += SIMDW)
-      {
-        _v4sf centre[SIMDW], size[SIMDW];
-        for (int laneIdx = 0; laneIdx < SIMDW; laneIdx++)
-        {
-          const int group = levelGroups.first()[std::min(ib+laneIdx, groupEnd-1)];
-          centre[laneIdx] = grpNodeCenterInfoV[group];
-          size  [laneIdx] =   grpNodeSizeInfoV[group];
-        }
-#ifdef AVXIMBH
-        bufferStruct.groupSplitFlag.push_back(split_node_grav_impbh_box8a(nodeCOM, centre, size));
-#else
-        bufferStruct.groupSplitFlag.push_back(split_node_grav_impbh_box4a(nodeCOM, centre, size));
-#endif
-      }
+      bufferStruct.groupSplitFlag.resize(((groupEnd-groupBeg-1)/LET_SPLIT_MAXW+1)*LET_SPLIT_MAXW);
+      letSplitKernels.splitFlags(nodeCOM, grpNodeCenterInfoV, grpNodeSizeInfoV,
+                                 &levelGroups.first()[groupBeg], groupEnd-groupBeg,
+                                 &bufferStruct.groupSplitFlag[0]);
 
       const int groupNextBeg = levelGroups.second().size();
       int split = false;
       for (int idx = groupBeg; idx < groupEnd; idx++)
       {
-        const bool gsplit = ((uint*)&bufferStruct.groupSplitFlag[0])[idx - groupBeg];
+        const bool gsplit = bufferStruct.groupSplitFlag[idx - groupBeg];
         if (gsplit)
         {
           split = true;
@@ -2534,7 +3384,10 @@ int getLEToptQuickTreevsTree(
         //Return -1 if we need to split something for which we
         //don't have any data-available
         if(nodeInfo_y == 0xFFFFFFFF)
+        {
+          timeFunction = get_time2() - tStart;
           return -1;
+        }
 
         if (!lleaf)
         {
@@ -2557,45 +3410,39 @@ int getLEToptQuickTreevsTree(
     levelGroups.second().clear();
   }
 
+  timeFunction = get_time2() - tStart;
   return 0;
 }
 
 
-int3 getLET1(
+/*
+ * Walk the local tree from every cellStride-th cell in [cellBeg, cellEnd) and
+ * store the nodes and particles that have to be exported in LETnodes/LETptcl.
+ * Child offsets of exported nodes start at cellOffset, particle offsets at 0.
+ * Returns the depth of the walk.
+ */
+static int getLETWalk(
     GETLETBUFFERS &bufferStruct,
-    real4 **LETBuffer_ptr,
+    std::vector<int2> &LETnodes,
+    std::vector<int > &LETptcl,
     const real4 *nodeCentre,
     const real4 *nodeSize,
     const real4 *multipole,
     const int cellBeg,
     const int cellEnd,
-    const real4 *bodies,
-    const int nParticles,
+    const int cellStride,
+    const int cellOffset,
     const real4 *groupSizeInfo,
     const real4 *groupCentreInfo,
     const int nGroups,
-    const int nNodes,
     unsigned long long &nflops)
 {
-  bufferStruct.LETBuffer_node.clear();
-  bufferStruct.LETBuffer_ptcl.clear();
   bufferStruct.currLevelVecI.clear();
   bufferStruct.nextLevelVecI.clear();
 
-  nflops = 0;
-
   int nExportPtcl = 0;
-  int nExportCell = 0;
-  int nExportCellOffset = cellEnd;
-
-  nExportCell += cellBeg;
-  for (int node = 0; node < cellBeg; node++)
-    bufferStruct.LETBuffer_node.push_back((int2){node, host_float_as_int(nodeSize[node].w)});
-
+  int nExportCellOffset = cellOffset;
 
-  const _v4sf*            bodiesV = (const _v4sf*)bodies;
-  const _v4sf*          nodeSizeV = (const _v4sf*)nodeSize;
-  const _v4sf*        nodeCentreV = (const _v4sf*)nodeCentre;
   const _v4sf*         multipoleV = (const _v4sf*)multipole;
   const _v4sf*   groupSizeV = (const _v4sf*)groupSizeInfo;
   const _v4sf* groupCenterV = (const _v4sf*)groupCentreInfo;
@@ -2604,14 +3451,8 @@ int3 getLET1(
 
   const int SIMDW   = 4;
 
-  #ifdef USE_AVX
-      //We use a mix of 4 and 8 widths
-      const int SIMDW2  = 8;
-  #else
-      const int SIMDW2  = 4;
-  #endif
-
-  const int nGroups4 = ((nGroups-1)/SIMDW2 + 1)*SIMDW2;
+  //Pad to the widest opening-test kernel, the padding repeats the last group
+  const int nGroups4 = ((nGroups-1)/LET_SPLIT_MAXW + 1)*LET_SPLIT_MAXW;
 
   //We need a bunch of buffers to act as swap space
   const int allocSize = (int)(nGroups4*1.10);
@@ -2631,7 +3472,7 @@ int3 getLET1(
 
 
 #if 1
-  const bool TRANSPOSE_SPLIT = false;
+  const bool TRANSPOSE_SPLIT = false;   //splitAny expects transposed blocks
 #else
   const bool TRANSPOSE_SPLIT = true;
 #endif
@@ -2664,7 +3505,7 @@ int3 getLET1(
     bufferStruct.groupSizeSIMD[ib+3] = bsw;
   }
 
-  for (int cell = cellBeg; cell < cellEnd; cell++)
+  for (int cell = cellBeg; cell < cellEnd; cell += cellStride)
     levelList.first().push_back(cell);
 
  int depth = 0;
@@ -2680,109 +3521,545 @@ int3 getLET1(
                                        bufferStruct.groupSIMDkeys);
 //      shuffle2vec<v4sf,SIMDW>(bufferStruct.groupCentreSIMD, bufferStruct.groupSizeSIMD);
 #endif
-    for (int i = 0; i < csize; i++)
-    {
-      const uint        nodeIdx  = levelList.first()[i];
-      const float nodeInfo_x = nodeCentre[nodeIdx].w;
-      const uint  nodeInfo_y = host_float_as_int(nodeSize[nodeIdx].w);
+    for (int i = 0; i < csize; i++)
+    {
+      const uint        nodeIdx  = levelList.first()[i];
+      const float nodeInfo_x = nodeCentre[nodeIdx].w;
+      const uint  nodeInfo_y = host_float_as_int(nodeSize[nodeIdx].w);
+
+      _v4sf nodeCOM = multipoleV[nodeIdx*3];
+      nodeCOM       = VECINSERT(nodeInfo_x, nodeCOM, 3);
+
+      int split = false;
+
+      /**************/
+
+
+      nflops += nGroups*20;  /* effective flops, can be less */
+      split   = letSplitKernels.splitAny(nodeCOM, (_v4sf*)&bufferStruct.groupCentreSIMD[0],
+                                         (_v4sf*)&bufferStruct.groupSizeSIMD[0], nGroups4);
+      /**************/
+
+      real4 size  = nodeSize[nodeIdx];
+      int sizew = 0xFFFFFFFF;
+
+      if (split)
+      {
+        const bool lleaf = nodeInfo_x <= 0.0f;
+        if (!lleaf)
+        {
+          const int lchild  =    nodeInfo_y & 0x0FFFFFFF;            //Index to the first child of the node
+          const int lnchild = (((nodeInfo_y & 0xF0000000) >> 28)) ;  //The number of children this node has
+          sizew = (nExportCellOffset | (lnchild << LEAFBIT));
+          nExportCellOffset += lnchild;
+          for (int i = lchild; i < lchild + lnchild; i++)
+            levelList.second().push_back(i);
+        }
+        else
+        {
+          const int pfirst =    nodeInfo_y & BODYMASK;
+          const int np     = (((nodeInfo_y & INVBMASK) >> LEAFBIT)+1);
+          sizew = (nExportPtcl | ((np-1) << LEAFBIT));
+          for (int i = pfirst; i < pfirst+np; i++)
+            LETptcl.push_back(i);
+          nExportPtcl += np;
+        }
+      }
+
+      LETnodes.push_back((int2){(int)nodeIdx, sizew});
+    }
+    depth++;
+    levelList.swap();
+    levelList.second().clear();
+  }
+
+  return depth;
+}
+
+//Allocate the LET buffer and fill it with the selected particles and nodes
+static void copyLETBuffer(
+    real4 **LETBuffer_ptr,
+    const std::vector<int2> &LETBuffer_node,
+    const std::vector<int > &LETBuffer_ptcl,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const real4 *bodies)
+{
+  const int nExportPtcl = LETBuffer_ptcl.size();
+  const int nExportCell = LETBuffer_node.size();
+
+  const _v4sf*            bodiesV = (const _v4sf*)bodies;
+  const _v4sf*          nodeSizeV = (const _v4sf*)nodeSize;
+  const _v4sf*        nodeCentreV = (const _v4sf*)nodeCentre;
+  const _v4sf*         multipoleV = (const _v4sf*)multipole;
+
+  /* now copy data into LETBuffer */
+  {
+    //LETBuffer.resize(nExportPtcl + 5*nExportCell);
+    *LETBuffer_ptr = letBufferPool->get<real4>(1+ nExportPtcl + 5*nExportCell);
+    real4 *LETBuffer = *LETBuffer_ptr;
+    _v4sf *vLETBuffer      = (_v4sf*)(&LETBuffer[1]);
+    //_v4sf *vLETBuffer      = (_v4sf*)&LETBuffer     [0];
+
+    int nStoreIdx = nExportPtcl;
+    int multiStoreIdx = nStoreIdx + 2*nExportCell;
+    for (int i = 0; i < nExportPtcl; i++)
+    {
+      const int idx = LETBuffer_ptcl[i];
+      vLETBuffer[i] = bodiesV[idx];
+    }
+    for (int i = 0; i < nExportCell; i++)
+    {
+      const int2 packed_idx = LETBuffer_node[i];
+      const int idx     = packed_idx.x;
+      const float sizew = host_int_as_float(packed_idx.y);
+      const _v4sf size  = VECINSERT(sizew,nodeSizeV[idx], 3);
+
+
+      vLETBuffer[nStoreIdx+nExportCell] = nodeCentreV[idx];     /* centre */
+      vLETBuffer[nStoreIdx            ] = size;                 /*  size  */
+
+      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+0];  /* multipole.x */
+      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+1];  /* multipole.x */
+      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+2];  /* multipole.x */
+      nStoreIdx++;
+    }
+  }
+
+}
+
+int3 getLET1(
+    GETLETBUFFERS &bufferStruct,
+    real4 **LETBuffer_ptr,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole,
+    const int cellBeg,
+    const int cellEnd,
+    const real4 *bodies,
+    const int nParticles,
+    const real4 *groupSizeInfo,
+    const real4 *groupCentreInfo,
+    const int nGroups,
+    const int nNodes,
+    unsigned long long &nflops)
+{
+  bufferStruct.LETBuffer_node.clear();
+  bufferStruct.LETBuffer_ptcl.clear();
+
+  nflops = 0;
+
+  for (int node = 0; node < cellBeg; node++)
+    bufferStruct.LETBuffer_node.push_back((int2){node, host_float_as_int(nodeSize[node].w)});
+
+  const int depth = getLETWalk(bufferStruct,
+                               bufferStruct.LETBuffer_node, bufferStruct.LETBuffer_ptcl,
+                               nodeCentre, nodeSize, multipole,
+                               cellBeg, cellEnd, 1, cellEnd,
+                               groupSizeInfo, groupCentreInfo, nGroups, nflops);
+
+  copyLETBuffer(LETBuffer_ptr, bufferStruct.LETBuffer_node, bufferStruct.LETBuffer_ptcl,
+                nodeCentre, nodeSize, multipole, bodies);
+
+  const int nExportPtcl = bufferStruct.LETBuffer_ptcl.size();
+  const int nExportCell = bufferStruct.LETBuffer_node.size();
+
+  return (int3){nExportCell, nExportPtcl, depth};
+}
+
+//Extract the groups from a group-tree (as build by sendCurrentInfoGrpTree), these
+//are the leaves and the nodes that are marked as end-point
+static void extractBoundaryGroups(const real4         *grpTree,
+                                  std::vector<float4> &boundaryCentres,
+                                  std::vector<float4> &boundarySizes)
+{
+  const int nbody = host_float_as_int(grpTree[0].x);
+  const int nnode = host_float_as_int(grpTree[0].y);
+
+  const real4 *grpSize   = &grpTree[1+nbody];
+  const real4 *grpCenter = &grpTree[1+nbody+nnode];
+
+  boundarySizes.clear();
+  boundaryCentres.clear();
+
+  for(int startSearch=0; startSearch < nnode; startSearch++)
+  {
+    //Two tests, if its a  leaf, and/or if its a node and marked as end-point
+    if((host_float_as_int(grpSize[startSearch].w) == 0xFFFFFFFF) || grpCenter[startSearch].w <= 0) //Tree extract
+    {
+      boundarySizes.push_back  (grpSize  [startSearch]);
+      boundaryCentres.push_back(grpCenter[startSearch]);
+    }
+  }//end for
+}
+
+
+/*
+ * Work-stealing scheduler for the LET construction.
+ * A job is the LET for one remote process. Large jobs are split in tasks that
+ * each walk an interleaved subset of the start-level cells (cell = cellBeg + part + k*nParts),
+ * so that the LETs of nearby processes are built by multiple threads. The
+ * thread that finishes the last task of a job merges the parts.
+ */
+struct LETJob
+{
+  int ibox;
+  int cellBeg, cellEnd;           //Start level of the local tree
+  int nParts;
+  int partsLeft;
+  const real4 *grpCenter;
+  const real4 *grpSize;           //Group sizes used for the walk, can be enlarged by margin
+  const real4 *grpSizeRef;        //Group sizes as received
+  int nGroups;
+  bool  reuseCache;               //Send the cached LET node-set
+  bool  storeCache;               //Store the result in the LET cache
+  float margin;
+  std::vector<float4> boundaryCentres;
+  std::vector<float4> boundarySizes;
+  std::vector<float4> enlargedSizes;
+  std::vector< std::vector<int2> > partNodes;
+  std::vector< std::vector<int > > partPtcl;
+  std::vector<int> partDepth;
+  unsigned long long nflops;
+  double tStart;
+};
+
+struct LETTask
+{
+  LETJob *job;
+  int     part;
+};
+
+struct LETTaskQueues
+{
+  struct __attribute__(( aligned(64) )) Queue
+  {
+    omp_lock_t          lock;
+    std::deque<LETTask> tasks;
+  };
+
+  std::vector<Queue> queues;
+  int nQueued;  //Tasks in the queues, not those being processed
+
+  LETTaskQueues(const int nThreads) : queues(nThreads), nQueued(0)
+  {
+    for(int i=0; i < nThreads; i++) omp_init_lock(&queues[i].lock);
+  }
+  ~LETTaskQueues()
+  {
+    for(size_t i=0; i < queues.size(); i++) omp_destroy_lock(&queues[i].lock);
+  }
+
+  void push(const int tid, const LETTask &task)
+  {
+    omp_set_lock(&queues[tid].lock);
+    queues[tid].tasks.push_back(task);
+    __sync_fetch_and_add(&nQueued, 1);
+    omp_unset_lock(&queues[tid].lock);
+  }
+
+  //Owner takes the most recently pushed task
+  bool pop(const int tid, LETTask &task)
+  {
+    if(queues[tid].tasks.empty()) return false;
+    bool found = false;
+    omp_set_lock(&queues[tid].lock);
+    if(!queues[tid].tasks.empty())
+    {
+      task = queues[tid].tasks.back();
+      queues[tid].tasks.pop_back();
+      __sync_fetch_and_sub(&nQueued, 1);
+      found = true;
+    }
+    omp_unset_lock(&queues[tid].lock);
+    return found;
+  }
+
+  //Thieves take the oldest task of another thread
+  bool steal(const int tid, LETTask &task)
+  {
+    const int nThreads = queues.size();
+    for(int i=1; i < nThreads && nQueued > 0; i++)
+    {
+      const int victim = (tid + i) % nThreads;
+      if(queues[victim].tasks.empty()) continue;
+      bool found = false;
+      omp_set_lock(&queues[victim].lock);
+      if(!queues[victim].tasks.empty())
+      {
+        task = queues[victim].tasks.front();
+        queues[victim].tasks.pop_front();
+        __sync_fetch_and_sub(&nQueued, 1);
+        found = true;
+      }
+      omp_unset_lock(&queues[victim].lock);
+      if(found) return true;
+    }
+    return false;
+  }
+};
+
+#ifdef USE_PEER_PRUNING
+//Box around the opening sphere of a cell: centre of mass and the squared
+//opening radius in w, as used by the split kernels
+static PeerBVH::Box openingBox(const real4 &com, const float openR2)
+{
+  const float r = sqrtf(fabsf(openR2))*1.0001f + 1e-6f; //Margin for the float rounding of the split test
+  PeerBVH::Box b = {{com.x-r, com.y-r, com.z-r}, {com.x+r, com.y+r, com.z+r}};
+  return b;
+}
+
+static PeerBVH::Box cellBox(const real4 &centre, const real4 &size)
+{
+  PeerBVH::Box b = {{centre.x-size.x, centre.y-size.y, centre.z-size.z},
+                    {centre.x+size.x, centre.y+size.y, centre.z+size.z}};
+  return b;
+}
+
+//Mark the processes for which both quick-check walks stop at the root. For
+//each process the box around its boundary-tree root and the opening sphere of
+//that root is put in a BVH, which is queried with the same box of our tree.
+//If the boxes do not overlap our root is not opened by the remote groups and
+//the remote root is not opened by our groups. Returns the number of far peers
+static int findFarPeers(const int procId, const int nProcs,
+                        const real4 *grpTrees, const uint *grpTreeOffsets,
+                        const real4 *nodeCentre, const real4 *nodeSize, const real4 *multipole,
+                        std::vector<char> &isFar)
+{
+  static PeerBVH           bvh;
+  static std::vector<PeerBVH::Box> boxes;
+  static std::vector<int>  ids, near;
+
+  boxes.resize(nProcs);
+  ids.clear();
+  isFar.assign(nProcs, 0);
+
+  for(int i=0; i < nProcs; i++)
+  {
+    if(i == procId) continue;
+    const real4 *grpTree = &grpTrees[grpTreeOffsets[i]];
+    const int    nbody   = host_float_as_int(grpTree[0].x);
+    const int    nnode   = host_float_as_int(grpTree[0].y);
+    if(nnode <= 0) continue;  //Empty boundary, keep the regular checks
+
+    //Layout: header, particles, sizes, centres, multipoles
+    const real4 &size   = grpTree[1+nbody];
+    const real4 &centre = grpTree[1+nbody+nnode];
+    const real4 &com    = grpTree[1+nbody+2*nnode];
+    boxes[i] = cellBox(centre, size);
+    boxes[i].expand(openingBox(com, centre.w));
+    ids.push_back(i);
+    isFar[i] = 1;
+  }
+
+  PeerBVH::Box own = cellBox(nodeCentre[0], nodeSize[0]);
+  own.expand(openingBox(multipole[0], nodeCentre[0].w));
+
+  bvh.build(boxes, ids);
+  bvh.query(own, near);
+  for(size_t i=0; i < near.size(); i++) isFar[near[i]] = 0;
+
+  return (int)(ids.size() - near.size());
+}
+#endif
 
-      _v4sf nodeCOM = multipoleV[nodeIdx*3];
-      nodeCOM       = VECINSERT(nodeInfo_x, nodeCOM, 3);
+//Decide in how many tasks to split the LET for process ibox. Based on the
+//cost of the LETs that we sent in the previous step. If there is no history
+//the quick-check result (too large for a quick LET) is used as hint
+static int getLETJobParts(const std::vector<int> &letCostPrevStep, const int ibox,
+                          const bool largeHint, const int nWorkers, const int nTopCells)
+{
+  const int maxParts = std::max(1, std::min(nWorkers, nTopCells));
 
-      int split = false;
+  double costSum = 0;
+  int    costCnt = 0;
+  for(size_t i=0; i < letCostPrevStep.size(); i++)
+  {
+    if(letCostPrevStep[i] > 0) { costSum += letCostPrevStep[i]; costCnt++; }
+  }
 
-      /**************/
+  if(costCnt == 0 || letCostPrevStep[ibox] <= 0)
+    return largeHint ? maxParts : 1;
 
+  const double costAvg = costSum / costCnt;
+  const int    nParts  = (int)(letCostPrevStep[ibox] / costAvg + 0.5);
+  return std::max(1, std::min(nParts, maxParts));
+}
 
-      const _v4sf vncx  = VECPERMUTE(nodeCOM, nodeCOM, 0x00);
-      const _v4sf vncy  = VECPERMUTE(nodeCOM, nodeCOM, 0x55);
-      const _v4sf vncz  = VECPERMUTE(nodeCOM, nodeCOM, 0xaa);
-      const _v4sf vncw  = VECPERMUTE(nodeCOM, nodeCOM, 0xff);
-      const _v4sf vsize = __abs(vncw);
+//Walk for a single task of a split LET job. Offsets are local to this part
+//and fixed up by mergeLETParts
+static void getLET1Part(
+    GETLETBUFFERS &bufferStruct,
+    LETJob &job,
+    const int part,
+    const real4 *nodeCentre,
+    const real4 *nodeSize,
+    const real4 *multipole)
+{
+  job.partNodes[part].clear();
+  job.partPtcl [part].clear();
+
+  unsigned long long nflops = 0;
+  job.partDepth[part] = getLETWalk(bufferStruct,
+                                   job.partNodes[part], job.partPtcl[part],
+                                   nodeCentre, nodeSize, multipole,
+                                   job.cellBeg + part, job.cellEnd, job.nParts, 0,
+                                   job.grpSize, job.grpCenter, job.nGroups, nflops);
+  __sync_fetch_and_add(&job.nflops, nflops);
+}
 
-      nflops += nGroups*20;  /* effective flops, can be less */
-      for (int ib = 0; ib < nGroups4 && !split; ib += SIMDW2){
-#ifdef USE_AVX
-        split |= split_node_grav_impbh_box4simd1<TRANSPOSE_SPLIT>(
-#else
-        split |= split_node_grav_impbh_box4simd1<TRANSPOSE_SPLIT>(
-#endif
-                    vncx,vncy,vncz,vsize, (_v4sf*)&bufferStruct.groupCentreSIMD[ib], (_v4sf*)&bufferStruct.groupSizeSIMD[ib]);
-      }
-      /**************/
+//Combine the parts of a split job into one node and particle list, with
+//the same layout as the lists produced by getLET1. Returns the depth
+static int mergeLETParts(
+    LETJob &job,
+    std::vector<int2> &LETBuffer_node,
+    std::vector<int > &LETBuffer_ptcl,
+    const real4 *nodeCentre,
+    const real4 *nodeSize)
+{
+  const int nParts = job.nParts;
+  std::vector<int> nStartCells(nParts), descOffset(nParts+1), ptclOffset(nParts+1);
 
-      real4 size  = nodeSize[nodeIdx];
-      int sizew = 0xFFFFFFFF;
+  descOffset[0] = ptclOffset[0] = 0;
+  int depth     = 0;
+  for(int k=0; k < nParts; k++)
+  {
+    nStartCells[k]  = (job.cellEnd - (job.cellBeg + k) + nParts - 1) / nParts;
+    descOffset[k+1] = descOffset[k] + (int)job.partNodes[k].size() - nStartCells[k];
+    ptclOffset[k+1] = ptclOffset[k] + (int)job.partPtcl[k].size();
+    depth           = std::max(depth, job.partDepth[k]);
+  }
 
-      if (split)
+  LETBuffer_node.resize(job.cellEnd + descOffset[nParts]);
+  LETBuffer_ptcl.clear();
+  LETBuffer_ptcl.reserve(ptclOffset[nParts]);
+
+  for(int k=0; k < nParts; k++)
+    LETBuffer_ptcl.insert(LETBuffer_ptcl.end(), job.partPtcl[k].begin(), job.partPtcl[k].end());
+
+  for(int node=0; node < job.cellBeg; node++)
+    LETBuffer_node[node] = (int2){node, host_float_as_int(nodeSize[node].w)};
+
+  for(int k=0; k < nParts; k++)
+  {
+    const std::vector<int2> &nodes = job.partNodes[k];
+    for(int i=0; i < (int)nodes.size(); i++)
+    {
+      const int idx  = nodes[i].x;
+      uint      info = nodes[i].y;
+
+      //The start cells keep their index, the rest goes after the start level
+      const int slot = (i < nStartCells[k]) ? idx : job.cellEnd + descOffset[k] + (i - nStartCells[k]);
+
+      if(info != 0xFFFFFFFF)
       {
-        const bool lleaf = nodeInfo_x <= 0.0f;
-        if (!lleaf)
-        {
-          const int lchild  =    nodeInfo_y & 0x0FFFFFFF;            //Index to the first child of the node
-          const int lnchild = (((nodeInfo_y & 0xF0000000) >> 28)) ;  //The number of children this node has
-          sizew = (nExportCellOffset | (lnchild << LEAFBIT));
-          nExportCellOffset += lnchild;
-          for (int i = lchild; i < lchild + lnchild; i++)
-            levelList.second().push_back(i);
-        }
-        else
-        {
-          const int pfirst =    nodeInfo_y & BODYMASK;
-          const int np     = (((nodeInfo_y & INVBMASK) >> LEAFBIT)+1);
-          sizew = (nExportPtcl | ((np-1) << LEAFBIT));
-          for (int i = pfirst; i < pfirst+np; i++)
-            bufferStruct.LETBuffer_ptcl.push_back(i);
-          nExportPtcl += np;
-        }
+        const bool leaf   = nodeCentre[idx].w <= 0.0f;
+        const int  offset = leaf ? ptclOffset[k] : job.cellEnd + descOffset[k];
+        info = ((info & BODYMASK) + offset) | (info & INVBMASK);
       }
-
-      bufferStruct.LETBuffer_node.push_back((int2){(int)nodeIdx, sizew});
-      nExportCell++;
+      LETBuffer_node[slot] = (int2){idx, (int)info};
     }
-    depth++;
-    levelList.swap();
-    levelList.second().clear();
   }
 
-  assert((int)bufferStruct.LETBuffer_ptcl.size() == nExportPtcl);
-  assert((int)bufferStruct.LETBuffer_node.size() == nExportCell);
+  return depth;
+}
 
-  /* now copy data into LETBuffer */
-  {
-    //LETBuffer.resize(nExportPtcl + 5*nExportCell);
-#pragma omp critical //Malloc seems to be not so thread safe..
-    *LETBuffer_ptr = (real4*)malloc(sizeof(real4)*(1+ nExportPtcl + 5*nExportCell));
-    real4 *LETBuffer = *LETBuffer_ptr;
-    _v4sf *vLETBuffer      = (_v4sf*)(&LETBuffer[1]);
-    //_v4sf *vLETBuffer      = (_v4sf*)&LETBuffer     [0];
 
-    int nStoreIdx = nExportPtcl;
-    int multiStoreIdx = nStoreIdx + 2*nExportCell;
-    for (int i = 0; i < nExportPtcl; i++)
-    {
-      const int idx = bufferStruct.LETBuffer_ptcl[i];
-      vLETBuffer[i] = bodiesV[idx];
-    }
-    for (int i = 0; i < nExportCell; i++)
-    {
-      const int2 packed_idx = bufferStruct.LETBuffer_node[i];
-      const int idx     = packed_idx.x;
-      const float sizew = host_int_as_float(packed_idx.y);
-      const _v4sf size  = VECINSERT(sizew,nodeSizeV[idx], 3);
+/*
+ * Cache of the LET node-set that we sent to a remote process. As long as the
+ * local tree is not rebuild the node indices stay valid. The walk is done
+ * against remote groups that are enlarged by 'margin', the resulting node-set
+ * stays a valid (conservative) LET as long as the remote groups and the local
+ * nodes that were not opened moved less than that margin. This is checked
+ * without a tree-walk by getLETCacheDrift.
+ */
+struct LETCache
+{
+  int   buildCount;             //Local tree build this set belongs to, -1 if invalid
+  int   cellBeg, cellEnd;
+  int   depth;
+  int   stepsSinceWalk;
+  float margin;
+  float driftPerStep;           //Largest observed movement per step, used to choose the margin
+  std::vector<int2>   nodes;
+  std::vector<int >   ptcl;
+  std::vector<float4> grpCenter;    //Remote groups used for the walk (not enlarged)
+  std::vector<float4> grpSize;
+  std::vector<int>    frontier;     //Local nodes that were not opened
+  std::vector<float4> frontierRef;  //Their centre of mass (xyz) and sqrt of the opening size (w)
+
+  LETCache() : buildCount(-1), cellBeg(0), cellEnd(0), depth(0), stepsSinceWalk(0),
+               margin(0), driftPerStep(0) {}
+};
 
+//Returns how far the groups and the not opened nodes moved since the walk,
+//or -1 if the remote group-set changed
+static float getLETCacheDrift(
+    const LETCache &cache,
+    const real4 *grpCenter,
+    const real4 *grpSize,
+    const int nGroups,
+    const real4 *nodeCentre,
+    const real4 *multipole)
+{
+  if(nGroups != (int)cache.grpCenter.size()) return -1;
 
-      vLETBuffer[nStoreIdx+nExportCell] = nodeCentreV[idx];     /* centre */
-      vLETBuffer[nStoreIdx            ] = size;                 /*  size  */
+  float grpDrift = 0;
+  for(int i=0; i < nGroups; i++)
+  {
+    const float4 c0 = cache.grpCenter[i], s0 = cache.grpSize[i];
+    const float4 c1 = grpCenter[i],       s1 = grpSize[i];
+    grpDrift = std::max(grpDrift, fabsf(c1.x-c0.x) + std::max(s1.x-s0.x, 0.0f));
+    grpDrift = std::max(grpDrift, fabsf(c1.y-c0.y) + std::max(s1.y-s0.y, 0.0f));
+    grpDrift = std::max(grpDrift, fabsf(c1.z-c0.z) + std::max(s1.z-s0.z, 0.0f));
+  }
 
-      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+0];  /* multipole.x */
-      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+1];  /* multipole.x */
-      vLETBuffer[multiStoreIdx++      ] = multipoleV[3*idx+2];  /* multipole.x */
-      nStoreIdx++;
-    }
+  float nodeDrift = 0;
+  for(int i=0; i < (int)cache.frontier.size(); i++)
+  {
+    const int    idx = cache.frontier[i];
+    const float4 ref = cache.frontierRef[i];
+    const float4 com = multipole[3*idx];
+    float d = std::max(fabsf(com.x-ref.x), std::max(fabsf(com.y-ref.y), fabsf(com.z-ref.z)));
+    d      += sqrtf(fabsf(nodeCentre[idx].w)) - ref.w;  //Growth of the opening distance
+    nodeDrift = std::max(nodeDrift, d);
   }
 
-  return (int3){nExportCell, nExportPtcl, depth};
+  return grpDrift + nodeDrift;
+}
+
+static void storeLETCache(
+    LETCache &cache,
+    const LETJob &job,
+    const std::vector<int2> &nodes,
+    const std::vector<int > &ptcl,
+    const int depth,
+    const int buildCount,
+    const real4 *nodeCentre,
+    const real4 *multipole)
+{
+  cache.buildCount     = buildCount;
+  cache.cellBeg        = job.cellBeg;
+  cache.cellEnd        = job.cellEnd;
+  cache.depth          = depth;
+  cache.stepsSinceWalk = 0;
+  cache.margin         = job.margin;
+  cache.nodes          = nodes;
+  cache.ptcl           = ptcl;
+  cache.grpCenter.assign(job.grpCenter,  job.grpCenter  + job.nGroups);
+  cache.grpSize.assign  (job.grpSizeRef, job.grpSizeRef + job.nGroups);
+
+  cache.frontier.clear();
+  cache.frontierRef.clear();
+  for(int i=job.cellBeg; i < (int)nodes.size(); i++)
+  {
+    if((uint)nodes[i].y != 0xFFFFFFFF) continue;
+    const int idx = nodes[i].x;
+    const float4 com = multipole[3*idx];
+    cache.frontier.push_back(idx);
+    cache.frontierRef.push_back(make_float4(com.x, com.y, com.z, sqrtf(fabsf(nodeCentre[idx].w))));
+  }
 }
 
 
@@ -2828,14 +4105,7 @@ int getLEToptQuickFullTree(
   const _v4sf* grpNodeCenterInfoV = (const _v4sf*)groupCentreInfo;
 
 
-#ifdef USE_AVX
-    #ifndef __AVX__
-    #error "AVX is not defined"
-    #endif
-      const int SIMDW  = 8;
-    #else
-      const int SIMDW  = 4;
-#endif
+  const int SIMDW = letSplitKernels.width;
 
   bufferStruct.LETBuffer_node.clear();
   bufferStruct.LETBuffer_ptcl.clear();
@@ -2887,28 +4157,16 @@ int getLEToptQuickFullTree(
       const int groupEnd = nodePacked.z;
       nflops += 20*((groupEnd - groupBeg-1)/SIMDW+1)*SIMDW;
 
-      bufferStruct.groupSplitFlag.clear();
-      for (int ib = groupBeg; ib < groupEnd; ib += SIMDW)
-      {
-        _v4sf centre[SIMDW], size[SIMDW];
-        for (int laneIdx = 0; laneIdx < SIMDW; laneIdx++)
-        {
-          const int group = levelGroups.first()[std::min(ib+laneIdx, groupEnd-1)];
-          centre[laneIdx] = grpNodeCenterInfoV[group];
-          size  [laneIdx] =   grpNodeSizeInfoV[group];
-        }
-#ifdef AVXIMBH
-        bufferStruct.groupSplitFlag.push_back(split_node_grav_impbh_box8a(nodeCOM, centre, size));
-#else
-        bufferStruct.groupSplitFlag.push_back(split_node_grav_impbh_box4a(nodeCOM, centre, size));
-#endif
-      }
+      bufferStruct.groupSplitFlag.resize(((groupEnd-groupBeg-1)/LET_SPLIT_MAXW+1)*LET_SPLIT_MAXW);
+      letSplitKernels.splitFlags(nodeCOM, grpNodeCenterInfoV, grpNodeSizeInfoV,
+                                 &levelGroups.first()[groupBeg], groupEnd-groupBeg,
+                                 &bufferStruct.groupSplitFlag[0]);
 
       const int groupNextBeg = levelGroups.second().size();
       int split = false;
       for (int idx = groupBeg; idx < groupEnd; idx++)
       {
-        const bool gsplit = ((uint*)&bufferStruct.groupSplitFlag[0])[idx - groupBeg];
+        const bool gsplit = bufferStruct.groupSplitFlag[idx - groupBeg];
 
         if (gsplit)
         {
@@ -3071,6 +4329,7 @@ typedef struct letObject
   real4       *buffer;
   int          size;
   int          destination;
+  int          tag;           //999 raw LET, 998 LETCodec encoded
 #ifdef USE_MPI
   MPI_Request  req;
 #endif
@@ -3093,6 +4352,39 @@ void octree::checkGPUAndStartLETComputation(tree_structure &tree,
                                             real4         **treeBuffers)
 {
 #ifdef USE_MPI
+  if(letStreamMB > 0)
+  {
+    //Streaming: the walk of the staged batch starts as soon as the GPU is free. The next
+    //batch is merged while that walk runs, instead of waiting for the GPU before merging
+    if(letStagedSize > 0 && gravStream->isFinished())
+      launchStagedLET();
+    if(letStagedSize > 0 || (nReceived - procTrees) <= 0)
+      return;
+
+    int recvTree      = 0;
+    int topNodeCount  = 0;
+    int oriTopCount   = 0;
+#pragma omp critical(updateReceivedProcessed)
+    {
+      recvTree             = nReceived;
+      topNodeCount         = topNodeOnTheFlyCount;
+      oriTopCount          = topNodeOnTheFlyCount;
+      topNodeOnTheFlyCount = 0;
+    }
+
+    mergeAndLaunchLETStructures(tree, remote, treeBuffers, treeBuffersSource,
+        topNodeCount, recvTree, mergeOwntree, procTrees, tStart);
+
+#pragma omp critical(updateReceivedProcessed)
+    {
+      topNodeOnTheFlyCount += (oriTopCount-topNodeCount);
+    }
+
+    totalLETExTime += thisPartLETExTime;
+    if(gravStream->isFinished()) launchStagedLET();
+    return;
+  }
+
     //This determines if we interrupt the LET computation by starting a gravity kernel on the GPU
   if(gravStream->isFinished())
   {
@@ -3129,6 +4421,17 @@ void octree::checkGPUAndStartLETComputation(tree_structure &tree,
 }
 
 
+//Walk the batch that mergeAndLaunchLETStructures left in remoteTree, waits for the
+//previous walk if that is still running
+void octree::launchStagedLET()
+{
+  if(letStagedSize == 0) return;
+  approximate_gravity_let(this->localTree, this->remoteTree, letStagedSize, letStagedActive);
+  letStagedSize   = 0;
+  letStagedActive = false;
+}
+
+
 void octree::essential_tree_exchangeV2(tree_structure &tree,
                                        tree_structure &remote,
                                        vector<real4>  &topLevelTrees,
@@ -3200,14 +4503,34 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   int nQuickBoundaryOk          = 0;
 
 
-  omp_set_num_threads(16); //8 Piz-Daint, 16 Titan
+  const static int MAX_THREAD = 64;
+  HostThreads &hostThreads = HostThreads::instance();
+  omp_set_num_threads(std::min(hostThreads.getLETThreads(), MAX_THREAD));
+
+  //Holds the buffers of about two steps, sends can still be in flight when the next step starts.
+  //The bytes kept are limited by the LET streaming budget when that is set
+  const size_t poolBytes = (letStreamMB > 0 ? (size_t)letStreamMB : (size_t)1024) * 1024 * 1024;
+  if(!letBufferPool) letBufferPool = new LETBufferPool(std::max(2*nProcs, 64), poolBytes);
+
+  if(useProgressThread && !letProgress)
+  {
+    letProgress = new MPIProgress();
+    if(!letProgress->start(hostThreads.getProgressCpu()))
+    {
+      if(procId == 0) fprintf(stderr, "MPI progress thread requires MPI_THREAD_MULTIPLE, disabled\n");
+      delete letProgress;
+      letProgress       = NULL;
+      useProgressThread = false;
+    }
+  }
+  freeCompletedLETSends();  //Sends of the previous step that completed after we returned
 
   letObject *computedLETs = new letObject[nProcs-1];
 
   int omp_ticket      = 0;
   int omp_ticket2     = 0;
   int omp_ticket3     = 0;
-  int nComputedLETs   = 0;
+  MPMCQueue<letObject> readyLETs(nProcs);  //LETs that are built and ready to be send
   int nReceived       = 0;
   int nSendOut        = 0;
   int nToSend	        = 0;
@@ -3222,8 +4545,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
   assert(nProcs <= NPROCMAX);
 
 
-  const static int MAX_THREAD = 64;
-  assert(MAX_THREAD >= omp_get_num_threads());
+  assert(MAX_THREAD >= omp_get_max_threads());
   static __attribute__(( aligned(64) )) GETLETBUFFERS getLETBuffers[MAX_THREAD];
 
 
@@ -3276,12 +4598,50 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
   bool completedA2A = false; //Barrier for the getLET threads
 
+  //Task queues for the LET construction, one per thread
+  LETTaskQueues letTaskQueues(omp_get_max_threads());
+  static std::vector<int> letCostPrevStep;  //Size of the LET we sent to each process last step
+  letCostPrevStep.resize(nProcs, 0);
+#ifdef USE_LET_REUSE
+  static std::vector<LETCache> letCache;     //Node-set of the LET we sent to each process
+  letCache.resize(nProcs);
+#endif
+  int nLETReused = 0;
+  unsigned long long letBytesRaw = 0, letBytesSent = 0; //LET volume before and after compression
+
+  //Processes on the same node walk each others tree in shared memory, they build the
+  //LET against their own groups and do not exchange any LET data with each other.
+  //Our segment is overwritten during the next publish, the peers are done reading
+  //it by then since they all have to enter the node Allreduce at the start of publish
+  int nNodeShared = 0;
+  std::vector<float4> ownBoundaryCentres, ownBoundarySizes;
+  if(useNodeSharedLET)
+  {
+    if(!nodeSharedTree) nodeSharedTree = new NodeSharedTree(procId, nProcs, mpiCommWorld);
+    nodeSharedTree->publish(tree.n, tree.n_nodes, node_begend.x, node_begend.y,
+                            &nodeSizeInfo[0], &nodeCenterInfo[0], &multipole[0], &bodies[0]);
+    extractBoundaryGroups(&fullBoundaryTree[0], ownBoundaryCentres, ownBoundarySizes);
+  }
+
+#ifdef USE_PEER_PRUNING
+  //Processes that are too far away to open our tree, or the other way around
+  std::vector<char> peerIsFar;
+  {
+    const double tPrune = get_time();
+    findFarPeers(procId, nProcs, globalGrpTreeCntSize, globalGrpTreeOffsets,
+                 &nodeCenterInfo[0], &nodeSizeInfo[0], &multipole[0], peerIsFar);
+    parStats.tQuickCheck += get_time() - tPrune;
+  }
+#endif
+
   //Use multiple OpenMP threads in parallel to build and exchange LETs
 #pragma omp parallel
   {
     int tid      = omp_get_thread_num();
     int nthreads = omp_get_num_threads();
 
+    hostThreads.bindLETThread(tid);
+
     if(tid != 1) //Thread 0, does LET creation and GPU control, Thread == 1 does MPI communication, all others do LET creation
     {
       int DistanceCheck = 0;
@@ -3316,8 +4676,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           }
         }//tid == 0
 
-        #pragma omp critical
-          currentTicket = omp_ticket++; //Get a unique ticket to determine which process to build the LET for
+        currentTicket = __sync_fetch_and_add(&omp_ticket, 1); //Get a unique ticket to determine which process to build the LET for
 
         if(currentTicket >= (nProcs-1)) //Break out if we processed all nodes
           break;
@@ -3336,7 +4695,46 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
         real4 *grpSize   =  &globalGrpTreeCntSize[idx];
 
 
-        if(doQuickLETCheck) //Perform the quick-check tests
+        if(doQuickLETCheck && useNodeSharedLET && nodeSharedTree->isOnNode(ibox))
+        {
+          //Build the LET of the remote tree ourself, directly from its shared memory segment
+          const NodeSharedTree::Tree remoteTree = nodeSharedTree->getTree(ibox);
+
+          real4 *LETDataBuffer = NULL;
+          unsigned long long nflops;
+          const int3 nExport = getLET1(getLETBuffers[tid], &LETDataBuffer,
+                                       remoteTree.nodeCentre, remoteTree.nodeSize, remoteTree.multipole,
+                                       remoteTree.cellBeg, remoteTree.cellEnd,
+                                       remoteTree.bodies, remoteTree.n,
+                                       &ownBoundarySizes[0], &ownBoundaryCentres[0],
+                                       ownBoundarySizes.size(), remoteTree.nNodes, nflops);
+
+          LETDataBuffer[0].x = host_int_as_float(nExport.y);           //Number of particles in the LET
+          LETDataBuffer[0].y = host_int_as_float(nExport.x);           //Number of nodes     in the LET
+          LETDataBuffer[0].z = host_int_as_float(remoteTree.cellBeg);  //First node on the level that indicates the start of the tree walk
+          LETDataBuffer[0].w = host_int_as_float(remoteTree.cellEnd);  //last  node on the level that indicates the start of the tree walk
+
+          #pragma omp critical(updateReceivedProcessed)
+          {
+            treeBuffers[nReceived]       = LETDataBuffer;
+            treeBuffersSource[nReceived] = 3; //3 indicates node shared memory source
+            topNodeOnTheFlyCount        += (remoteTree.cellEnd-remoteTree.cellBeg);
+            nReceived++;
+          }
+
+          //Same as a used boundary with a valid quick LET, so the remote process
+          //does not send anything to us and we do not send anything to it
+          quickCheckSendSizes[ibox] = make_int4(1, 1, 0, 0);
+          resultOfQuickCheck [ibox] = 1;
+          communicationStatus[ibox] = 2;
+
+          #pragma omp critical
+          {
+            nNodeShared++;
+            nCompletedQuickCheck++;
+          }
+        }
+        else if(doQuickLETCheck) //Perform the quick-check tests
         {
             unsigned long long nflops;
 
@@ -3363,50 +4761,67 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             }
 #endif
 
-            //Build the tree we possibly have to send to the remote process
-            double bla3;
-            const int sizeTree=  getLEToptQuickFullTree(
-                                            quickCheckData[ibox],
-                                            getLETBuffers[tid],
-                                            NCELLMAX,
-                                            NDEPTHMAX,
-                                            &nodeCenterInfo[0],
-                                            &nodeSizeInfo[0],
-                                            &multipole[0],
-                                            0,                //Cellbeg
-                                            1,                //Cell end
-                                            &bodies[0],
-                                            tree.n,
-                                            grpSize2,         //size
-                                            grpCenter2,       //center
-                                            0,                //group begin
-                                            1,                //group end
-                                            tree.n_nodes,
-                                            procId, ibox,
-                                            nflops, bla3);
-
-
-            //Test if the boundary tree sent by the remote tree is sufficient for us
-            double tBoundaryCheck;
-            int depthSearch = 0;
-            const int resultTree = getLEToptQuickTreevsTree(
+            int sizeTree, resultTree, depthSearch = 0;
+#ifdef USE_PEER_PRUNING
+            if(peerIsFar[ibox])
+            {
+              //The roots do not open each other: the quick LET is our root cell and
+              //the remote boundary is sufficient for us, same as the walks would find
+              sizeTree    = 1 + 5*1;
+              resultTree  = 0;
+              depthSearch = 1;
+              __sync_fetch_and_add(&parStats.nQuickPruned, 1);
+            }
+            else
+#endif
+            {
+              //Build the tree we possibly have to send to the remote process
+              double bla3;
+              sizeTree=  getLEToptQuickFullTree(
+                                              quickCheckData[ibox],
                                               getLETBuffers[tid],
-                                              &grpCenter[1+nbody+nnode],    //cntr
-                                              &grpCenter[1+nbody],          //size
-                                              &grpCenter[1+nbody+nnode*2],  //multipole
-                                              0, 1,                         //Start at the root of remote boundary tree
-                                              &nodeSizeInfo[0],             //Local tree-sizes
-                                              &nodeCenterInfo[0],           //Local tree-centers
-                                              0, 1,                         //start at the root of local tree
-                                              nnode,
-                                              procId,
-                                              ibox,
-                                              tBoundaryCheck, depthSearch);
+                                              NCELLMAX,
+                                              NDEPTHMAX,
+                                              &nodeCenterInfo[0],
+                                              &nodeSizeInfo[0],
+                                              &multipole[0],
+                                              0,                //Cellbeg
+                                              1,                //Cell end
+                                              &bodies[0],
+                                              tree.n,
+                                              grpSize2,         //size
+                                              grpCenter2,       //center
+                                              0,                //group begin
+                                              1,                //group end
+                                              tree.n_nodes,
+                                              procId, ibox,
+                                              nflops, bla3);
+
+
+              //Test if the boundary tree sent by the remote tree is sufficient for us
+              double tBoundaryCheck;
+              resultTree = getLEToptQuickTreevsTree(
+                                                getLETBuffers[tid],
+                                                &grpCenter[1+nbody+nnode],    //cntr
+                                                &grpCenter[1+nbody],          //size
+                                                &grpCenter[1+nbody+nnode*2],  //multipole
+                                                0, 1,                         //Start at the root of remote boundary tree
+                                                &nodeSizeInfo[0],             //Local tree-sizes
+                                                &nodeCenterInfo[0],           //Local tree-centers
+                                                0, 1,                         //start at the root of local tree
+                                                nnode,
+                                                procId,
+                                                ibox,
+                                                tBoundaryCheck, depthSearch);
+              #pragma omp atomic
+                parStats.tQuickCheck += tBoundaryCheck;
+              __sync_fetch_and_add(&parStats.nQuickChecks, 1);
+            }
 
             if(resultTree == 0)
             {
               //We can use this tree to compute gravity, no further info needed of the remote domain
-              #pragma omp critical
+              #pragma omp critical(updateReceivedProcessed)
               {
                 //Add the boundary as a LET tree
                 treeBuffers[nReceived] = &grpCenter[0];
@@ -3473,138 +4888,276 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                                          mergeOwntree,  treeBuffersSource, treeBuffers);
         }//tid == 0
 
-        bool breakOutOfFullLoop = false;
-
-        int ibox          = 0;
-        int currentTicket = 0;
-
-        #pragma omp critical
-                currentTicket = omp_ticket2++; //Get a unique ticket to determine which process to build the LET for
-
-        if(currentTicket >= requiresFullLET.size())
+        LETTask task;
+        if(!letTaskQueues.pop(tid, task) && !letTaskQueues.steal(tid, task))
         {
-          //We processed the nodes we identified ourself using quickLET, next we
-          //continue with the LETs that we need to do after the A2A.
+          //No queued work, start the LET for the next remote process
+          bool breakOutOfFullLoop = false;
+          bool waitForA2A         = false;
 
-          while(1)
-          { //Wait till the A2a communication is complete
-            if(completedA2A == true)  break;
-            usleep(10);
-          }
+          int ibox          = -1;
+          int currentTicket = 0;
+          bool largeHint    = false;
 
+          currentTicket = __sync_fetch_and_add(&omp_ticket2, 1); //Get a unique ticket to determine which process to build the LET for
 
-          #pragma omp critical
-                  currentTicket = omp_ticket3++; //Get a unique ticket to determine which process to build the LET for
+          if(currentTicket >= requiresFullLET.size())
+          {
+            //We processed the nodes we identified ourself using quickLET, next we
+            //continue with the LETs that we need to do after the A2A. While the
+            //A2A is in progress we help other threads with their tasks
+            if(completedA2A == false)
+            {
+              waitForA2A = true;
+            }
+            else
+            {
+              currentTicket = __sync_fetch_and_add(&omp_ticket3, 1); //Get a unique ticket to determine which process to build the LET for
 
-          if(currentTicket >= idsThatNeedMoreThanBoundary.size())
-            breakOutOfFullLoop = true;
+              if(currentTicket >= idsThatNeedMoreThanBoundary.size())
+                breakOutOfFullLoop = true;
+              else
+                ibox = idsThatNeedMoreThanBoundary[currentTicket]; //From the A2A result list
+            }
+          }
           else
-            ibox = idsThatNeedMoreThanBoundary[currentTicket]; //From the A2A result list
-        }
-        else
-        {
-          ibox = requiresFullLET[currentTicket];             //From the quickTest result list
-        }
-
-        //Jump out of the LET creation while
-        if(breakOutOfFullLoop == true) break;
-
+          {
+            ibox      = requiresFullLET[currentTicket];             //From the quickTest result list
+            largeHint = true;                                       //QuickTest was too large
+          }
 
+          //Jump out of the LET creation while, once no other thread has queued tasks
+          if(breakOutOfFullLoop == true)
+          {
+            if(letTaskQueues.nQueued == 0) break;
+            usleep(10);
+            continue;
+          }
+          if(waitForA2A)
+          {
+            usleep(10);
+            continue;
+          }
 
-        //Group info for this process
-        int idx          =   globalGrpTreeOffsets[ibox];
-        real4 *grpCenter =  &globalGrpTreeCntSize[idx];
-        idx             += this->globalGrpTreeCount[ibox] / 2; //Divide by two to get halfway
-        real4 *grpSize   =  &globalGrpTreeCntSize[idx];
+          LETJob *job   = new LETJob;
+          job->ibox     = ibox;
+          job->cellBeg  = (int)node_begend.x;
+          job->cellEnd  = (int)node_begend.y;
+          job->nflops   = 0;
+          job->tStart   = get_time();
+
+          //Group info for this process
+          int idx          =   globalGrpTreeOffsets[ibox];
+          real4 *grpCenter =  &globalGrpTreeCntSize[idx];
+          idx             += this->globalGrpTreeCount[ibox] / 2; //Divide by two to get halfway
+          real4 *grpSize   =  &globalGrpTreeCntSize[idx];
+
+          //Start and endGrp, only used when not using a tree-structure for the groups
+          int startGrp = 0;
+          int endGrp   = this->globalGrpTreeCount[ibox] / 2;
+
+          //Extract the boundaries from the tree-structure
+          #ifdef USE_GROUP_TREE
+            std::vector<float4> &boundaryCentres = job->boundaryCentres;
+            std::vector<float4> &boundarySizes   = job->boundarySizes;
+
+            boundarySizes.reserve(endGrp);
+            boundaryCentres.reserve(endGrp);
+            extractBoundaryGroups(grpCenter, boundaryCentres, boundarySizes);
+
+            endGrp    = boundarySizes.size();
+            grpCenter = &boundaryCentres[0];
+            grpSize   = &boundarySizes  [0];
+          #endif
+
+          assert(startGrp == 0);
+          job->grpCenter  = grpCenter;
+          job->grpSize    = grpSize;
+          job->grpSizeRef = grpSize;
+          job->nGroups    = endGrp;
+          job->reuseCache = false;
+          job->storeCache = false;
+          job->margin     = 0;
+
+          //Split LETs that were expensive in the previous step over multiple tasks
+          job->nParts    = getLETJobParts(letCostPrevStep, ibox, largeHint, nthreads-1,
+                                          job->cellEnd-job->cellBeg);
+
+#ifdef USE_LET_REUSE
+          //If the tree is not rebuild, test if the node-set of the previous step is still valid
+          LETCache &cache = letCache[ibox];
+          if(cache.buildCount == tree.buildCount &&
+             cache.cellBeg == job->cellBeg && cache.cellEnd == job->cellEnd)
+          {
+            cache.stepsSinceWalk++;
+            const float drift = getLETCacheDrift(cache, grpCenter, grpSize, endGrp,
+                                                 &nodeCenterInfo[0], &multipole[0]);
+            if(drift >= 0)
+              cache.driftPerStep = std::max(drift / cache.stepsSinceWalk, 0.5f*cache.driftPerStep);
 
-        //Start and endGrp, only used when not using a tree-structure for the groups
-        int startGrp = 0;
-        int endGrp   = this->globalGrpTreeCount[ibox] / 2;
+            if(drift >= 0 && drift < cache.margin)
+            {
+              job->reuseCache = true;
+              job->nParts     = 1;
+            }
+            else
+            {
+              cache.buildCount = -1;
+            }
+          }
 
-        int countNodes = 0, countParticles = 0;
+          //Steps that a new walk can be reused before the tree is rebuild
+          const int stepsLeft = rebuild_tree_rate - 1 - (iter % rebuild_tree_rate);
+          if(!job->reuseCache && stepsLeft > 0)
+          {
+            //Enlarge the groups so the result stays valid for the coming steps
+            job->storeCache = true;
+            job->margin     = 1.5f*cache.driftPerStep*stepsLeft;
+            if(job->margin > 0)
+            {
+              job->enlargedSizes.assign(grpSize, grpSize + endGrp);
+              for(int i=0; i < endGrp; i++)
+              {
+                job->enlargedSizes[i].x += job->margin;
+                job->enlargedSizes[i].y += job->margin;
+                job->enlargedSizes[i].z += job->margin;
+              }
+              job->grpSize = &job->enlargedSizes[0];
+            }
+          }
+#endif
+          job->partsLeft = job->nParts;
+          if(job->nParts > 1)
+          {
+            job->partNodes.resize(job->nParts);
+            job->partPtcl.resize (job->nParts);
+            job->partDepth.resize(job->nParts);
+          }
 
-        double tz = get_time();
-        real4   *LETDataBuffer;
-        unsigned long long int nflops = 0;
+          //Queue the extra parts so other threads can steal them, we do the first one
+          for(int part=job->nParts-1; part > 0; part--)
+          {
+            LETTask extra = {job, part};
+            letTaskQueues.push(tid, extra);
+          }
+          task.job  = job;
+          task.part = 0;
+        }
 
-        double tStartEx = get_time();
+        LETJob *job = task.job;
+        const int ibox = job->ibox;
 
-        //Extract the boundaries from the tree-structure
-        #ifdef USE_GROUP_TREE
-          std::vector<float4> boundaryCentres;
-          std::vector<float4> boundarySizes;
+        real4   *LETDataBuffer = NULL;
+        int3     nExport;
 
-          boundarySizes.reserve(endGrp);
-          boundaryCentres.reserve(endGrp);
-          boundarySizes.clear();
-          boundaryCentres.clear();
+        //Node and particle lists of the LET, kept for the LET cache
+        std::vector<int2> *letNodes = &getLETBuffers[tid].LETBuffer_node;
+        std::vector<int > *letPtcl  = &getLETBuffers[tid].LETBuffer_ptcl;
 
-          int nbody = host_float_as_int(grpCenter[0].x);
-          int nnode = host_float_as_int(grpCenter[0].y);
+        if(job->reuseCache)
+        {
+#ifdef USE_LET_REUSE
+          letNodes = &letCache[ibox].nodes;
+          letPtcl  = &letCache[ibox].ptcl;
+          copyLETBuffer(&LETDataBuffer, *letNodes, *letPtcl,
+                        &nodeCenterInfo[0], &nodeSizeInfo[0], &multipole[0], &bodies[0]);
+          nExport  = make_int3(letNodes->size(), letPtcl->size(), letCache[ibox].depth);
+          #pragma omp atomic
+            nLETReused++;
+#endif
+        }
+        else if(job->nParts == 1)
+        {
+          unsigned long long nflops = 0;
+          nExport = getLET1(
+                            getLETBuffers[tid],
+                            &LETDataBuffer,
+                            &nodeCenterInfo[0],
+                            &nodeSizeInfo[0],
+                            &multipole[0],
+                            job->cellBeg, job->cellEnd,
+                            &bodies[0],
+                            tree.n,
+                            job->grpSize, job->grpCenter,
+                            job->nGroups,
+                            tree.n_nodes, nflops);
+          job->nflops = nflops;
+        }
+        else
+        {
+          getLET1Part(getLETBuffers[tid], *job, task.part,
+                      &nodeCenterInfo[0], &nodeSizeInfo[0], &multipole[0]);
+
+          //The last part to finish builds the LET buffer
+          if(__sync_sub_and_fetch(&job->partsLeft, 1) != 0)
+            continue;
+
+          const int depth = mergeLETParts(*job, *letNodes, *letPtcl,
+                                          &nodeCenterInfo[0], &nodeSizeInfo[0]);
+          copyLETBuffer(&LETDataBuffer, *letNodes, *letPtcl,
+                        &nodeCenterInfo[0], &nodeSizeInfo[0], &multipole[0], &bodies[0]);
+          nExport = make_int3(letNodes->size(), letPtcl->size(), depth);
+        }
 
-          grpSize   = &grpCenter[1+nbody];
-          grpCenter = &grpCenter[1+nbody+nnode];
+#ifdef USE_LET_REUSE
+        if(job->storeCache)
+          storeLETCache(letCache[ibox], *job, *letNodes, *letPtcl, nExport.z,
+                        tree.buildCount, &nodeCenterInfo[0], &multipole[0]);
+#endif
 
-          for(int startSearch=0; startSearch < nnode; startSearch++)
-          {
-            //Two tests, if its a  leaf, and/or if its a node and marked as end-point
-            if((host_float_as_int(grpSize[startSearch].w) == 0xFFFFFFFF) || grpCenter[startSearch].w <= 0) //Tree extract
-            {
-              boundarySizes.push_back  (grpSize  [startSearch]);
-              boundaryCentres.push_back(grpCenter[startSearch]);
-            }
-          }//end for
-
-          endGrp    = boundarySizes.size();
-          grpCenter = &boundaryCentres[0];
-          grpSize   = &boundarySizes  [0];
-        #endif
-
-        double tEndEx = get_time();
-
-        int2 usedStartEndNode = {(int)node_begend.x, (int)node_begend.y};
-
-        assert(startGrp == 0);
-        int3  nExport = getLET1(
-                                getLETBuffers[tid],
-                                &LETDataBuffer,
-                                &nodeCenterInfo[0],
-                                &nodeSizeInfo[0],
-                                &multipole[0],
-                                usedStartEndNode.x, usedStartEndNode.y,
-                                &bodies[0],
-                                tree.n,
-                                grpSize, grpCenter,
-                                endGrp,
-                                tree.n_nodes, nflops);
-
-        countParticles  = nExport.y;
-        countNodes      = nExport.x;
+        int countParticles  = nExport.y;
+        int countNodes      = nExport.x;
         int bufferSize  = 1 + 1*countParticles + 5*countNodes;
         //Use count of exported particles and nodes, but let particles count more heavy.
         //Used during particle exchange / domain update to speedup particle-box assignment
 //        this->fullGrpAndLETRequestStatistics[ibox] = make_uint2(countParticles*10 + countNodes, ibox);
+        letCostPrevStep[ibox] = countParticles + countNodes;
         if (ENABLE_RUNTIME_LOG)
         {
-          fprintf(stderr,"Proc: %d LET getLetOp count&fill [%d,%d]: Depth: %d Dest: %d Total : %lg (#P: %d \t#N: %d) nNodes= %d  nGroups= %d \tsince start: %lg \n",
-                          procId, procId, tid, nExport.z, ibox, get_time()-tz,countParticles,
-                          countNodes, tree.n_nodes, endGrp, get_time()-t0);
+          fprintf(stderr,"Proc: %d LET getLetOp count&fill [%d,%d]: Depth: %d Dest: %d Total : %lg (#P: %d \t#N: %d) nNodes= %d  nGroups= %d nParts= %d \tsince start: %lg \n",
+                          procId, procId, tid, nExport.z, ibox, get_time()-job->tStart,countParticles,
+                          countNodes, tree.n_nodes, job->nGroups, job->nParts, get_time()-t0);
         }
 
         //Set the tree properties, before we exchange the data
         LETDataBuffer[0].x = host_int_as_float(countParticles);         //Number of particles in the LET
         LETDataBuffer[0].y = host_int_as_float(countNodes);             //Number of nodes     in the LET
-        LETDataBuffer[0].z = host_int_as_float(usedStartEndNode.x);     //First node on the level that indicates the start of the tree walk
-        LETDataBuffer[0].w = host_int_as_float(usedStartEndNode.y);     //last  node on the level that indicates the start of the tree walk
+        LETDataBuffer[0].z = host_int_as_float(job->cellBeg);           //First node on the level that indicates the start of the tree walk
+        LETDataBuffer[0].w = host_int_as_float(job->cellEnd);           //last  node on the level that indicates the start of the tree walk
 
-        //In a critical section to prevent multiple threads writing to the same location
-        #pragma omp critical
+        delete job;
+
+        //Compress the LET while the MPI thread is sending the previous ones
+        int letSize = sizeof(real4)*bufferSize;
+        int letTag  = 999;
+        if(letCodecBits > 0)
         {
-          computedLETs[nComputedLETs].buffer      = LETDataBuffer;
-          computedLETs[nComputedLETs].destination = ibox;
-          computedLETs[nComputedLETs].size        = sizeof(real4)*bufferSize;
-          nComputedLETs++;
+          char *encoded = (char*)letBufferPool->get(LETCodec::maxEncodedSize(4*bufferSize));
+          const int encodedSize = (int)LETCodec::encode((float*)LETDataBuffer, 4*bufferSize,
+                                                        letCodecBits, encoded);
+          if(encodedSize < letSize)
+          {
+            letBufferPool->release(LETDataBuffer);
+            LETDataBuffer = (real4*)encoded;
+            letSize       = encodedSize;
+            letTag        = 998;
+          }
+          else
+            letBufferPool->release(encoded);
         }
+        __sync_fetch_and_add(&letBytesRaw,  (unsigned long long)sizeof(real4)*bufferSize);
+        __sync_fetch_and_add(&letBytesSent, (unsigned long long)letSize);
+        __sync_fetch_and_add(&parStats.nLETs, 1);
+        __sync_fetch_and_add(&parStats.nLETNodes, countNodes);
+
+        //Hand the LET to the MPI thread, which sends it out as soon as it pops it.
+        //The queue holds nProcs entries so the push can not fail
+        letObject computed;
+        computed.buffer      = LETDataBuffer;
+        computed.destination = ibox;
+        computed.size        = letSize;
+        computed.tag         = letTag;
+        while(!readyLETs.push(computed)) {}
 
         if(tid == 0)
         {
@@ -3631,6 +5184,8 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           if(nReceived == nProcs-1)       startGrav = true;
           //Only start if there actually is new data
           if((nReceived - procTrees) > 0) startGrav = true;
+          //Or a merged batch waits for the GPU
+          if(letStagedSize > 0)           startGrav = true;
 
           if(startGrav) //Only start if there is new data
           {
@@ -3643,6 +5198,8 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
             usleep(10);
           }//if startGrav
         }//while 1
+
+        launchStagedLET(); //The last batch, if it is still waiting
       }//if tid==0
 
     }//if tid != 1
@@ -3655,6 +5212,7 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       {
         if(nCompletedQuickCheck == nProcs-1)
           break;
+        progressAsyncDomainUpdate();
         usleep(10);
       }
 
@@ -3667,7 +5225,17 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       //Send the sizes
       LOGF(stderr, "Going to do the alltoall size communication! Iter: %d Since begin: %lg \n", iter, get_time()-tStart);
       double t100 = get_time();
-      MPI_Alltoall(quickCheckSendSizes, 4, MPI_INT, quickCheckRecvSizes, 4, MPI_INT, mpiCommWorld);
+      if(useNeighbourComm)
+      {
+        //Pairs that used each others boundary and have a valid quick LET do not exchange anything
+        if(!letNeighbours) letNeighbours = new NeighbourComm(procId, nProcs, mpiCommWorld);
+        const int4 usedBoundary = {1, 1, 0, 0};
+        letNeighbours->alltoall((int*)quickCheckSendSizes, (int*)quickCheckRecvSizes, 4, (int*)&usedBoundary,
+                                [](const int *size) { return size[1] == 1 && size[0] != 0; });
+      }
+      else
+        MPI_Alltoall(quickCheckSendSizes, 4, MPI_INT, quickCheckRecvSizes, 4, MPI_INT, mpiCommWorld);
+      if (commMatrix) commMatrix->collective(CommMatrix::LET, 4*nProcs*sizeof(int), get_time()-t100);
       LOGF(stderr, "Completed_alltoall size communication! Iter: %d Took: %lg ( %lg )\n", iter, get_time()-t100, get_time()-t0);
 
       //If quickCheckRecvSizes[].y == 1 then the remote process used the boundary.
@@ -3746,59 +5314,109 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
                     nQuickCheckReceives, nReceived, topNodeOnTheFlyCount,
                     nQuickCheckRealSends, nQuickCheckRealSends+nQuickBoundaryOk,nBoundaryOk);
 
+      //Hand the expected LETs to the progress thread, they arrive without us entering MPI
+      if(letProgress) letProgress->receive(mpiCommWorld, expectedLETCount, allocLETRecvBuffer);
+
       tStartsStartGetLETSend = get_time();
       while(1)
       {
         bool sleepAtTheEnd = true;  //Will be set to false if we did anything in here. If true we wait a bit
 
         //Send out individual LETs that are computed and ready to be send
-        int tempComputed = nComputedLETs;
-
-        if(tempComputed > nSendOut)
+        letObject ready;
+        while(readyLETs.pop(ready))
         {
           sleepAtTheEnd = false;
-          for(int i=nSendOut; i < tempComputed; i++)
+          const int i     = nSendOut++;
+          computedLETs[i] = ready;
+          MPI_Isend(&(computedLETs[i].buffer)[0],computedLETs[i].size,
+              MPI_BYTE, computedLETs[i].destination, computedLETs[i].tag,
+              mpiCommWorld, &(computedLETs[i].req));
+          if (commMatrix) commMatrix->send(CommMatrix::LET, computedLETs[i].destination, computedLETs[i].size);
+          if (letProgress)
           {
-            MPI_Isend(&(computedLETs[i].buffer)[0],computedLETs[i].size,
-                MPI_BYTE, computedLETs[i].destination, 999,
-                mpiCommWorld, &(computedLETs[i].req));
+            //The progress thread owns the request and buffer now, the buffer
+            //is released once the completion is polled
+            letProgress->submit(computedLETs[i].req, computedLETs[i].buffer, computedLETs[i].destination);
+            computedLETs[i].req    = MPI_REQUEST_NULL;
+            computedLETs[i].buffer = NULL;
           }
-          nSendOut = tempComputed;
         }
 
-        //Receiving
+        //Receiving, the progress thread matches and completes the receives when it
+        //runs, otherwise we probe for them here
         MPI_Status probeStatus;
         MPI_Status recvStatus;
         int flag  = 0;
 
         do
         {
-          MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, mpiCommWorld, &flag, &probeStatus);
+          real4 *recvDataBuffer = NULL;
+          int    recvSource     = -1;
+          int    recvTag        = -1;
+          int    count          = 0;
+          double tY = get_time(), tZ = tY;
+
+          if(letProgress)
+          {
+            MPIProgress::Completion recvd;
+            flag = letProgress->pollReceived(recvd);
+            if(flag)
+            {
+              recvDataBuffer = (real4*)recvd.user;
+              recvSource     = recvd.source;
+              recvTag        = recvd.tag;
+              count          = recvd.count;
+            }
+          }
+          else
+          {
+            MPI_Iprobe(MPI_ANY_SOURCE, MPI_ANY_TAG, mpiCommWorld, &flag, &probeStatus);
+            if(flag)
+            {
+              MPI_Get_count(&probeStatus, MPI_BYTE, &count);
+              recvDataBuffer = (real4*)allocLETRecvBuffer(count);
+              tZ = get_time();
+              MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, mpiCommWorld,&recvStatus);
+              recvSource = recvStatus.MPI_SOURCE;
+              recvTag    = probeStatus.MPI_TAG;
+            }
+          }
 
           if(flag)
           {
             sleepAtTheEnd = false;  //We do something here
-            int count;
-            MPI_Get_count(&probeStatus, MPI_BYTE, &count);
-
-            double tY = get_time();
-            real4 *recvDataBuffer = new real4[count / sizeof(real4)];
-            double tZ = get_time();
-            MPI_Recv(&recvDataBuffer[0], count, MPI_BYTE, probeStatus.MPI_SOURCE, probeStatus.MPI_TAG, mpiCommWorld,&recvStatus);
+            if (commMatrix)
+            {
+              //Wait is the time since the start of the send/receive loop
+              commMatrix->recv(CommMatrix::LET, recvSource, count);
+              commMatrix->wait(CommMatrix::LET, recvSource, get_time()-tStartsStartGetLETSend);
+            }
 
             LOGF(stderr, "Receive complete from: %d  || recvTree: %d since start: %lg ( %lg ) alloc: %lg Recv: %lg Size: %d\n",
-                          recvStatus.MPI_SOURCE, 0, get_time()-tStart,get_time()-t0,tZ-tY, get_time()-tZ, count);
+                          recvSource, 0, get_time()-tStart,get_time()-t0,tZ-tY, get_time()-tZ, count);
+
+            if(recvTag == 998)
+            {
+              //Compressed LET, decode it into a regular LET buffer
+              const int nFloats   = LETCodec::decodedSize((char*)recvDataBuffer);
+              assert(nFloats > 0);
+              real4 *decoded      = letBufferPool->get<real4>(nFloats / 4);
+              LETCodec::decode((char*)recvDataBuffer, (float*)decoded);
+              letBufferPool->release(recvDataBuffer);
+              recvDataBuffer      = decoded;
+            }
 
             receivedLETCount++;
 
 //            this->fullGrpAndLETRequestStatistics[probeStatus.MPI_SOURCE] = make_uint2(0, 0);
 
-            if( communicationStatus[probeStatus.MPI_SOURCE] == 2)
+            if( communicationStatus[recvSource] == 2)
             {
               //We already used the boundary for this remote process, so don't use the custom tree
-              delete[] recvDataBuffer;
+              letBufferPool->release(recvDataBuffer);
 
-              fprintf(stderr,"Proc: %d , Iter: %d we received UNNEEDED LET data from proc: %d \n", procId,iter,probeStatus.MPI_SOURCE );
+              fprintf(stderr,"Proc: %d , Iter: %d we received UNNEEDED LET data from proc: %d \n", procId,iter,recvSource );
             }
             else
             {
@@ -3843,11 +5461,14 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
           if(computedLETs[i].buffer != NULL) MPI_Test(&(computedLETs[i].req), &testFlag, &waitStatus);
           if (testFlag)
           {
-            free(computedLETs[i].buffer);
+            letBufferPool->release(computedLETs[i].buffer);
             computedLETs[i].buffer = NULL;
             testFlag               = 0;
           }
         }//end for nSendOut
+        freeCompletedLETSends();
+
+        progressAsyncDomainUpdate();  //The domain search of the next update runs in the background
 
         if(sleepAtTheEnd)   usleep(10); //Only sleep when we did not send or receive anything
       } //while (1) surrounding the thread-id==1 code
@@ -3858,8 +5479,10 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
       {
         if(computedLETs[i].buffer)
         {
+          const double tW = get_time();
           MPI_Wait(&(computedLETs[i].req), &waitStatus);
-          free(computedLETs[i].buffer);
+          if (commMatrix) commMatrix->wait(CommMatrix::LET, computedLETs[i].destination, get_time()-tW);
+          letBufferPool->release(computedLETs[i].buffer);
           computedLETs[i].buffer = NULL;
         }
       }//for i < nSendOut
@@ -3870,9 +5493,10 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 #if 1 //Moved freeing of memory to here for ha-pacs workaround
   for(int i=0; i < nProcs-1; i++)
   {
-    if(treeBuffersSource[i] == 0) //Check if its a point to point source
+    //Point to point source or build from node shared memory, return the buffer to the pool
+    if(treeBuffersSource[i] == 0 || treeBuffersSource[i] == 3)
     {
-      delete[] treeBuffers[i];    //Free the memory of this part of the LET
+      letBufferPool->release(treeBuffers[i]);
       treeBuffers[i] = NULL;
     }
   }
@@ -3880,15 +5504,19 @@ void octree::essential_tree_exchangeV2(tree_structure &tree,
 
   char buff5[1024];
   sprintf(buff5,"LETTIME-%d: tInitLETEx: %lg tQuickCheck: %lg tQuickCheckWait: %lg tGetLET: %lg \
-tAlltoAll: %lg tGetLETSend: %lg tTotal: %lg mbSize-a2a: %f nA2AQsend: %d nA2AQrecv: %d nBoundRemote: %d nBoundLocal: %d\n",
+tAlltoAll: %lg tGetLETSend: %lg tTotal: %lg mbSize-a2a: %f nA2AQsend: %d nA2AQrecv: %d nBoundRemote: %d nBoundLocal: %d nLETReused: %d mbLETRaw: %f mbLETSent: %f nNeighbours: %d nNodeShared: %d\n",
      procId,
      tStatsStartUpEnd-tStatsStartUpStart, tStatsEndQuickCheck-tStatsStartUpEnd,
      tStatsEndWaitOnQuickCheck-tStatsStartUpEnd, tStatsEndGetLET-tStatsEndQuickCheck,
      tStatsEndAlltoAll-tStatsStartAlltoAll, tStartsEndGetLETSend-tStartsStartGetLETSend,
      get_time()-tStatsStartUpStart,
-     ZA1, nQuickCheckRealSends, nQuickCheckReceives, nQuickBoundaryOk, nBoundaryOk);
+     ZA1, nQuickCheckRealSends, nQuickCheckReceives, nQuickBoundaryOk, nBoundaryOk, nLETReused,
+     letBytesRaw / (1024*1024.), letBytesSent / (1024*1024.),
+     letNeighbours ? letNeighbours->nNeighbours() : nProcs-1, nNodeShared);
      //ZA1, nQuickCheckSends, nQuickRecv, nBoundaryOk);
    devContext->writeLogEvent(buff5); //TODO DELETE
+   parStats.tLET     += get_time() - t0;
+   parStats.bytesLET += letBytesSent;
 
 //  if(recvAllToAllBuffer) delete[] recvAllToAllBuffer;
   delete[] treeBuffersSource;
@@ -4004,6 +5632,8 @@ void octree::mergeAndLaunchLETStructures(
     //   otherwise we would make no progress
 
     int localLimit   =  tree.n            + 5*tree.n_nodes;
+    if(letStreamMB > 0)
+      localLimit     =  (int)((letStreamMB*1024LL*1024LL)/sizeof(real4));
     int currentCount =  nParticlesCounted + 5*nNodesCounted;
 
     if(currentCount > localLimit)
@@ -4351,13 +5981,13 @@ void octree::mergeAndLaunchLETStructures(
       combinedRemoteTree[j].w =  host_int_as_float(child);      //Store the modified value
     }//for non-top nodes
 
-#if 0 //Ha-pacs fix
-    if(treeBuffersSource[i+procTrees] == 0) //Check if its a point to point source
+    //When streaming the LET is no longer needed once it is merged, return it to the pool
+    //right away so only the LETs that wait for a batch are kept in host memory
+    if(letStreamMB > 0 && (treeBuffersSource[i+procTrees] == 0 || treeBuffersSource[i+procTrees] == 3))
     {
-      delete[] treeBuffers[i+procTrees];    //Free the memory of this part of the LET
+      letBufferPool->release(treeBuffers[i+procTrees]);    //Free the memory of this part of the LET
       treeBuffers[i+procTrees] = NULL;
     }
-#endif
 
 
   } //for PROCS
@@ -4432,7 +6062,15 @@ void octree::mergeAndLaunchLETStructures(
   //only done during the last approximate_gravity_let call
   bool doActivePart = (procTrees == mpiGetNProcs() -1);
 
-  approximate_gravity_let(this->localTree, this->remoteTree, bufferSize, doActivePart);
+  parStats.nLETBatches++;
+  if(letStreamMB > 0)
+  {
+    //Walked by launchStagedLET once the GPU is free
+    letStagedSize   = bufferSize;
+    letStagedActive = doActivePart;
+  }
+  else
+    approximate_gravity_let(this->localTree, this->remoteTree, bufferSize, doActivePart);
 
   double t4 = get_time();
   //Statistics about the tree-merging
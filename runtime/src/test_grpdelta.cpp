@@ -0,0 +1,130 @@
+/*
+ * Test of the delta encoding of the group trees in GroupTreeDelta.h
+ *
+ * ./test_grpdelta [tolerance] [steps]
+ *
+ * A synthetic group tree drifts a little every step and is send as deltas
+ * without a full refresh. After every step the boxes the receiver decoded have
+ * to contain the current boxes, and the decoded opening radius has to cover the
+ * current one plus the displacement of the centre of mass, otherwise the LET
+ * opening test and the quick boundary check on the receiving side are not
+ * conservative.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <cuda_runtime.h>
+#include "node_specs.h"
+#include "GroupTreeDelta.h"
+
+static float uniform(const float lo, const float hi)
+{
+  return lo + (hi - lo)*(float)drand48();
+}
+
+int main(int argc, char *argv[])
+{
+  const float tolerance = (argc > 1) ? atof(argv[1]) : 0.05f;
+  const int   nSteps    = (argc > 2) ? atoi(argv[2]) : 40;
+
+  //Internal nodes, end-point leaves and single child leaves
+  const int nInternal = 16, nEndPoint = 96, nSingle = 16;
+  const int nnode     = nInternal + nEndPoint + nSingle;
+  const int nbody     = nSingle;
+
+  std::vector<real4> tree(1 + nbody + 5*nnode);
+  tree[0] = make_float4(GroupTreeDelta::asFloat(nbody), GroupTreeDelta::asFloat(nnode),
+                        GroupTreeDelta::asFloat(0),     GroupTreeDelta::asFloat(1));
+  real4 *body = &tree[1];
+  real4 *size = &tree[1 + nbody];
+  real4 *cntr = &tree[1 + nbody + nnode];
+  real4 *mult = &tree[1 + nbody + 2*nnode];
+
+  srand48(7);
+  std::vector<float> speed(nnode);  //Drift per step relative to the allowed drift
+  for(int i=0; i < nnode; i++)
+  {
+    const bool  single = i >= nInternal + nEndPoint;
+    const float l      = (i < nInternal) ? uniform(1, 4) : uniform(0.1f, 1);
+    const float h      = single ? 0 : l;
+    size[i] = make_float4(h, h*uniform(0.5f, 1), h*uniform(0.5f, 1), 0);
+    if(i < nInternal)        size[i].w = GroupTreeDelta::asFloat(nInternal + i);
+    else if(!single)         size[i].w = GroupTreeDelta::asFloat(0xFFFFFFFF);
+    else                     size[i].w = GroupTreeDelta::asFloat(i - nInternal - nEndPoint);
+    const float r = 2*l;
+    cntr[i] = make_float4(uniform(-100, 100), uniform(-100, 100), uniform(-100, 100), (i < nInternal) ? r*r : -r*r);
+    mult[3*i+0] = make_float4(cntr[i].x + uniform(-h, h), cntr[i].y, cntr[i].z, uniform(1, 2));
+    mult[3*i+1] = make_float4(0.1f, 0.1f, 0.1f, 0);
+    mult[3*i+2] = make_float4(0.1f, 0.1f, 0.1f, 0);
+    speed[i]    = (i % 8 == 0) ? 0.8f : 0.15f;
+  }
+  for(int i=0; i < nbody; i++)
+    body[i] = make_float4(cntr[nInternal + nEndPoint + i].x, cntr[nInternal + nEndPoint + i].y,
+                          cntr[nInternal + nEndPoint + i].z, 1);
+
+  GroupTreeDelta sender(2, tolerance, 0), receiver(2, tolerance, 0);
+
+  int nFailed = 0;
+  for(int step=0; step < nSteps; step++)
+  {
+    if(step > 0)
+    {
+      const float lmin = GroupTreeDelta::smallestNode(tree);
+      for(int i=0; i < nnode; i++)
+      {
+        const bool  hasSize = GroupTreeDelta::hasSize(size[i], cntr[i]);
+        const float l       = hasSize ? std::max(size[i].x, std::max(size[i].y, size[i].z)) : lmin;
+        const float d       = speed[i]*tolerance*l;
+        cntr[i].x    += uniform(-d, d);
+        cntr[i].y    += uniform(-d, d);
+        cntr[i].z    += uniform(-d, d);
+        cntr[i].w    *= 1 + uniform(-0.5f, 0.5f)*speed[i]*tolerance;
+        mult[3*i].x  += uniform(-d, d);
+        mult[3*i].y  += uniform(-d, d);
+        mult[3*i].z  += uniform(-d, d);
+        if(hasSize)
+        {
+          size[i].x = std::max(0.01f, size[i].x + uniform(-d, d));
+          size[i].y = std::max(0.01f, size[i].y + uniform(-d, d));
+          size[i].z = std::max(0.01f, size[i].z + uniform(-d, d));
+        }
+      }
+    }
+
+    const std::vector<real4> &msg     = sender.encode(tree, step);
+    const std::vector<real4> &decoded = receiver.decode(0, &msg[0], msg.size());
+
+    const real4 *dSize = &decoded[1 + nbody];
+    const real4 *dCntr = &decoded[1 + nbody + nnode];
+    const real4 *dMult = &decoded[1 + nbody + 2*nnode];
+    for(int i=0; i < nnode; i++)
+    {
+      bool ok = true;
+      if(GroupTreeDelta::hasSize(size[i], cntr[i]))
+      {
+        ok &= dCntr[i].x - dSize[i].x <= cntr[i].x - size[i].x && cntr[i].x + size[i].x <= dCntr[i].x + dSize[i].x;
+        ok &= dCntr[i].y - dSize[i].y <= cntr[i].y - size[i].y && cntr[i].y + size[i].y <= dCntr[i].y + dSize[i].y;
+        ok &= dCntr[i].z - dSize[i].z <= cntr[i].z - size[i].z && cntr[i].z + size[i].z <= dCntr[i].z + dSize[i].z;
+      }
+      const float dx = mult[3*i].x - dMult[3*i].x;
+      const float dy = mult[3*i].y - dMult[3*i].y;
+      const float dz = mult[3*i].z - dMult[3*i].z;
+      ok &= sqrtf(fabsf(cntr[i].w)) + sqrtf(dx*dx + dy*dy + dz*dz) <= sqrtf(fabsf(dCntr[i].w));
+      ok &= (cntr[i].w > 0) == (dCntr[i].w > 0);
+      if(!ok)
+      {
+        if(nFailed < 10)
+          fprintf(stderr, "step %d node %d: the decoded box or opening radius does not cover the current one\n", step, i);
+        nFailed++;
+      }
+    }
+  }
+
+  fprintf(stderr, "tolerance: %g steps: %d full: %d delta: %d failed: %d\n",
+          tolerance, nSteps, sender.nFull, sender.nDelta, nFailed);
+
+  const bool passed = nFailed == 0 && sender.nFull == 1 && sender.nDelta == nSteps-1;
+  fprintf(stderr, "%s\n", passed ? "PASSED" : "FAILED");
+  return passed ? 0 : 1;
+}